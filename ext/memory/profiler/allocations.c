@@ -5,6 +5,7 @@
 #include "events.h"
 #include <ruby/debug.h>
 #include <stdio.h>
+#include <string.h>
 
 static VALUE Memory_Profiler_Allocations = Qnil;
 
@@ -12,11 +13,15 @@ static void Memory_Profiler_Allocations_mark(void *ptr) {
 	struct Memory_Profiler_Capture_Allocations *record = ptr;
 	
 	rb_gc_mark_movable(record->callback);
+	rb_gc_mark_movable(record->name);
+	rb_gc_mark_movable(record->batch);
+	rb_gc_mark_movable(record->batch_objects);
 }
 
 static void Memory_Profiler_Allocations_free(void *ptr) {
 	struct Memory_Profiler_Capture_Allocations *record = ptr;
 	
+	Memory_Profiler_Call_Tree_free(record->call_tree);
 	xfree(record);
 }
 
@@ -24,6 +29,9 @@ static void Memory_Profiler_Allocations_compact(void *ptr) {
 	struct Memory_Profiler_Capture_Allocations *record = ptr;
 	
 	record->callback = rb_gc_location(record->callback);
+	record->name = rb_gc_location(record->name);
+	record->batch = rb_gc_location(record->batch);
+	record->batch_objects = rb_gc_location(record->batch_objects);
 }
 
 static const rb_data_type_t Memory_Profiler_Allocations_type = {
@@ -46,6 +54,36 @@ struct Memory_Profiler_Capture_Allocations* Memory_Profiler_Allocations_get(VALU
 	return record;
 }
 
+void Memory_Profiler_Allocations_initialize(struct Memory_Profiler_Capture_Allocations *record) {
+	record->callback = Qnil;
+	record->name = Qnil;
+	record->batched = 0;
+	record->batch = Qnil;
+	record->batch_objects = Qnil;
+	record->depth = 0;
+	record->call_tree = NULL;
+	record->new_count = 0;
+	record->free_count = 0;
+	memset(record->lifetimes, 0, sizeof(record->lifetimes));
+}
+
+int Memory_Profiler_Allocations_batch_push(VALUE allocations, VALUE klass, VALUE kind, VALUE data, VALUE object) {
+	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
+	int empty = NIL_P(record->batch);
+	
+	if (empty) {
+		RB_OBJ_WRITE(allocations, &record->batch, rb_ary_new());
+		RB_OBJ_WRITE(allocations, &record->batch_objects, rb_ary_new());
+	}
+	
+	rb_ary_push(record->batch, klass);
+	rb_ary_push(record->batch, kind);
+	rb_ary_push(record->batch, data);
+	rb_ary_push(record->batch_objects, object);
+	
+	return empty;
+}
+
 static VALUE Memory_Profiler_Allocations_new_count(VALUE self) {
 	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(self);
 	return SIZET2NUM(record->new_count);
@@ -56,13 +94,34 @@ static VALUE Memory_Profiler_Allocations_free_count(VALUE self) {
 	return SIZET2NUM(record->free_count);
 }
 
+VALUE Memory_Profiler_Histogram_array(const size_t *counts) {
+	size_t size = MEMORY_PROFILER_HISTOGRAM_SIZE;
+	while (size > 0 && counts[size - 1] == 0) size--;
+	
+	VALUE histogram = rb_ary_new_capa(size);
+	
+	for (size_t index = 0; index < size; index++) {
+		rb_ary_push(histogram, SIZET2NUM(counts[index]));
+	}
+	
+	return histogram;
+}
+
+// Allocations#lifetime_histogram
+// The lifetimes of freed objects, in garbage collections: element i counts objects that were freed after 2**(i-1) to 2**i - 1 GCs had started since their allocation (so element 1 counts objects freed by the first GC). Trailing empty buckets are omitted.
+static VALUE Memory_Profiler_Allocations_lifetime_histogram(VALUE self) {
+	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(self);
+	
+	return Memory_Profiler_Histogram_array(record->lifetimes);
+}
+
 // Allocations#retained_count
 static VALUE Memory_Profiler_Allocations_retained_count(VALUE self) {
 	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(self);
 	
 	// Handle underflow when free_count > new_count:
 	size_t retained = record->free_count > record->new_count ? 0 : record->new_count - record->free_count;
-
+	
 	return SIZET2NUM(retained);
 }
 
@@ -73,6 +132,22 @@ static VALUE Memory_Profiler_Allocations_track(int argc, VALUE *argv, VALUE self
 	rb_scan_args(argc, argv, "&", &callback);
 	
 	RB_OBJ_WRITE(self, &record->callback, callback);
+	record->batched = 0;
+	
+	return self;
+}
+
+// Allocations#track_batch { |events| ... }
+// The callback is invoked once per drain of the event queue, with events as a flat array [klass, kind, data, ...] (data is nil for :newobj).
+// It may return an array with one value per event, the values for :newobj events are stored and passed back as the data of their :freeobj events.
+static VALUE Memory_Profiler_Allocations_track_batch(int argc, VALUE *argv, VALUE self) {
+	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(self);
+	
+	VALUE callback;
+	rb_scan_args(argc, argv, "&", &callback);
+	
+	RB_OBJ_WRITE(self, &record->callback, callback);
+	record->batched = 1;
 	
 	return self;
 }
@@ -81,14 +156,21 @@ void Memory_Profiler_Allocations_clear(VALUE allocations) {
 	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
 	record->new_count = 0;
 	record->free_count = 0;
+	memset(record->lifetimes, 0, sizeof(record->lifetimes));
 	RB_OBJ_WRITE(allocations, &record->callback, Qnil);
+	record->batched = 0;
+	record->batch = Qnil;
+	record->batch_objects = Qnil;
+	record->depth = 0;
+	
+	if (record->call_tree) {
+		Memory_Profiler_Call_Tree_clear(record->call_tree);
+	}
 }
 
 static VALUE Memory_Profiler_Allocations_allocate(VALUE klass) {
 	struct Memory_Profiler_Capture_Allocations *record = ALLOC(struct Memory_Profiler_Capture_Allocations);
-	record->callback = Qnil;
-	record->new_count = 0;
-	record->free_count = 0;
+	Memory_Profiler_Allocations_initialize(record);
 	
 	return Memory_Profiler_Allocations_wrap(record);
 }
@@ -104,5 +186,7 @@ void Init_Memory_Profiler_Allocations(VALUE Memory_Profiler)
 	rb_define_method(Memory_Profiler_Allocations, "new_count", Memory_Profiler_Allocations_new_count, 0);
 	rb_define_method(Memory_Profiler_Allocations, "free_count", Memory_Profiler_Allocations_free_count, 0);
 	rb_define_method(Memory_Profiler_Allocations, "retained_count", Memory_Profiler_Allocations_retained_count, 0);
+	rb_define_method(Memory_Profiler_Allocations, "lifetime_histogram", Memory_Profiler_Allocations_lifetime_histogram, 0);
 	rb_define_method(Memory_Profiler_Allocations, "track", Memory_Profiler_Allocations_track, -1);
+	rb_define_method(Memory_Profiler_Allocations, "track_batch", Memory_Profiler_Allocations_track_batch, -1);
 }
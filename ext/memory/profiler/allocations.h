@@ -6,16 +6,47 @@
 #include <ruby.h>
 #include <ruby/st.h>
 
+#include "call_tree.h"
+
+enum {
+	// Number of buckets in a log2 histogram of 32-bit values: 0, and one per power of two.
+	MEMORY_PROFILER_HISTOGRAM_SIZE = 33,
+};
+
+// Get the bucket of a value in a log2 histogram: 0 for 0, and i for 2**(i-1) to 2**i - 1.
+static inline size_t Memory_Profiler_Histogram_bucket(uint32_t value) {
+	return value ? 32 - __builtin_clz(value) : 0;
+}
+
 // Per-class allocation tracking record:
 struct Memory_Profiler_Capture_Allocations {
 	// Optional Ruby proc/lambda to call on allocation.
 	VALUE callback;
-
+	
+	// The name the counts are folded under if the class is freed (see Capture#folded), or nil.
+	VALUE name;
+	
+	// Whether the callback receives all events of a drain in one batch (see Allocations#track_batch).
+	int batched;
+	
+	// The pending batch as a flat array [klass, kind, data, ...] (nil if empty), and the object of each NEWOBJ event (nil for FREEOBJ), which are retained until the batch is flushed.
+	VALUE batch;
+	VALUE batch_objects;
+	
+	// Number of frames to capture natively for each allocation (0 = none, see Capture#track).
+	int depth;
+	
+	// The call tree of allocations captured with a depth (NULL until a depth is set, see Capture#call_tree).
+	struct Memory_Profiler_Call_Tree *call_tree;
+	
 	// Total allocations seen since tracking started.
 	size_t new_count;
 	// // Total frees seen since tracking started.
 	size_t free_count;
 	// Live count = new_count - free_count.
+	
+	// Log2 histogram of the lifetimes of freed objects, in garbage collections (see Allocations#lifetime_histogram).
+	size_t lifetimes[MEMORY_PROFILER_HISTOGRAM_SIZE];
 };
 
 // Wrap an allocations record in a VALUE.
@@ -24,6 +55,15 @@ VALUE Memory_Profiler_Allocations_wrap(struct Memory_Profiler_Capture_Allocation
 // Get allocations record from wrapper VALUE.
 struct Memory_Profiler_Capture_Allocations* Memory_Profiler_Allocations_get(VALUE self);
 
+// Initialize a new record.
+void Memory_Profiler_Allocations_initialize(struct Memory_Profiler_Capture_Allocations *record);
+
+// Append an event to the pending batch. Returns true if the batch was empty (so the caller should schedule a flush).
+int Memory_Profiler_Allocations_batch_push(VALUE allocations, VALUE klass, VALUE kind, VALUE data, VALUE object);
+
+// Convert a log2 histogram to an array of counts, omitting trailing empty buckets.
+VALUE Memory_Profiler_Histogram_array(const size_t *counts);
+
 // Clear/reset allocation counts for a record.
 void Memory_Profiler_Allocations_clear(VALUE allocations);
 
@@ -0,0 +1,448 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "call_tree.h"
+#include "allocations.h"
+#include "capture.h"
+#include "stacks.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	INITIAL_CAPACITY = 256,
+};
+
+static VALUE Memory_Profiler_Call_Tree = Qnil;
+
+struct Memory_Profiler_Call_Tree* Memory_Profiler_Call_Tree_new(void) {
+	struct Memory_Profiler_Call_Tree *tree = malloc(sizeof(struct Memory_Profiler_Call_Tree));
+	
+	if (!tree) {
+		return NULL;
+	}
+	
+	tree->capacity = INITIAL_CAPACITY;
+	tree->nodes = malloc(tree->capacity * sizeof(struct Memory_Profiler_Call_Tree_Node));
+	
+	tree->slots_capacity = INITIAL_CAPACITY * 2;
+	tree->slots = malloc(tree->slots_capacity * sizeof(uint32_t));
+	
+	if (!tree->nodes || !tree->slots) {
+		Memory_Profiler_Call_Tree_free(tree);
+		return NULL;
+	}
+	
+	Memory_Profiler_Call_Tree_clear(tree);
+	
+	return tree;
+}
+
+void Memory_Profiler_Call_Tree_free(struct Memory_Profiler_Call_Tree *tree) {
+	if (tree) {
+		free(tree->nodes);
+		free(tree->slots);
+		free(tree);
+	}
+}
+
+void Memory_Profiler_Call_Tree_clear(struct Memory_Profiler_Call_Tree *tree) {
+	memset(&tree->nodes[0], 0, sizeof(struct Memory_Profiler_Call_Tree_Node));
+	tree->count = 1;
+	
+	memset(tree->slots, 0, tree->slots_capacity * sizeof(uint32_t));
+	
+	tree->insertion_count = 0;
+}
+
+static inline size_t Memory_Profiler_Call_Tree_hash(uint32_t parent, uint32_t frame) {
+	uint64_t key = ((uint64_t)parent << 32) | frame;
+	
+	return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+// Find the empty slot for a new child.
+static inline size_t Memory_Profiler_Call_Tree_empty_slot(const uint32_t *slots, size_t slots_capacity, uint32_t parent, uint32_t frame) {
+	size_t mask = slots_capacity - 1;
+	size_t slot = Memory_Profiler_Call_Tree_hash(parent, frame) & mask;
+	
+	while (slots[slot]) {
+		slot = (slot + 1) & mask;
+	}
+	
+	return slot;
+}
+
+// Link a node into its parent's children and the child map.
+static inline void Memory_Profiler_Call_Tree_link(struct Memory_Profiler_Call_Tree *tree, uint32_t index) {
+	struct Memory_Profiler_Call_Tree_Node *node = &tree->nodes[index];
+	struct Memory_Profiler_Call_Tree_Node *parent = &tree->nodes[node->parent];
+	
+	node->next_sibling = parent->first_child;
+	parent->first_child = index;
+	
+	tree->slots[Memory_Profiler_Call_Tree_empty_slot(tree->slots, tree->slots_capacity, node->parent, node->frame)] = index;
+}
+
+// Double the map capacity and reinsert every node.
+static int Memory_Profiler_Call_Tree_resize_slots(struct Memory_Profiler_Call_Tree *tree) {
+	size_t slots_capacity = tree->slots_capacity * 2;
+	uint32_t *slots = calloc(slots_capacity, sizeof(uint32_t));
+	
+	if (!slots) return 0;
+	
+	for (uint32_t index = 1; index < tree->count; index++) {
+		struct Memory_Profiler_Call_Tree_Node *node = &tree->nodes[index];
+		slots[Memory_Profiler_Call_Tree_empty_slot(slots, slots_capacity, node->parent, node->frame)] = index;
+	}
+	
+	free(tree->slots);
+	tree->slots = slots;
+	tree->slots_capacity = slots_capacity;
+	
+	return 1;
+}
+
+// Find or create the child of a node for a frame, returning 0 on allocation failure.
+static uint32_t Memory_Profiler_Call_Tree_child(struct Memory_Profiler_Call_Tree *tree, uint32_t parent, uint32_t frame) {
+	size_t mask = tree->slots_capacity - 1;
+	size_t slot = Memory_Profiler_Call_Tree_hash(parent, frame) & mask;
+	
+	while (tree->slots[slot]) {
+		uint32_t index = tree->slots[slot];
+		
+		if (tree->nodes[index].parent == parent && tree->nodes[index].frame == frame) {
+			return index;
+		}
+		
+		slot = (slot + 1) & mask;
+	}
+	
+	if (tree->count >= UINT32_MAX) return 0;
+	
+	if (tree->count == tree->capacity) {
+		struct Memory_Profiler_Call_Tree_Node *nodes = realloc(tree->nodes, tree->capacity * 2 * sizeof(struct Memory_Profiler_Call_Tree_Node));
+		if (!nodes) return 0;
+		
+		tree->nodes = nodes;
+		tree->capacity *= 2;
+	}
+	
+	// Keep the map at most half full:
+	if ((tree->count + 1) * 2 > tree->slots_capacity) {
+		if (!Memory_Profiler_Call_Tree_resize_slots(tree)) return 0;
+	}
+	
+	uint32_t index = (uint32_t)tree->count++;
+	struct Memory_Profiler_Call_Tree_Node *node = &tree->nodes[index];
+	
+	node->parent = parent;
+	node->frame = frame;
+	node->first_child = 0;
+	node->total_count = 0;
+	node->retained_count = 0;
+	
+	Memory_Profiler_Call_Tree_link(tree, index);
+	
+	return index;
+}
+
+uint32_t Memory_Profiler_Call_Tree_insert(struct Memory_Profiler_Call_Tree *tree, const uint32_t *frames, uint32_t depth) {
+	uint32_t node = 0;
+	
+	for (uint32_t i = 0; i < depth; i++) {
+		node = Memory_Profiler_Call_Tree_child(tree, node, frames[i]);
+		if (!node) return 0;
+	}
+	
+	return node;
+}
+
+void Memory_Profiler_Call_Tree_increment(struct Memory_Profiler_Call_Tree *tree, uint32_t leaf, size_t weight) {
+	uint32_t index = leaf;
+	
+	while (1) {
+		struct Memory_Profiler_Call_Tree_Node *node = &tree->nodes[index];
+		node->total_count += weight;
+		node->retained_count += weight;
+		
+		if (index == 0) break;
+		index = node->parent;
+	}
+	
+	tree->insertion_count += 1;
+}
+
+void Memory_Profiler_Call_Tree_decrement(struct Memory_Profiler_Call_Tree *tree, uint32_t leaf, size_t weight) {
+	uint32_t index = leaf;
+	
+	while (1) {
+		struct Memory_Profiler_Call_Tree_Node *node = &tree->nodes[index];
+		node->retained_count -= node->retained_count < weight ? node->retained_count : weight;
+		
+		if (index == 0) break;
+		index = node->parent;
+	}
+}
+
+uint32_t* Memory_Profiler_Call_Tree_prune(struct Memory_Profiler_Call_Tree *tree, size_t limit, size_t *pruned_count) {
+	*pruned_count = 0;
+	
+	uint32_t *remap = calloc(tree->count, sizeof(uint32_t));
+	if (!remap) return NULL;
+	
+	// Children are always created after their parents, so a forward pass prunes each level before the levels below it (and never visits a discarded subtree). Nodes are kept by setting remap to 1 for now:
+	remap[0] = 1;
+	size_t count = 1;
+	
+	for (uint32_t index = 0; index < tree->count; index++) {
+		if (!remap[index]) continue;
+		
+		for (size_t kept = 0; kept < limit; kept++) {
+			uint32_t best = 0;
+			
+			for (uint32_t child = tree->nodes[index].first_child; child; child = tree->nodes[child].next_sibling) {
+				if (!remap[child] && (!best || tree->nodes[child].retained_count > tree->nodes[best].retained_count)) {
+					best = child;
+				}
+			}
+			
+			if (!best) break;
+			remap[best] = 1;
+			count++;
+		}
+	}
+	
+	if (count == tree->count) {
+		free(remap);
+		return NULL;
+	}
+	
+	*pruned_count = tree->count - count;
+	
+	// Compact the arena, preserving the order of the remaining nodes (so parents still come first):
+	count = 0;
+	
+	for (uint32_t index = 0; index < tree->count; index++) {
+		if (!remap[index]) continue;
+		
+		remap[index] = (uint32_t)count;
+		tree->nodes[count] = tree->nodes[index];
+		tree->nodes[count].parent = remap[tree->nodes[index].parent];
+		tree->nodes[count].first_child = 0;
+		count++;
+	}
+	
+	tree->count = count;
+	
+	memset(tree->slots, 0, tree->slots_capacity * sizeof(uint32_t));
+	for (uint32_t index = 1; index < tree->count; index++) {
+		Memory_Profiler_Call_Tree_link(tree, index);
+	}
+	
+	return remap;
+}
+
+size_t Memory_Profiler_Call_Tree_memsize(struct Memory_Profiler_Call_Tree *tree) {
+	if (!tree) return 0;
+	
+	return sizeof(struct Memory_Profiler_Call_Tree)
+		+ tree->capacity * sizeof(struct Memory_Profiler_Call_Tree_Node)
+		+ tree->slots_capacity * sizeof(uint32_t);
+}
+
+#pragma mark - NativeCallTree
+
+// The call tree of a class tracked by a capture. Frames are symbolized with the capture's stack table.
+struct Memory_Profiler_Call_Tree_Wrapper {
+	VALUE capture;
+	VALUE klass;
+	VALUE allocations;
+};
+
+static void Memory_Profiler_Call_Tree_Wrapper_mark(void *ptr) {
+	struct Memory_Profiler_Call_Tree_Wrapper *wrapper = ptr;
+	
+	rb_gc_mark_movable(wrapper->capture);
+	rb_gc_mark_movable(wrapper->klass);
+	rb_gc_mark_movable(wrapper->allocations);
+}
+
+static void Memory_Profiler_Call_Tree_Wrapper_compact(void *ptr) {
+	struct Memory_Profiler_Call_Tree_Wrapper *wrapper = ptr;
+	
+	wrapper->capture = rb_gc_location(wrapper->capture);
+	wrapper->klass = rb_gc_location(wrapper->klass);
+	wrapper->allocations = rb_gc_location(wrapper->allocations);
+}
+
+static const rb_data_type_t Memory_Profiler_Call_Tree_type = {
+	"Memory::Profiler::NativeCallTree",
+	{
+		.dmark = Memory_Profiler_Call_Tree_Wrapper_mark,
+		.dcompact = Memory_Profiler_Call_Tree_Wrapper_compact,
+		.dfree = RUBY_TYPED_DEFAULT_FREE,
+	},
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+VALUE Memory_Profiler_Call_Tree_wrap(VALUE capture, VALUE klass, VALUE allocations) {
+	struct Memory_Profiler_Call_Tree_Wrapper *wrapper;
+	VALUE self = TypedData_Make_Struct(Memory_Profiler_Call_Tree, struct Memory_Profiler_Call_Tree_Wrapper, &Memory_Profiler_Call_Tree_type, wrapper);
+	
+	RB_OBJ_WRITE(self, &wrapper->capture, capture);
+	RB_OBJ_WRITE(self, &wrapper->klass, klass);
+	RB_OBJ_WRITE(self, &wrapper->allocations, allocations);
+	
+	return self;
+}
+
+static struct Memory_Profiler_Call_Tree_Wrapper *Memory_Profiler_Call_Tree_Wrapper_get(VALUE self) {
+	struct Memory_Profiler_Call_Tree_Wrapper *wrapper;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Call_Tree_Wrapper, &Memory_Profiler_Call_Tree_type, wrapper);
+	
+	return wrapper;
+}
+
+static struct Memory_Profiler_Call_Tree *Memory_Profiler_Call_Tree_get(VALUE self) {
+	struct Memory_Profiler_Call_Tree_Wrapper *wrapper = Memory_Profiler_Call_Tree_Wrapper_get(self);
+	
+	return Memory_Profiler_Allocations_get(wrapper->allocations)->call_tree;
+}
+
+// Symbolize a frame, caching the location by frame index.
+static VALUE Memory_Profiler_Call_Tree_location(struct Memory_Profiler_Stacks *stacks, VALUE cache, uint32_t frame) {
+	VALUE location = rb_ary_entry(cache, frame);
+	
+	if (NIL_P(location)) {
+		location = Memory_Profiler_Stacks_location(stacks, frame);
+		rb_ary_store(cache, frame, location);
+	}
+	
+	return location;
+}
+
+// NativeCallTree#total_allocations
+static VALUE Memory_Profiler_Call_Tree_total_allocations(VALUE self) {
+	return SIZET2NUM(Memory_Profiler_Call_Tree_get(self)->nodes[0].total_count);
+}
+
+// NativeCallTree#retained_allocations
+static VALUE Memory_Profiler_Call_Tree_retained_allocations(VALUE self) {
+	return SIZET2NUM(Memory_Profiler_Call_Tree_get(self)->nodes[0].retained_count);
+}
+
+// NativeCallTree#insertion_count
+static VALUE Memory_Profiler_Call_Tree_insertion_count(VALUE self) {
+	return SIZET2NUM(Memory_Profiler_Call_Tree_get(self)->insertion_count);
+}
+
+// NativeCallTree#insertion_count=
+static VALUE Memory_Profiler_Call_Tree_set_insertion_count(VALUE self, VALUE value) {
+	Memory_Profiler_Call_Tree_get(self)->insertion_count = NUM2SIZET(value);
+	
+	return value;
+}
+
+// NativeCallTree#node_count
+static VALUE Memory_Profiler_Call_Tree_node_count(VALUE self) {
+	return SIZET2NUM(Memory_Profiler_Call_Tree_get(self)->count - 1);
+}
+
+// NativeCallTree#clear!
+static VALUE Memory_Profiler_Call_Tree_clear_bang(VALUE self) {
+	struct Memory_Profiler_Call_Tree_Wrapper *wrapper = Memory_Profiler_Call_Tree_Wrapper_get(self);
+	
+	Memory_Profiler_Call_Tree_clear(Memory_Profiler_Call_Tree_get(self));
+	Memory_Profiler_Stacks_remap_nodes(Memory_Profiler_Capture_stack_table(wrapper->capture), wrapper->klass, NULL);
+	
+	return self;
+}
+
+// NativeCallTree#prune!(limit = 5)
+// Keep only the top N children of each node by retained count. Returns the number of nodes discarded.
+static VALUE Memory_Profiler_Call_Tree_prune_bang(int argc, VALUE *argv, VALUE self) {
+	struct Memory_Profiler_Call_Tree_Wrapper *wrapper = Memory_Profiler_Call_Tree_Wrapper_get(self);
+	
+	VALUE limit;
+	rb_scan_args(argc, argv, "01", &limit);
+	
+	size_t pruned_count;
+	uint32_t *remap = Memory_Profiler_Call_Tree_prune(Memory_Profiler_Call_Tree_get(self), NIL_P(limit) ? 5 : NUM2SIZET(limit), &pruned_count);
+	
+	if (remap) {
+		Memory_Profiler_Stacks_remap_nodes(Memory_Profiler_Capture_stack_table(wrapper->capture), wrapper->klass, remap);
+		free(remap);
+	}
+	
+	return SIZET2NUM(pruned_count);
+}
+
+// NativeCallTree#each_path { |locations, total_count, retained_count| ... }
+// Yields every path from the root to a leaf, as locations innermost first.
+static VALUE Memory_Profiler_Call_Tree_each_path(VALUE self) {
+	RETURN_ENUMERATOR(self, 0, 0);
+	
+	struct Memory_Profiler_Call_Tree_Wrapper *wrapper = Memory_Profiler_Call_Tree_Wrapper_get(self);
+	VALUE cache = rb_ary_new();
+	
+	// The tree may grow while yielding, so nodes are accessed by index:
+	for (uint32_t index = 1; index < Memory_Profiler_Call_Tree_get(self)->count; index++) {
+		struct Memory_Profiler_Call_Tree *tree = Memory_Profiler_Call_Tree_get(self);
+		struct Memory_Profiler_Call_Tree_Node leaf = tree->nodes[index];
+		
+		if (leaf.first_child) continue;
+		
+		uint32_t frames[MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH];
+		uint32_t depth = 0;
+		
+		for (uint32_t node = index; node && depth < MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH; node = tree->nodes[node].parent) {
+			frames[depth++] = tree->nodes[node].frame;
+		}
+		
+		struct Memory_Profiler_Stacks *stacks = Memory_Profiler_Capture_stack_table(wrapper->capture);
+		VALUE locations = rb_ary_new_capa(depth);
+		
+		while (depth > 0) {
+			rb_ary_push(locations, Memory_Profiler_Call_Tree_location(stacks, cache, frames[--depth]));
+		}
+		
+		rb_yield_values(3, locations, SIZET2NUM(leaf.total_count), SIZET2NUM(leaf.retained_count));
+	}
+	
+	return self;
+}
+
+// NativeCallTree#each_frame { |location, total_count, retained_count| ... }
+// Yields the counts of every node with its location (a location may be yielded more than once, if it appears in several paths).
+static VALUE Memory_Profiler_Call_Tree_each_frame(VALUE self) {
+	RETURN_ENUMERATOR(self, 0, 0);
+	
+	struct Memory_Profiler_Call_Tree_Wrapper *wrapper = Memory_Profiler_Call_Tree_Wrapper_get(self);
+	VALUE cache = rb_ary_new();
+	
+	for (uint32_t index = 1; index < Memory_Profiler_Call_Tree_get(self)->count; index++) {
+		struct Memory_Profiler_Call_Tree_Node node = Memory_Profiler_Call_Tree_get(self)->nodes[index];
+		VALUE location = Memory_Profiler_Call_Tree_location(Memory_Profiler_Capture_stack_table(wrapper->capture), cache, node.frame);
+		
+		rb_yield_values(3, location, SIZET2NUM(node.total_count), SIZET2NUM(node.retained_count));
+	}
+	
+	return self;
+}
+
+void Init_Memory_Profiler_Call_Tree(VALUE Memory_Profiler)
+{
+	Memory_Profiler_Call_Tree = rb_define_class_under(Memory_Profiler, "NativeCallTree", rb_cObject);
+	rb_undef_alloc_func(Memory_Profiler_Call_Tree);
+	
+	rb_define_method(Memory_Profiler_Call_Tree, "total_allocations", Memory_Profiler_Call_Tree_total_allocations, 0);
+	rb_define_method(Memory_Profiler_Call_Tree, "retained_allocations", Memory_Profiler_Call_Tree_retained_allocations, 0);
+	rb_define_method(Memory_Profiler_Call_Tree, "insertion_count", Memory_Profiler_Call_Tree_insertion_count, 0);
+	rb_define_method(Memory_Profiler_Call_Tree, "insertion_count=", Memory_Profiler_Call_Tree_set_insertion_count, 1);
+	rb_define_method(Memory_Profiler_Call_Tree, "node_count", Memory_Profiler_Call_Tree_node_count, 0);
+	rb_define_method(Memory_Profiler_Call_Tree, "clear!", Memory_Profiler_Call_Tree_clear_bang, 0);
+	rb_define_method(Memory_Profiler_Call_Tree, "prune!", Memory_Profiler_Call_Tree_prune_bang, -1);
+	rb_define_method(Memory_Profiler_Call_Tree, "each_path", Memory_Profiler_Call_Tree_each_path, 0);
+	rb_define_method(Memory_Profiler_Call_Tree, "each_frame", Memory_Profiler_Call_Tree_each_frame, 0);
+}
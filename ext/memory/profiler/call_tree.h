@@ -0,0 +1,70 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A node in a call tree, representing a frame in the call paths of allocations.
+struct Memory_Profiler_Call_Tree_Node {
+	// The parent node (the root is its own parent) and the frame (index into the capture's stack table, 0 for the root):
+	uint32_t parent;
+	uint32_t frame;
+	
+	// The first child and next sibling (0 = none), for iterating over children:
+	uint32_t first_child;
+	uint32_t next_sibling;
+	
+	// Allocations through this node (never decrements), and how many of them are still live:
+	size_t total_count;
+	size_t retained_count;
+};
+
+// Call tree of allocation paths (innermost frame first), with nodes allocated from an arena and children indexed by frame.
+// Uses system malloc/free (not ruby_xmalloc), so paths can be recorded from the event hook.
+// Node 0 is the root.
+struct Memory_Profiler_Call_Tree {
+	struct Memory_Profiler_Call_Tree_Node *nodes;
+	size_t count;
+	size_t capacity;
+	
+	// Open addressing map from (parent, frame) to the child node (0 = empty slot), capacity is a power of two:
+	uint32_t *slots;
+	size_t slots_capacity;
+	
+	// Number of allocations recorded (e.g. since the tree was last pruned):
+	size_t insertion_count;
+};
+
+// Create a new, empty call tree.
+struct Memory_Profiler_Call_Tree* Memory_Profiler_Call_Tree_new(void);
+
+// Free the tree and all its memory.
+void Memory_Profiler_Call_Tree_free(struct Memory_Profiler_Call_Tree *tree);
+
+// Remove all nodes. Previously returned nodes become invalid.
+void Memory_Profiler_Call_Tree_clear(struct Memory_Profiler_Call_Tree *tree);
+
+// Find or create the path for the given frames (innermost first), returning the leaf node (0 on allocation failure or if there are no frames).
+uint32_t Memory_Profiler_Call_Tree_insert(struct Memory_Profiler_Call_Tree *tree, const uint32_t *frames, uint32_t depth);
+
+// Count allocations through every node from the leaf to the root.
+void Memory_Profiler_Call_Tree_increment(struct Memory_Profiler_Call_Tree *tree, uint32_t leaf, size_t weight);
+
+// Count frees through every node from the leaf to the root.
+void Memory_Profiler_Call_Tree_decrement(struct Memory_Profiler_Call_Tree *tree, uint32_t leaf, size_t weight);
+
+// Keep only the top `limit` children of each node by retained count, discarding the rest.
+// Returns a malloc'd array mapping each previous node index to its new index (0 if discarded), which the caller must free, or NULL if nothing was pruned.
+uint32_t* Memory_Profiler_Call_Tree_prune(struct Memory_Profiler_Call_Tree *tree, size_t limit, size_t *pruned_count);
+
+// Get the memory used by the tree.
+size_t Memory_Profiler_Call_Tree_memsize(struct Memory_Profiler_Call_Tree *tree);
+
+// Wrap the call tree of a class tracked by a capture (see Capture#call_tree).
+VALUE Memory_Profiler_Call_Tree_wrap(VALUE capture, VALUE klass, VALUE allocations);
+
+// Initialize the NativeCallTree class.
+void Init_Memory_Profiler_Call_Tree(VALUE Memory_Profiler);
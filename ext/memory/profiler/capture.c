@@ -3,16 +3,29 @@
 
 #include "capture.h"
 #include "allocations.h"
+#include "call_tree.h"
+#include "classes.h"
 #include "events.h"
+#include "export.h"
+#include "snapshot.h"
+#include "stacks.h"
 #include "table.h"
 
 #include <ruby/debug.h>
-#include <ruby/st.h>
+#include <errno.h>
+#include <math.h>
 #include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 
 enum {
 	DEBUG = 0,
+	
+	// Number of slots in the direct-mapped tracked class cache (must be a power of two).
+	CLASS_CACHE_SIZE = 256,
+	
+	// Number of GCs of precise ages kept when the allocation epoch base is moved forward (see Memory_Profiler_Capture_epoch).
+	EPOCH_WINDOW = 0x8000,
 };
 
 static VALUE Memory_Profiler_Capture = Qnil;
@@ -20,6 +33,18 @@ static VALUE Memory_Profiler_Capture = Qnil;
 // Event symbols:
 static VALUE sym_newobj, sym_freeobj;
 
+static ID id_call;
+
+// Direct-mapped cache slot remembering the result of looking up a class in the class registry.
+struct Memory_Profiler_Capture_Class_Cache_Entry {
+	// The class (0 = empty slot).
+	VALUE klass;
+	
+	// The allocations record for the class (NULL if the class is not tracked).
+	// Records are malloc'd and don't move, and they are evicted before they can be freed.
+	struct Memory_Profiler_Capture_Allocations *record;
+};
+
 // Main capture state (per-instance).
 struct Memory_Profiler_Capture {
 	// Master switch - is tracking active? (set by start/stop).
@@ -27,55 +52,183 @@ struct Memory_Profiler_Capture {
 	
 	// Should we queue callbacks? (temporarily disabled during queue processing).
 	int paused;
-
-	// Tracked classes: class => VALUE (wrapped Memory_Profiler_Capture_Allocations).
-	st_table *tracked;
+	
+	// Number of each_object iterations in progress, during which the capture can't be stopped or cleared.
+	int iterating;
+	
+	// Is the stopped hook installed? It removes recorded objects from the table as they are freed, while the capture is stopped.
+	int stopped_hook;
+	
+	// Index of this capture in the event queue's registry (0 = not registered, set by start/stop).
+	uint32_t capture_index;
+	
+	// Tracked classes, with their wrapped Memory_Profiler_Capture_Allocations as value, and the classes referenced by queued events and recorded objects, so they can store a small index instead of the class.
+	// Classes are weak while the capture is running: the event hook forgets classes as they are freed, and their allocations are folded into `folded`.
+	struct Memory_Profiler_Classes *classes;
+	
+	// Indices of freed classes whose allocations have not been folded yet (system malloc, as they are added by the event hook):
+	uint32_t *freed;
+	size_t freed_count;
+	size_t freed_capacity;
+	
+	// Indices of folded classes, which are released for reuse once nothing can refer to them (system malloc):
+	uint32_t *retired;
+	size_t retired_count;
+	size_t retired_capacity;
+	
+	// The GC count when classes were last retired: objects of theirs may be freed until that GC's sweep finishes.
+	size_t retired_epoch;
+	
+	// The GC count that the allocation epochs of recorded objects are relative to (see Memory_Profiler_Capture_epoch).
+	size_t epoch_base;
+	
+	// Allocations of freed classes, aggregated by name: String => Allocations (nil until a class is folded).
+	VALUE folded;
+	size_t folded_count;
+	
+	// Allocation stacks captured for classes tracked with a depth, referenced by index from the object table and queued events.
+	struct Memory_Profiler_Stacks *stacks;
+	
+	// Allocations with a pending batch of events (see Allocations#track_batch), or nil.
+	VALUE batched;
+	
+	// Automatically track every class that allocates (otherwise only classes added with `track`).
+	int track_all;
+	
+	// Queue allocations without retaining the objects, cancelling them in the queue if they are freed before being processed.
+	int weak_events;
+	
+	// Cache in front of the class registry used by the event hook.
+	// Only ever touched with the GVL held, so plain loads and stores are sufficient.
+	struct Memory_Profiler_Capture_Class_Cache_Entry class_cache[CLASS_CACHE_SIZE];
 	
 	// Custom object table: object (address) => state hash
 	// Uses system malloc (GC-safe), updates addresses during compaction
 	struct Memory_Profiler_Object_Table *states;
-
+	
 	// Total number of allocations and frees seen since tracking started.
 	size_t new_count;
 	size_t free_count;
+	
+	// Number of allocations that were not recorded, because they could not be queued (the event queue's memory limit) or the object table could not hold them.
+	size_t dropped_count;
+	
+	// Number of frees discarded by the object table's membership filter, as the objects were never recorded.
+	size_t filtered_count;
+	
+	// Sampling: record on average one in every `sample_interval` allocations (1 = record everything).
+	// Each recorded allocation (and its eventual free) is weighted by the interval, so counts remain unbiased estimates.
+	size_t sample_interval;
+	
+	// Precomputed log(1 - 1/sample_interval), used to draw geometric skip lengths.
+	double sample_log;
+	
+	// Number of trackable allocations to skip before the next one is recorded.
+	size_t sample_skip;
+	
+	// Xorshift state, only advanced when a sample is taken (not per allocation).
+	uint64_t sample_random;
+	
+	// Shared memory segment the counters are copied to for other processes (see Capture#export), or NULL.
+	struct Memory_Profiler_Export *export;
 };
 
-// GC mark callback for tracked table.
-static int Memory_Profiler_Capture_tracked_mark(st_data_t key, st_data_t value, st_data_t arg) {
-	// Mark class as un-movable:
-	// - We don't want to re-index the table if the class moves.
-	// - We don't want objects in `freeobj` to have invalid class pointers (maybe helps).
-	VALUE klass = (VALUE)key;
-	rb_gc_mark(klass);
+// Invalidate the tracked class cache (after `tracked` changes or classes move).
+static void Memory_Profiler_Capture_class_cache_clear(struct Memory_Profiler_Capture *capture) {
+	memset(capture->class_cache, 0, sizeof(capture->class_cache));
+}
+
+static inline struct Memory_Profiler_Capture_Class_Cache_Entry *Memory_Profiler_Capture_class_cache_entry(struct Memory_Profiler_Capture *capture, VALUE klass) {
+	size_t hash = ((size_t)klass >> 3) * 0x9E3779B97F4A7C15ULL;
 	
-	// Mark the wrapped Allocations VALUE:
-	VALUE allocations = (VALUE)value;
-	rb_gc_mark_movable(allocations);
+	return &capture->class_cache[(hash >> 32) & (CLASS_CACHE_SIZE - 1)];
+}
+
+// Get the allocations record for a class, or NULL if it is not tracked. Safe to call from the event hook (does not allocate).
+static inline struct Memory_Profiler_Capture_Allocations *Memory_Profiler_Capture_class_record(struct Memory_Profiler_Capture *capture, VALUE klass) {
+	struct Memory_Profiler_Capture_Class_Cache_Entry *entry = Memory_Profiler_Capture_class_cache_entry(capture, klass);
+	
+	if (entry->klass != klass) {
+		entry->klass = klass;
+		entry->record = NULL;
+		
+		VALUE allocations = Memory_Profiler_Classes_value(capture->classes, Memory_Profiler_Classes_find(capture->classes, klass));
+		
+		if (!NIL_P(allocations)) {
+			entry->record = Memory_Profiler_Allocations_get(allocations);
+		}
+	}
 	
-	return ST_CONTINUE;
+	return entry->record;
+}
+
+// Remove a class from the cache, e.g. when it is freed and its address may be reused.
+static inline void Memory_Profiler_Capture_class_cache_evict(struct Memory_Profiler_Capture *capture, VALUE klass) {
+	struct Memory_Profiler_Capture_Class_Cache_Entry *entry = Memory_Profiler_Capture_class_cache_entry(capture, klass);
+	
+	if (entry->klass == klass) {
+		entry->klass = 0;
+	}
+}
+
+// Get the allocations of a tracked class, or nil.
+static inline VALUE Memory_Profiler_Capture_tracked_allocations(struct Memory_Profiler_Capture *capture, VALUE klass) {
+	return Memory_Profiler_Classes_value(capture->classes, Memory_Profiler_Classes_find(capture->classes, klass));
+}
+
+// Get the number of tracked classes.
+static size_t Memory_Profiler_Capture_tracked_count(const struct Memory_Profiler_Capture *capture) {
+	size_t count = 0;
+	
+	for (size_t index = 1; index < capture->classes->count; index++) {
+		struct Memory_Profiler_Classes_Entry *entry = &capture->classes->entries[index];
+		
+		if (!NIL_P(entry->klass) && !NIL_P(entry->value)) count++;
+	}
+	
+	return count;
 }
 
 static void Memory_Profiler_Capture_mark(void *ptr) {
 	struct Memory_Profiler_Capture *capture = ptr;
 	
-	if (capture->tracked) {
-		st_foreach(capture->tracked, Memory_Profiler_Capture_tracked_mark, 0);
+	Memory_Profiler_Object_Table_mark(capture->states);
+	
+	// Marks the allocations of tracked (and freed) classes, and the classes themselves unless they are weak:
+	if (capture->classes) {
+		Memory_Profiler_Classes_mark(capture->classes);
 	}
 	
-	Memory_Profiler_Object_Table_mark(capture->states);
+	if (capture->stacks) {
+		Memory_Profiler_Stacks_mark(capture->stacks);
+	}
+	
+	rb_gc_mark_movable(capture->batched);
+	rb_gc_mark_movable(capture->folded);
 }
 
 static void Memory_Profiler_Capture_free(void *ptr) {
 	struct Memory_Profiler_Capture *capture = ptr;
-		
-	if (capture->tracked) {
-		st_free_table(capture->tracked);
-	}
 	
 	if (capture->states) {
 		Memory_Profiler_Object_Table_free(capture->states);
 	}
 	
+	if (capture->classes) {
+		Memory_Profiler_Classes_free(capture->classes);
+	}
+	
+	if (capture->stacks) {
+		Memory_Profiler_Stacks_free(capture->stacks);
+	}
+	
+	free(capture->freed);
+	free(capture->retired);
+	
+	if (capture->export) {
+		Memory_Profiler_Export_close(capture->export);
+	}
+	
 	xfree(capture);
 }
 
@@ -83,44 +236,47 @@ static size_t Memory_Profiler_Capture_memsize(const void *ptr) {
 	const struct Memory_Profiler_Capture *capture = ptr;
 	size_t size = sizeof(struct Memory_Profiler_Capture);
 	
-	if (capture->tracked) {
-		size += capture->tracked->num_entries * (sizeof(st_data_t) + sizeof(struct Memory_Profiler_Capture_Allocations));
+	if (capture->classes) {
+		size += Memory_Profiler_Classes_memsize(capture->classes);
+		size += Memory_Profiler_Capture_tracked_count(capture) * sizeof(struct Memory_Profiler_Capture_Allocations);
 	}
 	
-	return size;
-}
-
-// Foreach callback for st_foreach_with_replace (iteration logic).
-static int Memory_Profiler_Capture_tracked_foreach(st_data_t key, st_data_t value, st_data_t argp, int error) {
-	return ST_REPLACE;
-}
-
-// Replace callback for st_foreach_with_replace (update logic).
-static int Memory_Profiler_Capture_tracked_update(st_data_t *key, st_data_t *value, st_data_t argp, int existing) {
-	// Update wrapped Allocations VALUE if it moved:
-	VALUE old_allocations = (VALUE)*value;
-	VALUE new_allocations = rb_gc_location(old_allocations);
-	if (old_allocations != new_allocations) {
-		*value = (st_data_t)new_allocations;
+	size += capture->freed_capacity * sizeof(uint32_t);
+	size += capture->retired_capacity * sizeof(uint32_t);
+	
+	if (capture->export) {
+		size += sizeof(struct Memory_Profiler_Export);
+	}
+	
+	if (capture->stacks) {
+		size += Memory_Profiler_Stacks_memsize(capture->stacks);
 	}
 	
-	return ST_CONTINUE;
+	if (capture->states) {
+		size += Memory_Profiler_Object_Table_memsize(capture->states);
+	}
+	
+	return size;
 }
 
 static void Memory_Profiler_Capture_compact(void *ptr) {
 	struct Memory_Profiler_Capture *capture = ptr;
 	
-	// Update tracked keys and allocations values in-place:
-	if (capture->tracked && capture->tracked->num_entries > 0) {
-		if (st_foreach_with_replace(capture->tracked, Memory_Profiler_Capture_tracked_foreach, Memory_Profiler_Capture_tracked_update, 0)) {
-			rb_raise(rb_eRuntimeError, "tracked modified during GC compaction");
-		}
+	// Update tracked classes and their allocations in place (the registry is rehashed without allocating):
+	if (capture->classes) {
+		Memory_Profiler_Classes_compact(capture->classes);
 	}
 	
 	// Update custom object table (system malloc, safe during GC)
 	if (capture->states) {
 		Memory_Profiler_Object_Table_compact(capture->states);
 	}
+	
+	// Cached classes may have moved:
+	Memory_Profiler_Capture_class_cache_clear(capture);
+	
+	capture->batched = rb_gc_location(capture->batched);
+	capture->folded = rb_gc_location(capture->folded);
 }
 
 static const rb_data_type_t Memory_Profiler_Capture_type = {
@@ -152,59 +308,278 @@ const char *event_flag_name(rb_event_flag_t event_flag) {
 	}
 }
 
+// Intern a class in the registry, returning its index (0 if it could not be added). Safe to call from the event hook (the registry uses system malloc).
+static uint32_t Memory_Profiler_Capture_intern(VALUE self, struct Memory_Profiler_Capture *capture, VALUE klass) {
+	size_t count = capture->classes->count;
+	uint32_t index = Memory_Profiler_Classes_intern(capture->classes, klass);
+	
+	if (capture->classes->count != count) {
+		RB_OBJ_WRITTEN(self, Qnil, klass);
+	}
+	
+	return index;
+}
+
+// Get the name a class's allocations are folded under if it is freed: its own name, or for an anonymous class, the name of its nearest named superclass.
+static VALUE Memory_Profiler_Capture_fold_name(VALUE klass) {
+	for (VALUE ancestor = klass; !NIL_P(ancestor); ancestor = rb_class_superclass(ancestor)) {
+		VALUE name = rb_mod_name(ancestor);
+		if (!NIL_P(name)) return name;
+	}
+	
+	return Qnil;
+}
+
+// Start tracking a class, creating its allocations.
+static VALUE Memory_Profiler_Capture_track_class(VALUE self, struct Memory_Profiler_Capture *capture, VALUE klass) {
+	uint32_t index = Memory_Profiler_Capture_intern(self, capture, klass);
+	
+	if (!index) {
+		rb_raise(rb_eNoMemError, "Failed to add class to registry");
+	}
+	
+	VALUE name = Memory_Profiler_Capture_fold_name(klass);
+	
+	struct Memory_Profiler_Capture_Allocations *record = ALLOC(struct Memory_Profiler_Capture_Allocations);
+	Memory_Profiler_Allocations_initialize(record);
+	
+	VALUE allocations = Memory_Profiler_Allocations_wrap(record);
+	RB_OBJ_WRITE(allocations, &record->name, name);
+	
+	Memory_Profiler_Classes_set_value(capture->classes, index, allocations);
+	RB_OBJ_WRITTEN(self, Qnil, allocations);
+	
+	// The hook may have cached the class as untracked:
+	Memory_Profiler_Capture_class_cache_evict(capture, klass);
+	
+	return allocations;
+}
+
+// Get the allocations for a class, creating them if every class is tracked. Returns nil if the class is not tracked.
+static VALUE Memory_Profiler_Capture_allocations(VALUE self, struct Memory_Profiler_Capture *capture, VALUE klass) {
+	// The class was freed after the event was queued:
+	if (NIL_P(klass)) return Qnil;
+	
+	VALUE allocations = Memory_Profiler_Capture_tracked_allocations(capture, klass);
+	if (!NIL_P(allocations)) return allocations;
+	
+	// The class was untracked after the event was queued:
+	if (!capture->track_all) return Qnil;
+	
+	// First time seeing this class, create record automatically
+	return Memory_Profiler_Capture_track_class(self, capture, klass);
+}
+
+// Add an event to the batch of allocations, scheduling the batch to be flushed at the end of the drain.
+static void Memory_Profiler_Capture_batch_push(VALUE self, struct Memory_Profiler_Capture *capture, VALUE allocations, VALUE klass, VALUE kind, VALUE data, VALUE object) {
+	if (Memory_Profiler_Allocations_batch_push(allocations, klass, kind, data, object)) {
+		if (NIL_P(capture->batched)) {
+			RB_OBJ_WRITE(self, &capture->batched, rb_ary_new());
+		}
+		
+		rb_ary_push(capture->batched, allocations);
+	}
+}
+
+// Count an allocation (or a free) against the stack it was recorded with, if any, and its path in the class's call tree, with the number of allocations it stands for.
+// Safe to call from the event hook (the call tree uses system malloc).
+static inline void Memory_Profiler_Capture_stack_count(struct Memory_Profiler_Capture *capture, struct Memory_Profiler_Capture_Allocations *record, uint32_t index, int freed, size_t weight) {
+	struct Memory_Profiler_Stack *stack = Memory_Profiler_Stacks_get(capture->stacks, index);
+	if (!stack) return;
+	
+	if (freed) {
+		stack->free_count += weight;
+		
+		// Allocations counted before the path was pruned (or the tree was cleared) are not in the tree:
+		if (stack->node_retained_count && record && record->call_tree) {
+			if (weight > stack->node_retained_count) weight = stack->node_retained_count;
+			
+			Memory_Profiler_Call_Tree_decrement(record->call_tree, stack->node, weight);
+			stack->node_retained_count -= weight;
+		}
+	} else {
+		stack->new_count += weight;
+		
+		if (record && record->call_tree) {
+			if (!stack->node) {
+				stack->node = Memory_Profiler_Call_Tree_insert(record->call_tree, Memory_Profiler_Stacks_frames(capture->stacks, stack), stack->depth);
+			}
+			
+			if (stack->node) {
+				Memory_Profiler_Call_Tree_increment(record->call_tree, stack->node, weight);
+				stack->node_retained_count += weight;
+			}
+		}
+	}
+}
+
+struct Memory_Profiler_Stacks* Memory_Profiler_Capture_stack_table(VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	return capture->stacks;
+}
+
+// Get the class index of an allocation, as stored in events and the object table: its stack (which determines and retains the class) if it has one, otherwise the index of the class in the registry (which the capture retains).
+// Returns 0 if the class could not be interned. Safe to call from the event hook (the registry uses system malloc).
+static uint32_t Memory_Profiler_Capture_klass_index(VALUE self, struct Memory_Profiler_Capture *capture, VALUE klass, uint32_t stack) {
+	if (stack) {
+		return stack | MEMORY_PROFILER_EVENT_KLASS_STACK;
+	}
+	
+	return Memory_Profiler_Capture_intern(self, capture, klass);
+}
+
+// Get the class (and stack) of a class index. The class is nil if it has been freed since.
+static VALUE Memory_Profiler_Capture_klass_of_index(struct Memory_Profiler_Capture *capture, uint32_t klass_index, uint32_t *stack) {
+	if (klass_index & MEMORY_PROFILER_EVENT_KLASS_STACK) {
+		*stack = klass_index & ~MEMORY_PROFILER_EVENT_KLASS_STACK;
+		
+		struct Memory_Profiler_Stack *entry = Memory_Profiler_Stacks_get(capture->stacks, *stack);
+		return entry ? entry->klass : Qnil;
+	}
+	
+	*stack = 0;
+	
+	return Memory_Profiler_Classes_get(capture->classes, klass_index);
+}
+
+// Get the allocations that a class index counts against, or nil. The class may have been freed since (in which case its class is nil), and then the allocations it was folded into are returned.
+// Safe to call from the event hook.
+static VALUE Memory_Profiler_Capture_index_allocations(struct Memory_Profiler_Capture *capture, uint32_t klass_index) {
+	if (klass_index & MEMORY_PROFILER_EVENT_KLASS_STACK) {
+		struct Memory_Profiler_Stack *stack = Memory_Profiler_Stacks_get(capture->stacks, klass_index & ~MEMORY_PROFILER_EVENT_KLASS_STACK);
+		if (!stack) return Qnil;
+		
+		// Stacks retain their class, so it can't have been freed:
+		klass_index = Memory_Profiler_Classes_find(capture->classes, stack->klass);
+	}
+	
+	return Memory_Profiler_Classes_value(capture->classes, klass_index);
+}
+
+// The allocation epoch of an object recorded now: the number of garbage collections since `epoch_base`, plus one, in 16 bits to fit the object table's entries. Epoch 0 is an object allocated before the base.
+// Before epochs would overflow, the base is moved forward, keeping the last EPOCH_WINDOW GCs, and the epochs of older objects are clamped to 0, so that their ages saturate instead of wrapping around.
+// Safe to call from the event hook: the entries are rewritten in place.
+static uint16_t Memory_Profiler_Capture_epoch(struct Memory_Profiler_Capture *capture) {
+	size_t count = rb_gc_count();
+	
+	if (count - capture->epoch_base >= UINT16_MAX) {
+		size_t base = count - EPOCH_WINDOW;
+		
+		Memory_Profiler_Object_Table_shift_epochs(capture->states, base - capture->epoch_base);
+		capture->epoch_base = base;
+	}
+	
+	return (uint16_t)(count - capture->epoch_base + 1);
+}
+
+// The age of an object allocated at the given epoch, in GCs. An object allocated before the base is at least as old as the base, which is at least EPOCH_WINDOW GCs old.
+static inline uint32_t Memory_Profiler_Capture_age(struct Memory_Profiler_Capture *capture, uint16_t epoch) {
+	size_t age = rb_gc_count() - capture->epoch_base + 1 - epoch;
+	
+	return age > UINT32_MAX ? UINT32_MAX : (uint32_t)age;
+}
+
+// Count the lifetime of a freed object, in GCs since it was allocated (at least 1, for the GC that freed it). Safe to call from the event hook.
+static inline void Memory_Profiler_Capture_count_lifetime(struct Memory_Profiler_Capture *capture, struct Memory_Profiler_Capture_Allocations *record, uint16_t epoch, size_t weight) {
+	record->lifetimes[Memory_Profiler_Histogram_bucket(Memory_Profiler_Capture_age(capture, epoch))] += weight;
+}
+
 // Process a NEWOBJ event. All allocation tracking logic is here.
-// object_id parameter is the Integer object_id, NOT the raw object.
-// Process a NEWOBJ event. All allocation tracking logic is here.
-// object parameter is the actual object being allocated.
-static void Memory_Profiler_Capture_process_newobj(VALUE self, VALUE klass, VALUE object) {
+// object parameter is the actual object being allocated, and weight the number of sampled allocations it stands for (see Memory_Profiler_Event_weight).
+static void Memory_Profiler_Capture_process_newobj(VALUE self, VALUE klass, VALUE object, uint32_t stack, uint32_t weight) {
 	struct Memory_Profiler_Capture *capture;
 	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
 	
 	// Pause the capture to prevent infinite loop:
 	capture->paused += 1;
 	
-	// Increment global new count:
-	capture->new_count++;
-	
 	// Look up or create allocations record for this class:
-	st_data_t allocations_data;
-	VALUE allocations;
-	struct Memory_Profiler_Capture_Allocations *record;
+	VALUE allocations = Memory_Profiler_Capture_allocations(self, capture, klass);
+	if (NIL_P(allocations)) goto done;
 	
-	if (st_lookup(capture->tracked, (st_data_t)klass, &allocations_data)) {
-		// Existing record
-		allocations = (VALUE)allocations_data;
-		record = Memory_Profiler_Allocations_get(allocations);
-		record->new_count++;
-	} else {
-		// First time seeing this class, create record automatically
-		record = ALLOC(struct Memory_Profiler_Capture_Allocations);
-		record->callback = Qnil;
-		record->new_count = 1;
-		record->free_count = 0;
-		
-		allocations = Memory_Profiler_Allocations_wrap(record);
-		st_insert(capture->tracked, (st_data_t)klass, (st_data_t)allocations);
-		RB_OBJ_WRITTEN(self, Qnil, klass);
-		RB_OBJ_WRITTEN(self, Qnil, allocations);
-	}
+	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
 	
-	VALUE data = Qnil;
-	if (!NIL_P(record->callback)) {
-		data = rb_funcall(record->callback, rb_intern("call"), 3, klass, sym_newobj, Qnil);
+	uint32_t klass_index = Memory_Profiler_Capture_klass_index(self, capture, klass, stack);
+	
+	// Insert before invoking the callback, so that a free during the callback (of a weak event's object) is matched.
+	// If the table is full and could not grow, the object can't be recorded, nor counted (its free could not be):
+	if (!klass_index || !Memory_Profiler_Object_Table_insert(capture->states, object, klass_index, Memory_Profiler_Capture_epoch(capture))) {
+		capture->dropped_count++;
+		goto done;
 	}
 	
-	struct Memory_Profiler_Object_Table_Entry *entry = Memory_Profiler_Object_Table_insert(capture->states, object);
-	RB_OBJ_WRITTEN(self, Qnil, object);
-	RB_OBJ_WRITE(self, &entry->klass, klass);
-	RB_OBJ_WRITE(self, &entry->data, data);
+	// Increment global and per-class new counts (each sampled allocation stands in for `sample_interval` allocations):
+	capture->new_count += capture->sample_interval * weight;
+	record->new_count += capture->sample_interval * weight;
+	Memory_Profiler_Capture_stack_count(capture, record, stack, 0, capture->sample_interval * weight);
+	
+	// Its free is counted with the same weight (or if the weight can't be stored, as a single sampled allocation):
+	if (weight != 1) {
+		Memory_Profiler_Object_Table_set_weight(capture->states, object, weight);
+	}
 	
 	if (DEBUG) fprintf(stderr, "[NEWOBJ] Object inserted into table: %p\n", (void*)object);
 	
+	if (!NIL_P(record->callback) && record->batched) {
+		// The data is filled in when the batch is flushed:
+		Memory_Profiler_Capture_batch_push(self, capture, allocations, klass, sym_newobj, Qnil, object);
+	} else if (!NIL_P(record->callback)) {
+		VALUE data = rb_funcall(record->callback, id_call, 3, klass, sym_newobj, Qnil);
+		
+		// The object may have been freed (and its address reused) during the callback:
+		struct Memory_Profiler_Object_Table_Entry entry;
+		if (!NIL_P(data) && Memory_Profiler_Object_Table_lookup(capture->states, object, &entry) && entry.klass == klass_index) {
+			if (Memory_Profiler_Object_Table_set_data(capture->states, object, data)) {
+				RB_OBJ_WRITTEN(self, Qnil, data);
+			}
+		}
+	}
+	
+done:
 	// Resume the capture:
 	capture->paused -= 1;
 }
 
+// Process an ANNIHILATED event: the object was allocated and freed before its NEWOBJ event was processed.
+// Only counts are recorded - the object never reaches the table, and callbacks are not invoked.
+static void Memory_Profiler_Capture_process_annihilated(VALUE self, uint32_t klass_index, uint32_t weight) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	capture->paused += 1;
+	
+	uint32_t stack;
+	VALUE klass = Memory_Profiler_Capture_klass_of_index(capture, klass_index, &stack);
+	
+	// The object wasn't retained, so its class may have been freed (and folded) since:
+	VALUE allocations = Memory_Profiler_Capture_index_allocations(capture, klass_index);
+	
+	if (NIL_P(allocations)) {
+		allocations = Memory_Profiler_Capture_allocations(self, capture, klass);
+	}
+	
+	if (!NIL_P(allocations)) {
+		struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
+		
+		size_t count = capture->sample_interval * weight;
+		
+		capture->new_count += count;
+		capture->free_count += count;
+		record->new_count += count;
+		record->free_count += count;
+		
+		// Freed before it was processed, so (almost certainly) by the first GC after its allocation:
+		record->lifetimes[1] += count;
+		
+		Memory_Profiler_Capture_stack_count(capture, record, stack, 0, count);
+		Memory_Profiler_Capture_stack_count(capture, record, stack, 1, count);
+	}
+	
+	capture->paused -= 1;
+}
+
 // Process a FREEOBJ event. All deallocation tracking logic is here.
 // freeobj_data parameter is [state_hash, object] array from event handler.
 static void Memory_Profiler_Capture_process_freeobj(VALUE capture_value, VALUE unused_klass, VALUE object) {
@@ -214,41 +589,53 @@ static void Memory_Profiler_Capture_process_freeobj(VALUE capture_value, VALUE u
 	// Pause the capture to prevent infinite loop:
 	capture->paused += 1;
 	
-	struct Memory_Profiler_Object_Table_Entry *entry = Memory_Profiler_Object_Table_lookup(capture->states, object);
+	struct Memory_Profiler_Object_Table_Entry entry;
 	
-	if (!entry) {
+	if (!Memory_Profiler_Object_Table_lookup(capture->states, object, &entry)) {
 		if (DEBUG) fprintf(stderr, "[FREEOBJ] Object not found in table: %p\n", (void*)object);
 		goto done;
 	} else {
 		if (DEBUG) fprintf(stderr, "[FREEOBJ] Object found in table: %p\n", (void*)object);
 	}
 	
-	VALUE klass = entry->klass;
-	VALUE data = entry->data;
+	uint32_t stack;
+	VALUE klass = Memory_Profiler_Capture_klass_of_index(capture, entry.klass, &stack);
+	VALUE allocations = Memory_Profiler_Capture_index_allocations(capture, entry.klass);
+	VALUE data = entry.data;
+	size_t weight = capture->sample_interval * entry.weight;
 	
-	// Look up allocations from tracked table:
-	st_data_t allocations_data;
-	if (!st_lookup(capture->tracked, (st_data_t)klass, &allocations_data)) {
-		// Class not tracked - shouldn't happen, but be defensive:
+	// Delete by entry (faster - no second lookup!)
+	// Always remove the entry, even if the class is no longer tracked, so that dead objects don't linger in the table:
+	Memory_Profiler_Object_Table_delete_entry(capture->states, &entry);
+	
+	// Only the stack and capture retain the data now:
+	RB_GC_GUARD(data);
+	
+	if (NIL_P(allocations)) {
+		// Untracking removes a class's entries, so this is only a safeguard (stacks belong to the capture, so they are still counted):
 		if (DEBUG) fprintf(stderr, "[FREEOBJ] Class not found in tracked: %p\n", (void*)klass);
+		Memory_Profiler_Capture_stack_count(capture, NULL, stack, 1, weight);
 		goto done;
 	}
-	VALUE allocations = (VALUE)allocations_data;
-	
-	// Delete by entry pointer (faster - no second lookup!)
-	Memory_Profiler_Object_Table_delete_entry(capture->states, entry);
 	
 	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
 	
-	// Increment global free count
-	capture->free_count++;
+	Memory_Profiler_Capture_stack_count(capture, record, stack, 1, weight);
+	
+	// Increment global free count (only sampled objects are in the table, so use the same weight):
+	capture->free_count += weight;
 	
 	// Increment per-class free count
-	record->free_count++;
+	record->free_count += weight;
+	Memory_Profiler_Capture_count_lifetime(capture, record, entry.epoch, weight);
 	
-	// Call callback if present
-	if (!NIL_P(record->callback) && !NIL_P(data)) {
-		rb_funcall(record->callback, rb_intern("call"), 3, klass, sym_freeobj, data);
+	// Call callback if present (not for freed classes, whose allocations have been or will be folded):
+	if (!NIL_P(record->callback) && !NIL_P(data) && !NIL_P(klass)) {
+		if (record->batched) {
+			Memory_Profiler_Capture_batch_push(capture_value, capture, allocations, klass, sym_freeobj, data, Qnil);
+		} else {
+			rb_funcall(record->callback, id_call, 3, klass, sym_freeobj, data);
+		}
 	}
 
 done:
@@ -257,13 +644,33 @@ done:
 }
 
 // Process a single event (NEWOBJ or FREEOBJ). Called from events.c via rb_protect to catch exceptions.
-void Memory_Profiler_Capture_process_event(struct Memory_Profiler_Event *event) {
-	switch (event->type) {
+void Memory_Profiler_Capture_process_event(VALUE self, struct Memory_Profiler_Event *event) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	VALUE object = Memory_Profiler_Event_object(event);
+	
+	uint32_t stack = 0;
+	VALUE klass = Qnil;
+	
+	// FREEOBJ events have no class:
+	uint32_t klass_index = Memory_Profiler_Event_klass(event);
+	if (klass_index) {
+		klass = Memory_Profiler_Capture_klass_of_index(capture, klass_index, &stack);
+	}
+	
+	switch (Memory_Profiler_Event_type(event)) {
 		case MEMORY_PROFILER_EVENT_TYPE_NEWOBJ:
-			Memory_Profiler_Capture_process_newobj(event->capture, event->klass, event->object);
+			Memory_Profiler_Capture_process_newobj(self, klass, object, stack, Memory_Profiler_Event_weight(event));
+			
+			// Weak objects are only kept alive by the stack while they are processed:
+			RB_GC_GUARD(object);
+			break;
+		case MEMORY_PROFILER_EVENT_TYPE_ANNIHILATED:
+			Memory_Profiler_Capture_process_annihilated(self, klass_index, Memory_Profiler_Event_weight(event));
 			break;
 		case MEMORY_PROFILER_EVENT_TYPE_FREEOBJ:
-			Memory_Profiler_Capture_process_freeobj(event->capture, event->klass, event->object);
+			Memory_Profiler_Capture_process_freeobj(self, Qnil, object);
 			break;
 		default:
 			// Ignore.
@@ -271,6 +678,153 @@ void Memory_Profiler_Capture_process_event(struct Memory_Profiler_Event *event)
 	}
 }
 
+int Memory_Profiler_Capture_flush_pending_p(VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	return capture->freed_count > 0 || (!NIL_P(capture->batched) && RARRAY_LEN(capture->batched) > 0);
+}
+
+// Release the indices of folded classes for reuse, once nothing can refer to them: objects of a freed class are freed by the same GC (so by the time the next one starts, its sweep has finished and their frees have been queued), and queued events refer to classes by index until they are processed.
+static void Memory_Profiler_Capture_release(struct Memory_Profiler_Capture *capture) {
+	if (capture->retired_count == 0 || rb_gc_count() <= capture->retired_epoch || !Memory_Profiler_Events_idle_p()) return;
+	
+	for (size_t index = 0; index < capture->retired_count; index++) {
+		// If the free list can't grow, the rest stay folded until the registry is pruned:
+		if (!Memory_Profiler_Classes_release(capture->classes, capture->retired[index])) break;
+	}
+	
+	capture->retired_count = 0;
+}
+
+// Remember the index of a folded class, to be released for reuse later. Returns 0 if it could not be recorded, in which case it is only reused once the registry is pruned.
+static int Memory_Profiler_Capture_retire(struct Memory_Profiler_Capture *capture, uint32_t index) {
+	if (capture->retired_count == capture->retired_capacity) {
+		size_t capacity = capture->retired_capacity ? capture->retired_capacity * 2 : 16;
+		uint32_t *retired = realloc(capture->retired, capacity * sizeof(uint32_t));
+		
+		if (!retired) return 0;
+		
+		capture->retired = retired;
+		capture->retired_capacity = capacity;
+	}
+	
+	capture->retired[capture->retired_count++] = index;
+	capture->retired_epoch = rb_gc_count();
+	
+	return 1;
+}
+
+// Fold the allocations of freed classes into `folded`, by name. The records of the freed classes are released, and objects of theirs that are freed later are counted against the folded allocations. Their indices are reused by new classes, once no object or event can refer to them.
+static void Memory_Profiler_Capture_fold(VALUE self, struct Memory_Profiler_Capture *capture) {
+	Memory_Profiler_Capture_release(capture);
+	
+	while (capture->freed_count > 0) {
+		uint32_t index = capture->freed[--capture->freed_count];
+		
+		VALUE allocations = Memory_Profiler_Classes_value(capture->classes, index);
+		if (NIL_P(allocations)) continue;
+		
+		struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
+		
+		if (NIL_P(capture->folded)) {
+			RB_OBJ_WRITE(self, &capture->folded, rb_hash_new());
+		}
+		
+		VALUE bucket = rb_hash_lookup(capture->folded, record->name);
+		
+		if (NIL_P(bucket)) {
+			struct Memory_Profiler_Capture_Allocations *bucket_record = ALLOC(struct Memory_Profiler_Capture_Allocations);
+			Memory_Profiler_Allocations_initialize(bucket_record);
+			
+			bucket = Memory_Profiler_Allocations_wrap(bucket_record);
+			RB_OBJ_WRITE(bucket, &bucket_record->name, record->name);
+			rb_hash_aset(capture->folded, record->name, bucket);
+		}
+		
+		struct Memory_Profiler_Capture_Allocations *bucket_record = Memory_Profiler_Allocations_get(bucket);
+		bucket_record->new_count += record->new_count;
+		bucket_record->free_count += record->free_count;
+		
+		for (size_t bucket = 0; bucket < MEMORY_PROFILER_HISTOGRAM_SIZE; bucket++) {
+			bucket_record->lifetimes[bucket] += record->lifetimes[bucket];
+		}
+		
+		Memory_Profiler_Classes_set_value(capture->classes, index, bucket);
+		RB_OBJ_WRITTEN(self, Qnil, bucket);
+		
+		Memory_Profiler_Capture_retire(capture, index);
+		
+		capture->folded_count++;
+	}
+}
+
+// Invoke the callback of one pending batch, storing the returned data of NEWOBJ events.
+void Memory_Profiler_Capture_flush(VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	Memory_Profiler_Capture_fold(self, capture);
+	
+	if (NIL_P(capture->batched)) return;
+	
+	// Removed before the callback is invoked, so that if it raises, the next flush continues with the next batch:
+	VALUE allocations = rb_ary_shift(capture->batched);
+	if (NIL_P(allocations)) return;
+	
+	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
+	
+	VALUE events = record->batch;
+	VALUE objects = record->batch_objects;
+	RB_OBJ_WRITE(allocations, &record->batch, Qnil);
+	RB_OBJ_WRITE(allocations, &record->batch_objects, Qnil);
+	
+	// The callback may have been replaced since the events were batched:
+	if (NIL_P(events) || NIL_P(record->callback) || !record->batched) return;
+	
+	// Pause the capture to prevent infinite loop:
+	capture->paused += 1;
+	
+	VALUE results = rb_funcall(record->callback, id_call, 1, events);
+	
+	if (RB_TYPE_P(results, T_ARRAY)) {
+		long count = RARRAY_LEN(objects);
+		if (RARRAY_LEN(results) < count) count = RARRAY_LEN(results);
+		
+		for (long i = 0; i < count; i++) {
+			VALUE object = RARRAY_AREF(objects, i);
+			VALUE data = RARRAY_AREF(results, i);
+			
+			// Only NEWOBJ events have an object:
+			if (NIL_P(object) || NIL_P(data)) continue;
+			
+			struct Memory_Profiler_Object_Table_Entry entry;
+			if (!Memory_Profiler_Object_Table_lookup(capture->states, object, &entry) || !NIL_P(entry.data)) continue;
+			
+			uint32_t stack;
+			if (Memory_Profiler_Capture_klass_of_index(capture, entry.klass, &stack) != RARRAY_AREF(events, i * 3)) continue;
+			
+			if (Memory_Profiler_Object_Table_set_data(capture->states, object, data)) {
+				RB_OBJ_WRITTEN(self, Qnil, data);
+			}
+		}
+	}
+	
+	RB_GC_GUARD(objects);
+	
+	capture->paused -= 1;
+}
+
+void Memory_Profiler_Capture_process_event_failed(VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	// The exception skipped resuming the capture:
+	if (capture->paused > 0) {
+		capture->paused -= 1;
+	}
+}
+
 #pragma mark - Event Handlers
 
 // Check if object type is trackable. Excludes internal types (T_IMEMO, T_NODE, T_ICLASS, etc.) that don't have normal classes.
@@ -307,6 +861,215 @@ int Memory_Profiler_Capture_trackable_p(VALUE object) {
 	}
 }
 
+// Draw the next 64-bit pseudo-random number (xorshift64*).
+static inline uint64_t Memory_Profiler_Capture_random(struct Memory_Profiler_Capture *capture) {
+	uint64_t x = capture->sample_random;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	capture->sample_random = x;
+	
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Draw the number of allocations to skip before the next sample.
+// Skips are geometrically distributed, so every allocation is independently sampled with probability 1/sample_interval, without drawing a random number per allocation.
+static size_t Memory_Profiler_Capture_sample_skip(struct Memory_Profiler_Capture *capture) {
+	if (capture->sample_interval <= 1) return 0;
+	
+	// Uniform in (0, 1] using the top 53 bits:
+	double uniform = ((Memory_Profiler_Capture_random(capture) >> 11) + 1) * (1.0 / 9007199254740992.0);
+	double skip = floor(log(uniform) / capture->sample_log);
+	
+	if (skip >= (double)SIZE_MAX) return SIZE_MAX;
+	
+	return (size_t)skip;
+}
+
+// Decide whether the current allocation should be recorded.
+static inline int Memory_Profiler_Capture_sample_p(struct Memory_Profiler_Capture *capture) {
+	if (capture->sample_skip > 0) {
+		capture->sample_skip--;
+		return 0;
+	}
+	
+	capture->sample_skip = Memory_Profiler_Capture_sample_skip(capture);
+	
+	return 1;
+}
+
+// Record an allocation directly from the event hook, for classes without a callback.
+// Only counters and the object table (system malloc) are touched, so no Ruby code runs and nothing is allocated on the Ruby heap.
+// Returns false if the allocation must be queued instead: its address still belongs to a freed object whose FREEOBJ event is queued (e.g. to pass its data to a callback), which must be processed first.
+static int Memory_Profiler_Capture_record_newobj(VALUE self, struct Memory_Profiler_Capture *capture, struct Memory_Profiler_Capture_Allocations *record, VALUE klass, VALUE object, uint32_t stack) {
+	if (Memory_Profiler_Object_Table_may_contain_p(capture->states, object)) {
+		struct Memory_Profiler_Object_Table_Entry entry;
+		if (Memory_Profiler_Object_Table_lookup(capture->states, object, &entry)) return 0;
+	}
+	
+	uint32_t klass_index = Memory_Profiler_Capture_klass_index(self, capture, klass, stack);
+	
+	// Only counted once recorded, as the free of an object that isn't recorded can't be counted:
+	if (!klass_index || !Memory_Profiler_Object_Table_insert(capture->states, object, klass_index, Memory_Profiler_Capture_epoch(capture))) {
+		capture->dropped_count++;
+		return 1;
+	}
+	
+	capture->new_count += capture->sample_interval;
+	record->new_count += capture->sample_interval;
+	Memory_Profiler_Capture_stack_count(capture, record, stack, 0, capture->sample_interval);
+	
+	return 1;
+}
+
+// Record a free directly from the event hook, for entries without callback data (or for all entries, if force is set, in which case the callback is not invoked).
+// Returns true if the free was handled, false if it still needs to be queued.
+static int Memory_Profiler_Capture_record_freeobj(struct Memory_Profiler_Capture *capture, VALUE object, int force) {
+	struct Memory_Profiler_Object_Table_Entry entry;
+	
+	// Not recorded (the membership filter had a false positive):
+	if (!Memory_Profiler_Object_Table_lookup(capture->states, object, &entry)) return 1;
+	
+	// The callback needs to receive the data:
+	if (!NIL_P(entry.data) && !force) return 0;
+	
+	uint32_t stack;
+	Memory_Profiler_Capture_klass_of_index(capture, entry.klass, &stack);
+	
+	// Looked up by index, as the class may have been freed earlier in the same sweep:
+	VALUE allocations = Memory_Profiler_Capture_index_allocations(capture, entry.klass);
+	struct Memory_Profiler_Capture_Allocations *record = NIL_P(allocations) ? NULL : Memory_Profiler_Allocations_get(allocations);
+	
+	size_t weight = capture->sample_interval * entry.weight;
+	
+	Memory_Profiler_Capture_stack_count(capture, record, stack, 1, weight);
+	Memory_Profiler_Object_Table_delete_entry(capture->states, &entry);
+	
+	// Untracking removes a class's entries, so the record should always exist:
+	if (record) {
+		capture->free_count += weight;
+		record->free_count += weight;
+		Memory_Profiler_Capture_count_lifetime(capture, record, entry.epoch, weight);
+	}
+	
+	return 1;
+}
+
+// The event queue rejected an allocation (it is over its memory limit).
+static void Memory_Profiler_Capture_overflow_newobj(VALUE self, struct Memory_Profiler_Capture *capture, struct Memory_Profiler_Capture_Allocations *record, VALUE klass, VALUE object, uint32_t stack) {
+	// Records can't be created from the hook, so allocations of new classes are always dropped (as are allocations that would have to wait for a queued free):
+	if (record && Memory_Profiler_Events_overflow_policy() == MEMORY_PROFILER_EVENTS_OVERFLOW_SYNCHRONOUS) {
+		if (Memory_Profiler_Capture_record_newobj(self, capture, record, klass, object, stack)) return;
+	}
+	
+	capture->dropped_count++;
+}
+
+// Capture the stack of the current allocation and intern it, returning its index (0 if it could not be captured).
+// Safe to call from the event hook: rb_profile_frames doesn't allocate, and the stack table uses system malloc.
+static uint32_t Memory_Profiler_Capture_stack(VALUE self, struct Memory_Profiler_Capture *capture, VALUE klass, int depth) {
+	VALUE frames[MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH];
+	int lines[MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH];
+	
+	int count = rb_profile_frames(0, depth, frames, lines);
+	if (count <= 0) return 0;
+	
+	size_t stacks_count = capture->stacks->count;
+	size_t frames_count = capture->stacks->frames_count;
+	uint32_t index = Memory_Profiler_Stacks_intern(capture->stacks, klass, frames, lines, count);
+	
+	// A new stack retains its class and frames:
+	if (capture->stacks->count != stacks_count || capture->stacks->frames_count != frames_count) {
+		RB_OBJ_WRITTEN(self, Qnil, klass);
+		
+		for (int i = 0; i < count; i++) {
+			RB_OBJ_WRITTEN(self, Qnil, frames[i]);
+		}
+	}
+	
+	return index;
+}
+
+// Forget a class that is being freed, and queue its allocations (if it was tracked) to be folded.
+// Called from the event hook, so nothing is allocated on the Ruby heap - folding happens when the event queue is next drained.
+static void Memory_Profiler_Capture_forget(struct Memory_Profiler_Capture *capture, VALUE klass) {
+	uint32_t index = Memory_Profiler_Classes_forget(capture->classes, klass);
+	if (!index || NIL_P(Memory_Profiler_Classes_value(capture->classes, index))) return;
+	
+	if (capture->freed_count == capture->freed_capacity) {
+		size_t capacity = capture->freed_capacity ? capture->freed_capacity * 2 : 16;
+		uint32_t *freed = realloc(capture->freed, capacity * sizeof(uint32_t));
+		
+		// The allocations stay unfolded (still counted, but retained) until the registry is pruned:
+		if (!freed) return;
+		
+		capture->freed = freed;
+		capture->freed_capacity = capacity;
+	}
+	
+	capture->freed[capture->freed_count++] = index;
+	
+	if (capture->freed_count == 1) {
+		Memory_Profiler_Events_trigger();
+	}
+}
+
+// Copy the counters of the capture, its tracked classes, the event queue and the object table into the export segment.
+// Safe to call from the event hook: nothing is allocated, and only the names of tracked classes are read (never the classes, which may be awaiting their free), which are retained by their allocations.
+static void Memory_Profiler_Capture_export_update(struct Memory_Profiler_Capture *capture) {
+	struct Memory_Profiler_Export *export = capture->export;
+	struct Memory_Profiler_Export_Header *header = export->header;
+	
+	if (!Memory_Profiler_Export_owner_p(export)) return;
+	
+	Memory_Profiler_Export_begin(export);
+	
+	size_t class_count = 0, tracked_count = 0;
+	
+	for (size_t index = 1; index < capture->classes->count; index++) {
+		struct Memory_Profiler_Classes_Entry *entry = &capture->classes->entries[index];
+		if (NIL_P(entry->klass) || NIL_P(entry->value)) continue;
+		
+		tracked_count++;
+		if (class_count == export->capacity) continue;
+		
+		struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(entry->value);
+		struct Memory_Profiler_Export_Class *target = &export->classes[class_count++];
+		
+		if (RB_TYPE_P(record->name, T_STRING)) {
+			Memory_Profiler_Export_name(target, RSTRING_PTR(record->name), RSTRING_LEN(record->name));
+		} else {
+			Memory_Profiler_Export_name(target, "", 0);
+		}
+		
+		target->new_count = record->new_count;
+		target->free_count = record->free_count;
+	}
+	
+	header->tracked_count = tracked_count;
+	
+	header->new_count = capture->new_count;
+	header->free_count = capture->free_count;
+	header->dropped_count = capture->dropped_count;
+	header->folded_count = capture->folded_count + capture->freed_count;
+	
+	struct Memory_Profiler_Events_Counters counters;
+	Memory_Profiler_Events_counters(&counters);
+	
+	header->queue_size = counters.queue_size;
+	header->overflow_count = counters.overflow_count;
+	header->annihilated_count = counters.annihilated_count;
+	header->drain_count = counters.drain_count;
+	header->peak_depth = counters.peak_depth;
+	
+	header->table_size = Memory_Profiler_Object_Table_size(capture->states);
+	header->table_capacity = Memory_Profiler_Object_Table_capacity(capture->states);
+	header->table_tombstones = Memory_Profiler_Object_Table_tombstones(capture->states);
+	header->table_memory_size = Memory_Profiler_Object_Table_memsize(capture->states);
+	
+	Memory_Profiler_Export_end(export, class_count);
+}
+
 // Event hook callback with RAW_ARG
 // Signature: (VALUE data, rb_trace_arg_t *trace_arg)
 static void Memory_Profiler_Capture_event_callback(VALUE self, void *ptr) {
@@ -326,21 +1089,113 @@ static void Memory_Profiler_Capture_event_callback(VALUE self, void *ptr) {
 		// Skip NEWOBJ if disabled (during callback) to prevent infinite recursion
 		if (capture->paused) return;
 		
+		// Allocations drive periodic updates of the export segment, without a thread of their own:
+		if (capture->export && Memory_Profiler_Export_due_p(capture->export)) {
+			Memory_Profiler_Capture_export_update(capture);
+		}
+		
 		VALUE klass = rb_obj_class(object);
 		
 		// Skip if klass is not a Class
 		if (rb_type(klass) != RUBY_T_CLASS) return;
 		
+		struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Capture_class_record(capture, klass);
+		
+		// Skip classes that were not explicitly tracked, before they touch the queue:
+		if (!record && !capture->track_all) return;
+		
+		// Skip allocations that are not sampled (always sampled when sample_interval is 1):
+		if (!Memory_Profiler_Capture_sample_p(capture)) return;
+		
+		// The stack must be captured now, while it is still the allocation's stack:
+		uint32_t stack = 0;
+		if (record && record->depth > 0) {
+			stack = Memory_Profiler_Capture_stack(self, capture, klass, record->depth);
+		}
+		
+		// Counts-only classes are recorded inline, the queue is reserved for callbacks (and creating new records).
+		// With weak events, they are queued too, so that short lived objects never reach the table:
+		if (record && NIL_P(record->callback) && !capture->weak_events) {
+			if (Memory_Profiler_Capture_record_newobj(self, capture, record, klass, object, stack)) return;
+		}
+		
+		// Events refer to the class by index:
+		uint32_t klass_index = Memory_Profiler_Capture_klass_index(self, capture, klass, stack);
+		if (!klass_index) return;
+		
 		// Enqueue actual object (not object_id) - queue retains it until processed
 		// Ruby 3.5 compatible: no need for FL_SEEN_OBJ_ID or rb_obj_id
 		if (DEBUG) fprintf(stderr, "[NEWOBJ] Enqueuing event for object: %p\n", (void*)object);
-		Memory_Profiler_Events_enqueue(MEMORY_PROFILER_EVENT_TYPE_NEWOBJ, self, klass, object);
+		int queued;
+		if (capture->weak_events) {
+			queued = Memory_Profiler_Events_enqueue_weak(capture->capture_index, klass_index, object);
+		} else {
+			queued = Memory_Profiler_Events_enqueue(MEMORY_PROFILER_EVENT_TYPE_NEWOBJ, capture->capture_index, klass_index, object);
+		}
+		
+		if (!queued) {
+			Memory_Profiler_Capture_overflow_newobj(self, capture, record, klass, object, stack);
+		}
 	} else if (event_flag == RUBY_INTERNAL_EVENT_FREEOBJ) {
+		// A freed class's address may be reused by a new class:
+		if (rb_type(object) == RUBY_T_CLASS) {
+			Memory_Profiler_Capture_class_cache_evict(capture, object);
+			Memory_Profiler_Capture_forget(capture, object);
+		}
+		
+		// Objects that die before their allocation is processed cancel out inside the queue:
+		if (capture->weak_events && Memory_Profiler_Events_annihilate(capture->capture_index, object)) return;
+		
+		// Most freed objects were never recorded - discard them without touching the queue:
+		if (!Memory_Profiler_Object_Table_may_contain_p(capture->states, object)) {
+			capture->filtered_count++;
+			return;
+		}
+		
+		// Frees without callback data are handled inline:
+		if (Memory_Profiler_Capture_record_freeobj(capture, object, 0)) return;
+		
 		if (DEBUG) fprintf(stderr, "[FREEOBJ] Enqueuing event for object: %p\n", (void*)object);
-		Memory_Profiler_Events_enqueue(MEMORY_PROFILER_EVENT_TYPE_FREEOBJ, self, Qnil, object);
+		
+		// Frees are never dropped, the table must not keep the address of a freed object (only the callback is skipped):
+		if (!Memory_Profiler_Events_enqueue(MEMORY_PROFILER_EVENT_TYPE_FREEOBJ, capture->capture_index, 0, object)) {
+			Memory_Profiler_Capture_record_freeobj(capture, object, 1);
+		}
 	}
 }
 
+static void Memory_Profiler_Capture_stopped_callback(VALUE self, void *ptr);
+
+// Remove the stopped hook, once the table no longer holds any object (or force is set).
+static void Memory_Profiler_Capture_release_stopped_hook(VALUE self, struct Memory_Profiler_Capture *capture, int force) {
+	if (!capture->stopped_hook) return;
+	if (!force && Memory_Profiler_Object_Table_size(capture->states) > 0) return;
+	
+	rb_remove_event_hook_with_data((rb_event_hook_func_t)Memory_Profiler_Capture_stopped_callback, self);
+	capture->stopped_hook = 0;
+}
+
+// Event hook of a stopped capture, for FREEOBJ only.
+// Recorded objects are removed from the table as they are freed, so that it never holds the address of a freed object (nor keeps the object alive). Counts are not updated and callbacks are not invoked, as the capture is stopped.
+static void Memory_Profiler_Capture_stopped_callback(VALUE self, void *ptr) {
+	rb_trace_arg_t *trace_arg = (rb_trace_arg_t *)ptr;
+	
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	VALUE object = rb_tracearg_object(trace_arg);
+	
+	if (!Memory_Profiler_Object_Table_may_contain_p(capture->states, object)) return;
+	
+	struct Memory_Profiler_Object_Table_Entry entry;
+	if (!Memory_Profiler_Object_Table_lookup(capture->states, object, &entry)) return;
+	
+	Memory_Profiler_Object_Table_delete_entry(capture->states, &entry);
+	
+	// The hook retains the capture, so it is removed along with the last recorded object:
+	Memory_Profiler_Capture_release_stopped_hook(self, capture, 0);
+}
+
 // Allocate new capture
 static VALUE Memory_Profiler_Capture_alloc(VALUE klass) {
 	struct Memory_Profiler_Capture *capture;
@@ -350,35 +1205,141 @@ static VALUE Memory_Profiler_Capture_alloc(VALUE klass) {
 		rb_raise(rb_eRuntimeError, "Failed to allocate Memory::Profiler::Capture");
 	}
 	
-	capture->tracked = st_init_numtable();
-	
-	if (!capture->tracked) {
-		rb_raise(rb_eRuntimeError, "Failed to initialize tracked hash table");
-	}
-	
 	// Initialize custom object table (uses system malloc, GC-safe)
 	capture->states = Memory_Profiler_Object_Table_new(1024);
 	if (!capture->states) {
-		st_free_table(capture->tracked);
 		rb_raise(rb_eRuntimeError, "Failed to initialize object table");
 	}
 	
+	capture->batched = Qnil;
+	
+	capture->freed = NULL;
+	capture->freed_count = 0;
+	capture->freed_capacity = 0;
+	capture->retired = NULL;
+	capture->retired_count = 0;
+	capture->retired_capacity = 0;
+	capture->retired_epoch = 0;
+	capture->epoch_base = rb_gc_count();
+	capture->folded = Qnil;
+	capture->folded_count = 0;
+	
+	capture->classes = Memory_Profiler_Classes_new();
+	if (!capture->classes) {
+		rb_raise(rb_eRuntimeError, "Failed to initialize class registry");
+	}
+	
+	capture->stacks = Memory_Profiler_Stacks_new();
+	if (!capture->stacks) {
+		rb_raise(rb_eRuntimeError, "Failed to initialize stack table");
+	}
+	
 	// Initialize allocation tracking counters
 	capture->new_count = 0;
 	capture->free_count = 0;
+	capture->dropped_count = 0;
+	capture->filtered_count = 0;
+	
+	// Track every class that allocates by default:
+	capture->track_all = 1;
+	Memory_Profiler_Capture_class_cache_clear(capture);
+	
+	// Retain queued objects by default:
+	capture->weak_events = 0;
+	
+	// Record every allocation by default:
+	capture->sample_interval = 1;
+	capture->sample_log = 0;
+	capture->sample_skip = 0;
+	capture->sample_random = ((uint64_t)rb_genrand_int32() << 32) | rb_genrand_int32() | 1;
 	
 	// Initialize state flags - not running, callbacks disabled
 	capture->running = 0;
 	capture->paused = 0;
+	capture->iterating = 0;
+	capture->stopped_hook = 0;
+	capture->capture_index = 0;
+	
+	capture->export = NULL;
 	
 	// Global event queue system will auto-initialize on first use (lazy initialization)
 	
-	return obj;
+	return obj;
+}
+
+// Initialize capture
+// Usage: Capture.new or Capture.new(sample_rate: 0.01, track_all: false, weak_events: true)
+// sample_rate is the probability that any given allocation is recorded; it is rounded to one in N allocations.
+// track_all: false restricts tracking to classes added with `track`; other allocations are dropped in the event hook.
+// weak_events: true queues allocations without retaining the objects, so the profiler doesn't extend their lifetime; objects that are freed before their allocation is processed are only counted (callbacks are not invoked for them).
+static VALUE Memory_Profiler_Capture_initialize(int argc, VALUE *argv, VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	VALUE options;
+	rb_scan_args(argc, argv, ":", &options);
+	
+	ID keywords[3] = {rb_intern("sample_rate"), rb_intern("track_all"), rb_intern("weak_events")};
+	VALUE values[3] = {Qundef, Qundef, Qundef};
+	
+	if (!NIL_P(options)) {
+		rb_get_kwargs(options, keywords, 0, 3, values);
+	}
+	
+	if (values[1] != Qundef) {
+		capture->track_all = RTEST(values[1]);
+	}
+	
+	if (values[2] != Qundef) {
+		capture->weak_events = RTEST(values[2]);
+	}
+	
+	VALUE sample_rate = values[0];
+	if (sample_rate != Qundef && !NIL_P(sample_rate)) {
+		double rate = NUM2DBL(sample_rate);
+		
+		if (!(rate > 0.0 && rate <= 1.0)) {
+			rb_raise(rb_eArgError, "sample_rate must be greater than 0 and at most 1!");
+		}
+		
+		double interval = round(1.0 / rate);
+		if (interval >= (double)SIZE_MAX) {
+			rb_raise(rb_eArgError, "sample_rate is too small!");
+		}
+		
+		capture->sample_interval = interval < 1 ? 1 : (size_t)interval;
+		
+		if (capture->sample_interval > 1) {
+			capture->sample_log = log(1.0 - 1.0 / (double)capture->sample_interval);
+			capture->sample_skip = Memory_Profiler_Capture_sample_skip(capture);
+		}
+	}
+	
+	return self;
+}
+
+// Check whether every allocating class is tracked automatically.
+static VALUE Memory_Profiler_Capture_track_all_p(VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	return capture->track_all ? Qtrue : Qfalse;
+}
+
+// Check whether queued allocations are held weakly.
+static VALUE Memory_Profiler_Capture_weak_events_p(VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	return capture->weak_events ? Qtrue : Qfalse;
 }
 
-// Initialize capture
-static VALUE Memory_Profiler_Capture_initialize(VALUE self) {
-	return self;
+// Get the effective sample rate (1.0 means every allocation is recorded).
+static VALUE Memory_Profiler_Capture_sample_rate(VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	return DBL2NUM(1.0 / (double)capture->sample_interval);
 }
 
 // Start capturing allocations
@@ -392,6 +1353,9 @@ static VALUE Memory_Profiler_Capture_start(VALUE self) {
 	// It could fail and we want to raise an error if it does, here specifically.
 	Memory_Profiler_Events_instance();
 	
+	// Queued events refer to the capture by index:
+	capture->capture_index = Memory_Profiler_Events_register(self);
+	
 	// Add event hook for NEWOBJ and FREEOBJ with RAW_ARG to get trace_arg
 	rb_add_event_hook2(
 		(rb_event_hook_func_t)Memory_Profiler_Capture_event_callback,
@@ -400,6 +1364,12 @@ static VALUE Memory_Profiler_Capture_start(VALUE self) {
 		RUBY_EVENT_HOOK_FLAG_SAFE | RUBY_EVENT_HOOK_FLAG_RAW_ARG
 	);
 	
+	// The hook removes freed objects from the table itself, replacing the stopped hook:
+	Memory_Profiler_Capture_release_stopped_hook(self, capture, 1);
+	
+	// The hook forgets classes as they are freed, so they no longer need to be kept alive (or pinned):
+	capture->classes->weak = 1;
+	
 	// Set both flags - we're now running and callbacks are enabled
 	capture->running = 1;
 	capture->paused = 0;
@@ -414,65 +1384,164 @@ static VALUE Memory_Profiler_Capture_stop(VALUE self) {
 	
 	if (!capture->running) return Qfalse;
 	
+	if (capture->iterating) {
+		rb_raise(rb_eRuntimeError, "Cannot stop while iterating over objects!");
+	}
+	
+	// Flush any pending queued events while the hook is still installed, so that frees during the drain are still observed (and weak events of objects freed before they are processed are still annihilated). This ensures all callbacks are invoked and object_states is properly maintained:
+	Memory_Profiler_Events_process_all();
+	
+	// A callback may have stopped the capture already:
+	if (!capture->running) return Qtrue;
+	
+	// Classes are weak while the hook is installed. Disabling GC finishes any garbage collection in progress, so that every class it didn't mark is freed (and forgotten) before they are marked again, and no other starts until the hook is removed:
+	VALUE disabled = rb_gc_disable();
+	
+	capture->classes->weak = 0;
+	
+	// Classes are marked again, so they need a write barrier:
+	for (size_t index = 1; index < capture->classes->count; index++) {
+		RB_OBJ_WRITTEN(self, Qundef, capture->classes->entries[index].klass);
+	}
+	
 	// Remove event hook using same data (self) we registered with. No more events will be queued after this point:
 	rb_remove_event_hook_with_data((rb_event_hook_func_t)Memory_Profiler_Capture_event_callback, self);
 	
-	// Flush any pending queued events in the global queue before stopping.
-	// This ensures all callbacks are invoked and object_states is properly maintained.
+	// Recorded objects (including those of the final drain) can still be inspected, so their frees are still observed, only to remove them from the table:
+	rb_add_event_hook2(
+		(rb_event_hook_func_t)Memory_Profiler_Capture_stopped_callback,
+		RUBY_INTERNAL_EVENT_FREEOBJ,
+		self,
+		RUBY_EVENT_HOOK_FLAG_SAFE | RUBY_EVENT_HOOK_FLAG_RAW_ARG
+	);
+	capture->stopped_hook = 1;
+	capture->running = 0;
+	
+	// Events queued since the drain (e.g. by its callbacks) can no longer be annihilated, so their objects are retained until they are processed:
+	Memory_Profiler_Events_retain(capture->capture_index);
+	
+	if (disabled == Qfalse) {
+		rb_gc_enable();
+	}
+	
 	Memory_Profiler_Events_process_all();
 	
-	// Clear both flags - we're no longer running and callbacks are disabled
-	capture->running = 0;
+	Memory_Profiler_Events_unregister(capture->capture_index);
+	capture->capture_index = 0;
+	
+	Memory_Profiler_Capture_fold(self, capture);
+	
+	// No queued events refer to class indices any more. Unless recorded objects still do, only tracked classes need to be kept (and retained):
+	if (Memory_Profiler_Object_Table_size(capture->states) == 0) {
+		Memory_Profiler_Classes_prune(capture->classes);
+		capture->retired_count = 0;
+	}
+	
+	Memory_Profiler_Capture_release_stopped_hook(self, capture, 0);
+	
+	// Publish the final counters:
+	if (capture->export) {
+		Memory_Profiler_Capture_export_update(capture);
+	}
+	
+	// Callbacks are enabled again once restarted:
 	capture->paused = 0;
 	
 	return Qtrue;
 }
 
+// Set the number of frames captured for each allocation, creating the call tree they are recorded in.
+static void Memory_Profiler_Capture_track_depth(struct Memory_Profiler_Capture_Allocations *record, int depth) {
+	if (depth > 0 && !record->call_tree) {
+		record->call_tree = Memory_Profiler_Call_Tree_new();
+		
+		if (!record->call_tree) {
+			rb_raise(rb_eNoMemError, "Failed to allocate call tree");
+		}
+	}
+	
+	record->depth = depth;
+}
+
 // Add a class to track with optional callback
-// Usage: track(klass) or track(klass) { |obj, klass| ... }
-// Callback can call caller_locations with desired depth
+// Usage: track(klass) or track(klass, depth: 8) { |obj, klass| ... }
+// depth: captures up to that many frames of each allocation's stack natively (see `stacks`). Callbacks can instead call caller_locations themselves, but that is much slower.
 // Returns the Allocations object for the tracked class
 static VALUE Memory_Profiler_Capture_track(int argc, VALUE *argv, VALUE self) {
 	struct Memory_Profiler_Capture *capture;
 	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
 	
-	VALUE klass, callback;
-	rb_scan_args(argc, argv, "1&", &klass, &callback);
-		
-	st_data_t allocations_data;
-	VALUE allocations;
+	VALUE klass, options, callback;
+	rb_scan_args(argc, argv, "1:&", &klass, &options, &callback);
 	
-	if (st_lookup(capture->tracked, (st_data_t)klass, &allocations_data)) {
-		allocations = (VALUE)allocations_data;
-		struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
-		RB_OBJ_WRITE(self, &record->callback, callback);
-	} else {
-		struct Memory_Profiler_Capture_Allocations *record = ALLOC(struct Memory_Profiler_Capture_Allocations);
-		RB_OBJ_WRITE(self, &record->callback, callback);
-		record->new_count = 0;
-		record->free_count = 0;
-		// NOTE: States table removed - now at Capture level
+	int depth = 0;
+	if (!NIL_P(options)) {
+		ID keywords[1] = {rb_intern("depth")};
+		VALUE values[1] = {Qundef};
+		rb_get_kwargs(options, keywords, 0, 1, values);
 		
-		// Wrap the record in a VALUE
-		allocations = Memory_Profiler_Allocations_wrap(record);
-		
-		st_insert(capture->tracked, (st_data_t)klass, (st_data_t)allocations);
-		RB_OBJ_WRITTEN(self, Qnil, klass);
-		RB_OBJ_WRITTEN(self, Qnil, allocations);
+		if (values[0] != Qundef && !NIL_P(values[0])) {
+			depth = NUM2INT(values[0]);
+			
+			if (depth < 0 || depth > MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH) {
+				rb_raise(rb_eArgError, "depth must be between 0 and %d!", MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH);
+			}
+		}
+	}
+	
+	VALUE allocations = Memory_Profiler_Capture_tracked_allocations(capture, klass);
+	
+	if (NIL_P(allocations)) {
+		allocations = Memory_Profiler_Capture_track_class(self, capture, klass);
 	}
 	
+	struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
+	RB_OBJ_WRITE(allocations, &record->callback, callback);
+	record->batched = 0;
+	Memory_Profiler_Capture_track_depth(record, depth);
+	
 	return allocations;
 }
 
+// Arguments for matching the object table entries of a class.
+struct Memory_Profiler_Capture_Klass_Arguments {
+	struct Memory_Profiler_Capture *capture;
+	VALUE klass;
+};
+
+// Check whether an object table entry belongs to a class, by its class index (no lookup in `tracked`).
+static int Memory_Profiler_Capture_klass_entry_p(const struct Memory_Profiler_Object_Table_Entry *entry, void *arg) {
+	struct Memory_Profiler_Capture_Klass_Arguments *arguments = arg;
+	
+	uint32_t stack;
+	return Memory_Profiler_Capture_klass_of_index(arguments->capture, entry->klass, &stack) == arguments->klass;
+}
+
 // Stop tracking a class
 static VALUE Memory_Profiler_Capture_untrack(VALUE self, VALUE klass) {
 	struct Memory_Profiler_Capture *capture;
 	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
 	
-	st_data_t allocations_data;
-	if (st_delete(capture->tracked, (st_data_t *)&klass, &allocations_data)) {
+	uint32_t index = Memory_Profiler_Classes_find(capture->classes, klass);
+	
+	if (!NIL_P(Memory_Profiler_Classes_value(capture->classes, index))) {
 		// The wrapped Allocations VALUE will be GC'd naturally
 		// No manual cleanup needed
+		Memory_Profiler_Classes_set_value(capture->classes, index, Qnil);
+		Memory_Profiler_Capture_class_cache_evict(capture, klass);
+		
+		// The stacks' call tree nodes belong to the untracked record's tree:
+		Memory_Profiler_Stacks_remap_nodes(capture->stacks, klass, NULL);
+		
+		// Drop the class's recorded objects (and their callback data) in one pass, rather than leaving them to be discarded one free at a time:
+		struct Memory_Profiler_Capture_Klass_Arguments arguments = {
+			.capture = capture,
+			.klass = klass,
+		};
+		
+		Memory_Profiler_Object_Table_delete_if(capture->states, Memory_Profiler_Capture_klass_entry_p, &arguments);
+		
+		Memory_Profiler_Capture_release_stopped_hook(self, capture, 0);
 	}
 	
 	return self;
@@ -483,7 +1552,7 @@ static VALUE Memory_Profiler_Capture_tracking_p(VALUE self, VALUE klass) {
 	struct Memory_Profiler_Capture *capture;
 	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
 	
-	return st_lookup(capture->tracked, (st_data_t)klass, NULL) ? Qtrue : Qfalse;
+	return NIL_P(Memory_Profiler_Capture_tracked_allocations(capture, klass)) ? Qfalse : Qtrue;
 }
 
 // Get count of live objects for a specific class (O(1) lookup!)
@@ -491,9 +1560,8 @@ static VALUE Memory_Profiler_Capture_retained_count_of(VALUE self, VALUE klass)
 	struct Memory_Profiler_Capture *capture;
 	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
 	
-	st_data_t allocations_data;
-	if (st_lookup(capture->tracked, (st_data_t)klass, &allocations_data)) {
-		VALUE allocations = (VALUE)allocations_data;
+	VALUE allocations = Memory_Profiler_Capture_tracked_allocations(capture, klass);
+	if (!NIL_P(allocations)) {
 		struct Memory_Profiler_Capture_Allocations *record = Memory_Profiler_Allocations_get(allocations);
 		if (record->free_count <= record->new_count) {
 			return SIZET2NUM(record->new_count - record->free_count);
@@ -503,15 +1571,6 @@ static VALUE Memory_Profiler_Capture_retained_count_of(VALUE self, VALUE klass)
 	return INT2FIX(0);
 }
 
-// Iterator to reset each class record
-static int Memory_Profiler_Capture_tracked_clear(st_data_t key, st_data_t value, st_data_t arg) {
-	VALUE allocations = (VALUE)value;
-	
-	Memory_Profiler_Allocations_clear(allocations);
-	
-	return ST_CONTINUE;
-}
-
 // Clear all allocation tracking (resets all counts to 0)
 static VALUE Memory_Profiler_Capture_clear(VALUE self) {
 	struct Memory_Profiler_Capture *capture;
@@ -525,8 +1584,22 @@ static VALUE Memory_Profiler_Capture_clear(VALUE self) {
 		rb_raise(rb_eRuntimeError, "Cannot clear while capture is running - call stop() first!");
 	}
 	
+	if (capture->iterating) {
+		rb_raise(rb_eRuntimeError, "Cannot clear while iterating over objects!");
+	}
+	
 	// Reset all counts to 0 (don't free, just reset):
-	st_foreach(capture->tracked, Memory_Profiler_Capture_tracked_clear, 0);
+	for (size_t index = 1; index < capture->classes->count; index++) {
+		VALUE allocations = capture->classes->entries[index].value;
+		
+		if (!NIL_P(allocations)) {
+			Memory_Profiler_Allocations_clear(allocations);
+		}
+	}
+	
+	// Allocations of freed classes are discarded:
+	capture->folded = Qnil;
+	capture->folded_count = 0;
 	
 	// Clear custom object table by recreating it
 	if (capture->states) {
@@ -534,24 +1607,27 @@ static VALUE Memory_Profiler_Capture_clear(VALUE self) {
 		capture->states = Memory_Profiler_Object_Table_new(1024);
 	}
 	
+	// No recorded object refers to the epoch base any more:
+	capture->epoch_base = rb_gc_count();
+	
+	Memory_Profiler_Capture_release_stopped_hook(self, capture, 1);
+	
+	// No recorded object refers to class indices any more:
+	Memory_Profiler_Classes_prune(capture->classes);
+	capture->retired_count = 0;
+	
+	// Stacks hold per-stack counts, and no recorded object refers to them any more:
+	Memory_Profiler_Stacks_clear(capture->stacks);
+	
 	// Reset allocation tracking counters
 	capture->new_count = 0;
 	capture->free_count = 0;
+	capture->dropped_count = 0;
+	capture->filtered_count = 0;
 	
 	return self;
 }
 
-// Iterator callback for each
-static int Memory_Profiler_Capture_each_allocation(st_data_t key, st_data_t value, st_data_t arg) {
-	VALUE klass = (VALUE)key;
-	VALUE allocations = (VALUE)value;  // Already a wrapped VALUE
-	
-	// Yield class and allocations wrapper
-	rb_yield_values(2, klass, allocations);
-	
-	return ST_CONTINUE;
-}
-
 // Iterate over all tracked classes with their allocation data
 static VALUE Memory_Profiler_Capture_each(VALUE self) {
 	struct Memory_Profiler_Capture *capture;
@@ -559,73 +1635,86 @@ static VALUE Memory_Profiler_Capture_each(VALUE self) {
 	
 	RETURN_ENUMERATOR(self, 0, 0);
 	
-	st_foreach(capture->tracked, Memory_Profiler_Capture_each_allocation, 0);
+	// The block may track more classes, so the registry is reloaded for every class:
+	for (size_t index = 1; index < capture->classes->count; index++) {
+		struct Memory_Profiler_Classes_Entry entry = capture->classes->entries[index];
+		
+		// Skip freed classes, and classes that are only referenced by events or recorded objects:
+		if (NIL_P(entry.klass) || NIL_P(entry.value)) continue;
+		
+		// Yield class and allocations wrapper
+		rb_yield_values(2, entry.klass, entry.value);
+	}
 	
 	return self;
 }
 
-// Struct for filtering states during each_object iteration
+// Struct for copying the entries of each_object
 struct Memory_Profiler_Each_Object_Arguments {
 	VALUE self;
+	struct Memory_Profiler_Capture *capture;
 	
-	// The allocations wrapper to filter by (Qnil = no filter).
+	// The class to filter by (Qnil = no filter), and its allocations wrapper.
+	VALUE klass;
 	VALUE allocations;
+	
+	// Pairs of object and allocations, copied from the table before any is yielded:
+	VALUE *pairs;
+	size_t count;
+	size_t capacity;
 };
 
-// Cleanup function to re-enable GC
-static VALUE Memory_Profiler_Capture_each_object_ensure(VALUE arg) {
-	// Re-enable GC (rb_gc_enable returns previous state, but we don't need it)
-	rb_gc_enable();
+// Copy one object table entry
+static void Memory_Profiler_Capture_each_object_entry(const struct Memory_Profiler_Object_Table_Entry *entry, void *arg) {
+	struct Memory_Profiler_Each_Object_Arguments *arguments = arg;
 	
-	return Qnil;
+	if (arguments->count == arguments->capacity) return;
+	
+	uint32_t stack;
+	VALUE klass = Memory_Profiler_Capture_klass_of_index(arguments->capture, entry->klass, &stack);
+	
+	VALUE allocations;
+	
+	// Filter by class index, so that entries of other classes are skipped without looking up their allocations:
+	if (!NIL_P(arguments->klass)) {
+		if (klass != arguments->klass) return;
+		
+		allocations = arguments->allocations;
+	} else {
+		allocations = Memory_Profiler_Capture_index_allocations(arguments->capture, entry->klass);
+	}
+	
+	arguments->pairs[arguments->count * 2] = entry->object;
+	arguments->pairs[arguments->count * 2 + 1] = allocations;
+	arguments->count++;
 }
 
-// Main iteration function
+// Yield the copied entries
 static VALUE Memory_Profiler_Capture_each_object_body(VALUE arg) {
 	struct Memory_Profiler_Each_Object_Arguments *arguments = (struct Memory_Profiler_Each_Object_Arguments *)arg;
-	struct Memory_Profiler_Capture *capture;
-	TypedData_Get_Struct(arguments->self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
 	
-	// Iterate custom object table entries
-	if (capture->states) {
-		if (DEBUG) fprintf(stderr, "[ITER] Iterating table, capacity=%zu, count=%zu\n", capture->states->capacity, capture->states->count);
-		
-		for (size_t i = 0; i < capture->states->capacity; i++) {
-			struct Memory_Profiler_Object_Table_Entry *entry = &capture->states->entries[i];
-			
-			// Skip empty or deleted slots (0 = not set)
-			if (entry->object == 0) {
-				continue;
-			}
-			
-			// Look up allocations from klass
-			st_data_t allocations_data;
-			VALUE allocations = Qnil;
-			if (st_lookup(capture->tracked, (st_data_t)entry->klass, &allocations_data)) {
-				allocations = (VALUE)allocations_data;
-			}
-			
-			// Filter by allocations if specified
-			if (!NIL_P(arguments->allocations)) {
-				if (allocations != arguments->allocations) continue;
-			}
-			
-			rb_yield_values(2, entry->object, allocations);
-		}
+	for (size_t i = 0; i < arguments->count; i++) {
+		rb_yield_values(2, arguments->pairs[i * 2], arguments->pairs[i * 2 + 1]);
 	}
 	
 	return arguments->self;
 }
 
-// Iterate over tracked object IDs, optionally filtered by class
+// Allow the capture to be stopped and cleared again
+static VALUE Memory_Profiler_Capture_each_object_ensure(VALUE arg) {
+	struct Memory_Profiler_Each_Object_Arguments *arguments = (struct Memory_Profiler_Each_Object_Arguments *)arg;
+	
+	arguments->capture->iterating -= 1;
+	
+	return Qnil;
+}
+
+// Iterate over tracked objects, optionally filtered by class
 // Called as: 
-//   capture.each_object(String) { |object_id, state| ... }  # Specific class
-//   capture.each_object { |object_id, state| ... }          // All objects
+//   capture.each_object(String) { |object, allocations| ... }  # Specific class
+//   capture.each_object { |object, allocations| ... }          // All objects
 // 
-// Yields object_id as Integer. Caller can:
-//   - Format as hex: "0x%x" % object_id
-//   - Convert to object with ObjectSpace._id2ref (may raise RangeError if recycled)
-// Future-proof for Ruby 3.5 where _id2ref is deprecated
+// The objects are copied before the first is yielded, so the block may allocate (growing the table) without objects being skipped or repeated. The capture can't be stopped or cleared by the block.
 static VALUE Memory_Profiler_Capture_each_object(int argc, VALUE *argv, VALUE self) {
 	struct Memory_Profiler_Capture *capture;
 	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
@@ -635,38 +1724,282 @@ static VALUE Memory_Profiler_Capture_each_object(int argc, VALUE *argv, VALUE se
 	
 	RETURN_ENUMERATOR(self, argc, argv);
 	
-	// Disable GC to prevent objects from being collected during iteration
-	rb_gc_disable();
-	
-	// Process all pending events to clean up stale entries
-	// At this point, all remaining objects in the table should be valid
+	// Process all pending events, so that the table is up to date:
 	Memory_Profiler_Events_process_all();
 	
 	// If class provided, look up its allocations wrapper
 	VALUE allocations = Qnil;
 	if (!NIL_P(klass)) {
-		st_data_t allocations_data;
-		if (st_lookup(capture->tracked, (st_data_t)klass, &allocations_data)) {
-			allocations = (VALUE)allocations_data;
-		} else {
-			// Class not tracked - nothing to iterate
-			// Re-enable GC before returning
-			rb_gc_enable();
-			return self;
-		}
+		allocations = Memory_Profiler_Capture_tracked_allocations(capture, klass);
+		
+		// Class not tracked - nothing to iterate:
+		if (NIL_P(allocations)) return self;
 	}
 	
-	// Setup arguments for iteration
+	// Disabling GC finishes any sweep in progress, so that the table holds no object that is already dead, and keeps it that way while it is copied:
+	VALUE disabled = rb_gc_disable();
+	
 	struct Memory_Profiler_Each_Object_Arguments arguments = {
 		.self = self,
-		.allocations = allocations
+		.capture = capture,
+		.klass = klass,
+		.allocations = allocations,
+		.count = 0,
+		.capacity = Memory_Profiler_Object_Table_size(capture->states),
 	};
 	
-	// Use rb_ensure to guarantee cleanup even if exception is raised
-	return rb_ensure(
+	// The buffer is scanned conservatively by GC, so the copied objects stay alive until they are yielded:
+	VALUE buffer;
+	arguments.pairs = ALLOCV_N(VALUE, buffer, arguments.capacity * 2);
+	
+	Memory_Profiler_Object_Table_each(capture->states, Memory_Profiler_Capture_each_object_entry, &arguments);
+	
+	if (disabled == Qfalse) {
+		rb_gc_enable();
+	}
+	
+	capture->iterating += 1;
+	
+	rb_ensure(
 		Memory_Profiler_Capture_each_object_body, (VALUE)&arguments,
 		Memory_Profiler_Capture_each_object_ensure, (VALUE)&arguments
 	);
+	
+	ALLOCV_END(buffer);
+	
+	return self;
+}
+
+// Get the call tree of a class tracked with `depth:` (see NativeCallTree), or nil.
+// The tree is updated as allocations are recorded and freed, without running any Ruby code.
+static VALUE Memory_Profiler_Capture_call_tree(VALUE self, VALUE klass) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	VALUE allocations = Memory_Profiler_Capture_tracked_allocations(capture, klass);
+	if (NIL_P(allocations)) {
+		return Qnil;
+	}
+	
+	if (!Memory_Profiler_Allocations_get(allocations)->call_tree) {
+		return Qnil;
+	}
+	
+	return Memory_Profiler_Call_Tree_wrap(self, klass, allocations);
+}
+
+// Get the allocation stacks of a class tracked with `depth:`, as an array of [locations, count, retained_count].
+// Frames are symbolized into "path:line:in 'label'" strings on demand, innermost first.
+static VALUE Memory_Profiler_Capture_stacks(VALUE self, VALUE klass) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	// Count any allocations and frees which are still queued:
+	Memory_Profiler_Events_process_all();
+	
+	VALUE result = rb_ary_new();
+	
+	// Symbolizing allocates, and interning a new stack could move the frame storage:
+	capture->paused += 1;
+	
+	for (uint32_t index = 1; index < capture->stacks->count; index++) {
+		struct Memory_Profiler_Stack *stack = Memory_Profiler_Stacks_get(capture->stacks, index);
+		if (stack->klass != klass) continue;
+		
+		size_t retained = stack->free_count > stack->new_count ? 0 : stack->new_count - stack->free_count;
+		
+		rb_ary_push(result, rb_ary_new_from_args(3,
+			Memory_Profiler_Stacks_locations(capture->stacks, stack),
+			SIZET2NUM(stack->new_count),
+			SIZET2NUM(retained)
+		));
+	}
+	
+	capture->paused -= 1;
+	
+	return result;
+}
+
+struct Memory_Profiler_Capture_Age_Histogram_Arguments {
+	struct Memory_Profiler_Capture *capture;
+	VALUE klass;
+	size_t counts[MEMORY_PROFILER_HISTOGRAM_SIZE];
+};
+
+// Count one object table entry in its age bucket
+static void Memory_Profiler_Capture_age_histogram_entry(const struct Memory_Profiler_Object_Table_Entry *entry, void *arg) {
+	struct Memory_Profiler_Capture_Age_Histogram_Arguments *arguments = arg;
+	
+	uint32_t stack;
+	if (Memory_Profiler_Capture_klass_of_index(arguments->capture, entry->klass, &stack) != arguments->klass) return;
+	
+	arguments->counts[Memory_Profiler_Histogram_bucket(Memory_Profiler_Capture_age(arguments->capture, entry->epoch))] += arguments->capture->sample_interval * entry->weight;
+}
+
+// Get the ages of the live objects of a tracked class, in garbage collections (GC.count) since they were allocated, as a histogram of log2 ranges.
+// Element 0 counts objects allocated since the last GC, and element i counts objects that survived 2**(i-1) to 2**i - 1 GCs. Trailing empty buckets are omitted.
+// Counts are scaled like retained_count when sampling. Returns nil if the class is not tracked.
+static VALUE Memory_Profiler_Capture_age_histogram(VALUE self, VALUE klass) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	if (NIL_P(Memory_Profiler_Capture_tracked_allocations(capture, klass))) {
+		return Qnil;
+	}
+	
+	// Count any allocations and frees which are still queued:
+	Memory_Profiler_Events_process_all();
+	
+	struct Memory_Profiler_Capture_Age_Histogram_Arguments arguments = {
+		.capture = capture,
+		.klass = klass,
+	};
+	
+	// Counting doesn't allocate, so the table can't change during the pass:
+	Memory_Profiler_Object_Table_each(capture->states, Memory_Profiler_Capture_age_histogram_entry, &arguments);
+	
+	return Memory_Profiler_Histogram_array(arguments.counts);
+}
+
+struct Memory_Profiler_Capture_Snapshot_Arguments {
+	struct Memory_Profiler_Capture *capture;
+	struct Memory_Profiler_Snapshot_Entry *entries;
+	size_t count;
+	size_t capacity;
+};
+
+// Copy one object table entry into the snapshot, with its class as an index into the class registry (stacks are resolved to their class).
+static void Memory_Profiler_Capture_snapshot_entry(const struct Memory_Profiler_Object_Table_Entry *entry, void *arg) {
+	struct Memory_Profiler_Capture_Snapshot_Arguments *arguments = arg;
+	
+	// Nothing is inserted while copying, so the table can't grow past the entries allocated up front:
+	if (arguments->count == arguments->capacity) return;
+	
+	uint32_t klass_index = entry->klass;
+	
+	if (klass_index & MEMORY_PROFILER_EVENT_KLASS_STACK) {
+		struct Memory_Profiler_Stack *stack = Memory_Profiler_Stacks_get(arguments->capture->stacks, klass_index & ~MEMORY_PROFILER_EVENT_KLASS_STACK);
+		klass_index = stack ? Memory_Profiler_Classes_find(arguments->capture->classes, stack->klass) : 0;
+	}
+	
+	arguments->entries[arguments->count++] = (struct Memory_Profiler_Snapshot_Entry){
+		.address = (uint64_t)entry->object,
+		.klass = klass_index,
+		// The GC count at allocation (truncated), which doesn't change when the epoch base is moved, or 0 if it is no longer known:
+		.epoch = entry->epoch ? (uint16_t)(arguments->capture->epoch_base + entry->epoch - 1) : 0,
+		.weight = (uint16_t)entry->weight,
+	};
+}
+
+// Take a snapshot of the recorded (live) objects, see Memory::Profiler::Snapshot.
+// Objects are copied as addresses in a single table pass, without allocating any Ruby objects per object.
+static VALUE Memory_Profiler_Capture_snapshot(VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	// Record any allocations and frees which are still queued:
+	Memory_Profiler_Events_process_all();
+	
+	struct Memory_Profiler_Capture_Snapshot_Arguments arguments = {
+		.capture = capture,
+		.capacity = Memory_Profiler_Object_Table_size(capture->states),
+	};
+	
+	arguments.entries = ALLOC_N(struct Memory_Profiler_Snapshot_Entry, arguments.capacity);
+	
+	// Copying doesn't allocate, so the table can't change during the pass:
+	Memory_Profiler_Object_Table_each(capture->states, Memory_Profiler_Capture_snapshot_entry, &arguments);
+	
+	// Map class registry indices to snapshot class indices (freed classes have no live objects, so their entries are dropped):
+	VALUE classes = rb_ary_new();
+	VALUE map_buffer;
+	uint32_t *map = ALLOCV_N(uint32_t, map_buffer, capture->classes->count);
+	memset(map, 0, capture->classes->count * sizeof(uint32_t));
+	
+	size_t count = 0;
+	
+	for (size_t index = 0; index < arguments.count; index++) {
+		struct Memory_Profiler_Snapshot_Entry entry = arguments.entries[index];
+		
+		if (!map[entry.klass]) {
+			VALUE klass = Memory_Profiler_Classes_get(capture->classes, entry.klass);
+			
+			if (NIL_P(klass)) {
+				map[entry.klass] = UINT32_MAX;
+			} else {
+				rb_ary_push(classes, klass);
+				map[entry.klass] = (uint32_t)RARRAY_LEN(classes);
+			}
+		}
+		
+		if (map[entry.klass] == UINT32_MAX) continue;
+		
+		entry.klass = map[entry.klass] - 1;
+		arguments.entries[count++] = entry;
+	}
+	
+	ALLOCV_END(map_buffer);
+	
+	return Memory_Profiler_Snapshot_new(arguments.entries, count, classes, capture->sample_interval);
+}
+
+// Export the counters to a shared memory segment, for a sidecar process to read (see Memory::Profiler::Export).
+// Usage: capture.export("/dev/shm/memory-profiler.#{Process.pid}", capacity: 1024, interval: 0.1), or capture.export(nil) to stop.
+// The segment is updated from the event hook at most once per interval (in seconds), when the capture stops, and when export is called. It holds up to capacity tracked classes. The path must not already exist: it is created readable only by this user, and unlinked when exporting stops or the capture is freed.
+static VALUE Memory_Profiler_Capture_export(int argc, VALUE *argv, VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
+	
+	VALUE path, options;
+	rb_scan_args(argc, argv, "1:", &path, &options);
+	
+	ID keywords[2] = {rb_intern("capacity"), rb_intern("interval")};
+	VALUE values[2] = {Qundef, Qundef};
+	
+	if (!NIL_P(options)) {
+		rb_get_kwargs(options, keywords, 0, 2, values);
+	}
+	
+	size_t capacity = 1024;
+	if (values[0] != Qundef) {
+		capacity = NUM2SIZET(values[0]);
+		
+		if (capacity == 0 || capacity > UINT32_MAX) {
+			rb_raise(rb_eArgError, "capacity must be between 1 and %u!", UINT32_MAX);
+		}
+	}
+	
+	double interval = 0.1;
+	if (values[1] != Qundef) {
+		interval = NUM2DBL(values[1]);
+		
+		if (!(interval >= 0.0 && interval < 1e9)) {
+			rb_raise(rb_eArgError, "interval must be a non-negative number of seconds!");
+		}
+	}
+	
+	if (!NIL_P(path)) {
+		FilePathValue(path);
+	}
+	
+	if (capture->export) {
+		Memory_Profiler_Export_close(capture->export);
+		capture->export = NULL;
+	}
+	
+	if (NIL_P(path)) return Qnil;
+	
+	struct Memory_Profiler_Export *export = Memory_Profiler_Export_open(StringValueCStr(path), capacity, (uint64_t)(interval * 1e9));
+	
+	if (!export) {
+		if (errno == 0) errno = ENOMEM;
+		rb_sys_fail_str(path);
+	}
+	
+	capture->export = export;
+	Memory_Profiler_Capture_export_update(capture);
+	
+	return path;
 }
 
 // Get allocations for a specific class
@@ -674,12 +2007,17 @@ static VALUE Memory_Profiler_Capture_aref(VALUE self, VALUE klass) {
 	struct Memory_Profiler_Capture *capture;
 	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
 	
-	st_data_t allocations_data;
-	if (st_lookup(capture->tracked, (st_data_t)klass, &allocations_data)) {
-		return (VALUE)allocations_data;
-	}
+	return Memory_Profiler_Capture_tracked_allocations(capture, klass);
+}
+
+// Get the allocations of classes that were freed while they were tracked, folded together by name: the class's own name, or for anonymous classes (e.g. from Class.new or Struct.new), the name of their nearest named superclass.
+static VALUE Memory_Profiler_Capture_folded(VALUE self) {
+	struct Memory_Profiler_Capture *capture;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Capture, &Memory_Profiler_Capture_type, capture);
 	
-	return Qnil;
+	Memory_Profiler_Capture_fold(self, capture);
+	
+	return NIL_P(capture->folded) ? rb_hash_new() : rb_hash_dup(capture->folded);
 }
 
 // Struct to accumulate statistics during iteration
@@ -697,12 +2035,35 @@ static VALUE Memory_Profiler_Capture_statistics(VALUE self) {
 	VALUE statistics = rb_hash_new();
 	
 	// Tracked classes count
-	rb_hash_aset(statistics, ID2SYM(rb_intern("tracked_count")), SIZET2NUM(capture->tracked->num_entries));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("tracked_count")), SIZET2NUM(Memory_Profiler_Capture_tracked_count(capture)));
+	
+	// Tracked classes that were freed, and folded into `folded`
+	rb_hash_aset(statistics, ID2SYM(rb_intern("folded_count")), SIZET2NUM(capture->folded_count + capture->freed_count));
 	
 	// Custom object table size
 	size_t states_size = capture->states ? Memory_Profiler_Object_Table_size(capture->states) : 0;
 	rb_hash_aset(statistics, ID2SYM(rb_intern("object_table_size")), SIZET2NUM(states_size));
 	
+	// Custom object table capacity, tombstones and rebuilds
+	if (capture->states) {
+		rb_hash_aset(statistics, ID2SYM(rb_intern("object_table")), Memory_Profiler_Object_Table_statistics(capture->states));
+	}
+	
+	// Classes in the registry, including freed classes whose index can't be reused yet
+	rb_hash_aset(statistics, ID2SYM(rb_intern("class_registry_size")), SIZET2NUM(capture->classes->count - 1 - capture->classes->free_count));
+	
+	// Unique allocation stacks captured
+	rb_hash_aset(statistics, ID2SYM(rb_intern("stack_table_size")), SIZET2NUM(capture->stacks->count - 1));
+	
+	// Allocations lost to the event queue's memory limit
+	rb_hash_aset(statistics, ID2SYM(rb_intern("dropped_count")), SIZET2NUM(capture->dropped_count));
+	
+	// Frees of objects that were never recorded, discarded before they reached the queue or the table
+	rb_hash_aset(statistics, ID2SYM(rb_intern("filtered_count")), SIZET2NUM(capture->filtered_count));
+	
+	// Global event queue (shared by all captures):
+	rb_hash_aset(statistics, ID2SYM(rb_intern("events")), Memory_Profiler_Events_statistics());
+	
 	return statistics;
 }
 
@@ -736,6 +2097,7 @@ void Init_Memory_Profiler_Capture(VALUE Memory_Profiler)
 {
 	// Initialize event symbols
 	sym_newobj = ID2SYM(rb_intern("newobj"));
+	id_call = rb_intern("call");
 	sym_freeobj = ID2SYM(rb_intern("freeobj"));
 	rb_gc_register_mark_object(sym_newobj);
 	rb_gc_register_mark_object(sym_freeobj);
@@ -743,7 +2105,7 @@ void Init_Memory_Profiler_Capture(VALUE Memory_Profiler)
 	Memory_Profiler_Capture = rb_define_class_under(Memory_Profiler, "Capture", rb_cObject);
 	rb_define_alloc_func(Memory_Profiler_Capture, Memory_Profiler_Capture_alloc);
 	
-	rb_define_method(Memory_Profiler_Capture, "initialize", Memory_Profiler_Capture_initialize, 0);
+	rb_define_method(Memory_Profiler_Capture, "initialize", Memory_Profiler_Capture_initialize, -1);
 	rb_define_method(Memory_Profiler_Capture, "start", Memory_Profiler_Capture_start, 0);
 	rb_define_method(Memory_Profiler_Capture, "stop", Memory_Profiler_Capture_stop, 0);
 	rb_define_method(Memory_Profiler_Capture, "track", Memory_Profiler_Capture_track, -1);  // -1 to accept block
@@ -753,12 +2115,30 @@ void Init_Memory_Profiler_Capture(VALUE Memory_Profiler)
 	rb_define_method(Memory_Profiler_Capture, "each", Memory_Profiler_Capture_each, 0);
 	rb_define_method(Memory_Profiler_Capture, "each_object", Memory_Profiler_Capture_each_object, -1);  // -1 = variable args
 	rb_define_method(Memory_Profiler_Capture, "[]", Memory_Profiler_Capture_aref, 1);
+	rb_define_method(Memory_Profiler_Capture, "folded", Memory_Profiler_Capture_folded, 0);
+	rb_define_method(Memory_Profiler_Capture, "stacks", Memory_Profiler_Capture_stacks, 1);
+	rb_define_method(Memory_Profiler_Capture, "age_histogram", Memory_Profiler_Capture_age_histogram, 1);
+	rb_define_method(Memory_Profiler_Capture, "snapshot", Memory_Profiler_Capture_snapshot, 0);
+	rb_define_method(Memory_Profiler_Capture, "export", Memory_Profiler_Capture_export, -1);
+	rb_define_method(Memory_Profiler_Capture, "call_tree", Memory_Profiler_Capture_call_tree, 1);
 	rb_define_method(Memory_Profiler_Capture, "clear", Memory_Profiler_Capture_clear, 0);
 	rb_define_method(Memory_Profiler_Capture, "statistics", Memory_Profiler_Capture_statistics, 0);
 	rb_define_method(Memory_Profiler_Capture, "new_count", Memory_Profiler_Capture_new_count, 0);
 	rb_define_method(Memory_Profiler_Capture, "free_count", Memory_Profiler_Capture_free_count, 0);
 	rb_define_method(Memory_Profiler_Capture, "retained_count", Memory_Profiler_Capture_retained_count, 0);
+	rb_define_method(Memory_Profiler_Capture, "sample_rate", Memory_Profiler_Capture_sample_rate, 0);
+	rb_define_method(Memory_Profiler_Capture, "track_all?", Memory_Profiler_Capture_track_all_p, 0);
+	rb_define_method(Memory_Profiler_Capture, "weak_events?", Memory_Profiler_Capture_weak_events_p, 0);
 	
 	// Initialize Allocations class
 	Init_Memory_Profiler_Allocations(Memory_Profiler);
+	
+	// Initialize Events module
+	Init_Memory_Profiler_Events(Memory_Profiler);
+	
+	// Initialize NativeCallTree class
+	Init_Memory_Profiler_Call_Tree(Memory_Profiler);
+	
+	// Initialize Snapshot class
+	Init_Memory_Profiler_Snapshot(Memory_Profiler);
 }
@@ -8,9 +8,21 @@
 // Initialize the Capture module.
 void Init_Memory_Profiler_Capture(VALUE Memory_Profiler);
 
+// Get the stack table of a capture, which interns the frames of its call trees.
+struct Memory_Profiler_Stacks* Memory_Profiler_Capture_stack_table(VALUE capture);
+
 // Forward declaration.
 struct Memory_Profiler_Event;
 
-// Process a single event. Called from the global event queue processor.
+// Process a single event for the given capture. Called from the global event queue processor.
 // This is wrapped with rb_protect to catch exceptions.
-void Memory_Profiler_Capture_process_event(struct Memory_Profiler_Event *event);
+void Memory_Profiler_Capture_process_event(VALUE capture, struct Memory_Profiler_Event *event);
+
+// Whether the capture has batches of events waiting for their callbacks (see Allocations#track_batch), or freed classes to fold.
+int Memory_Profiler_Capture_flush_pending_p(VALUE capture);
+
+// Fold the allocations of freed classes, and invoke the callback of the next pending batch. Called at the end of each drain, wrapped with rb_protect.
+void Memory_Profiler_Capture_flush(VALUE capture);
+
+// Called when processing an event raised an exception, to undo any state left behind (e.g. the capture being paused).
+void Memory_Profiler_Capture_process_event_failed(VALUE capture);
@@ -0,0 +1,266 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "classes.h"
+#include "events.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	INITIAL_CAPACITY = 64,
+};
+
+struct Memory_Profiler_Classes* Memory_Profiler_Classes_new(void) {
+	struct Memory_Profiler_Classes *classes = malloc(sizeof(struct Memory_Profiler_Classes));
+	
+	if (!classes) {
+		return NULL;
+	}
+	
+	classes->count = 1;
+	classes->capacity = INITIAL_CAPACITY;
+	classes->entries = calloc(classes->capacity, sizeof(struct Memory_Profiler_Classes_Entry));
+	
+	classes->slots_capacity = INITIAL_CAPACITY * 2;
+	classes->slots = calloc(classes->slots_capacity, sizeof(uint32_t));
+	
+	classes->weak = 0;
+	
+	classes->free = NULL;
+	classes->free_count = 0;
+	classes->free_capacity = 0;
+	
+	if (!classes->entries || !classes->slots) {
+		Memory_Profiler_Classes_free(classes);
+		return NULL;
+	}
+	
+	// Index 0 means "no class":
+	classes->entries[0].klass = Qnil;
+	classes->entries[0].value = Qnil;
+	
+	return classes;
+}
+
+void Memory_Profiler_Classes_free(struct Memory_Profiler_Classes *classes) {
+	if (classes) {
+		free(classes->entries);
+		free(classes->slots);
+		free(classes->free);
+		free(classes);
+	}
+}
+
+static inline size_t Memory_Profiler_Classes_hash(VALUE klass) {
+	return (size_t)((((uint64_t)klass >> 3) * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+// Find the slot for a class: either the slot containing its index, or the empty slot where it belongs.
+static inline uint32_t *Memory_Profiler_Classes_slot(struct Memory_Profiler_Classes *classes, uint32_t *slots, size_t slots_capacity, VALUE klass) {
+	size_t mask = slots_capacity - 1;
+	size_t index = Memory_Profiler_Classes_hash(klass) & mask;
+	
+	while (slots[index] && classes->entries[slots[index]].klass != klass) {
+		index = (index + 1) & mask;
+	}
+	
+	return &slots[index];
+}
+
+// Insert the index of every class that hasn't been forgotten into the (empty) slots.
+static void Memory_Profiler_Classes_rehash(struct Memory_Profiler_Classes *classes, uint32_t *slots, size_t slots_capacity) {
+	for (uint32_t index = 1; index < classes->count; index++) {
+		VALUE klass = classes->entries[index].klass;
+		
+		if (!NIL_P(klass)) {
+			*Memory_Profiler_Classes_slot(classes, slots, slots_capacity, klass) = index;
+		}
+	}
+}
+
+// Double the map capacity and reinsert every class.
+static int Memory_Profiler_Classes_resize_slots(struct Memory_Profiler_Classes *classes) {
+	size_t slots_capacity = classes->slots_capacity * 2;
+	uint32_t *slots = calloc(slots_capacity, sizeof(uint32_t));
+	
+	if (!slots) return 0;
+	
+	Memory_Profiler_Classes_rehash(classes, slots, slots_capacity);
+	
+	free(classes->slots);
+	classes->slots = slots;
+	classes->slots_capacity = slots_capacity;
+	
+	return 1;
+}
+
+uint32_t Memory_Profiler_Classes_intern(struct Memory_Profiler_Classes *classes, VALUE klass) {
+	uint32_t *slot = Memory_Profiler_Classes_slot(classes, classes->slots, classes->slots_capacity, klass);
+	
+	if (*slot) {
+		return *slot;
+	}
+	
+	// Reuse a released index (the map can't fill up, as its class was removed from it):
+	if (classes->free_count > 0) {
+		uint32_t index = classes->free[--classes->free_count];
+		classes->entries[index].klass = klass;
+		classes->entries[index].value = Qnil;
+		*slot = index;
+		
+		return index;
+	}
+	
+	// Indices stay below the stack tag, so that they fit in the object table (see MEMORY_PROFILER_EVENT_KLASS_STACK):
+	if (classes->count >= MEMORY_PROFILER_EVENT_KLASS_STACK) return 0;
+	
+	// Keep the map at most half full (forgotten classes keep their index, so this over-estimates):
+	if ((classes->count + 1) * 2 > classes->slots_capacity) {
+		if (!Memory_Profiler_Classes_resize_slots(classes)) return 0;
+		slot = Memory_Profiler_Classes_slot(classes, classes->slots, classes->slots_capacity, klass);
+	}
+	
+	if (classes->count == classes->capacity) {
+		struct Memory_Profiler_Classes_Entry *entries = realloc(classes->entries, classes->capacity * 2 * sizeof(struct Memory_Profiler_Classes_Entry));
+		if (!entries) return 0;
+		
+		classes->entries = entries;
+		classes->capacity *= 2;
+	}
+	
+	uint32_t index = (uint32_t)classes->count++;
+	classes->entries[index].klass = klass;
+	classes->entries[index].value = Qnil;
+	*slot = index;
+	
+	return index;
+}
+
+uint32_t Memory_Profiler_Classes_find(struct Memory_Profiler_Classes *classes, VALUE klass) {
+	if (NIL_P(klass)) return 0;
+	
+	return *Memory_Profiler_Classes_slot(classes, classes->slots, classes->slots_capacity, klass);
+}
+
+void Memory_Profiler_Classes_set_value(struct Memory_Profiler_Classes *classes, uint32_t index, VALUE value) {
+	if (index == 0 || index >= classes->count) return;
+	
+	classes->entries[index].value = value;
+}
+
+uint32_t Memory_Profiler_Classes_forget(struct Memory_Profiler_Classes *classes, VALUE klass) {
+	uint32_t *slot = Memory_Profiler_Classes_slot(classes, classes->slots, classes->slots_capacity, klass);
+	uint32_t index = *slot;
+	
+	if (!index) return 0;
+	
+	classes->entries[index].klass = Qnil;
+	
+	// Backward shift deletion, so that no probe sequence is broken (and no tombstones are needed):
+	size_t mask = classes->slots_capacity - 1;
+	size_t hole = slot - classes->slots;
+	size_t next = (hole + 1) & mask;
+	
+	while (classes->slots[next]) {
+		size_t home = Memory_Profiler_Classes_hash(classes->entries[classes->slots[next]].klass) & mask;
+		
+		// The entry can move into the hole if its home isn't cyclically within (hole, next]:
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			classes->slots[hole] = classes->slots[next];
+			hole = next;
+		}
+		
+		next = (next + 1) & mask;
+	}
+	
+	classes->slots[hole] = 0;
+	
+	return index;
+}
+
+int Memory_Profiler_Classes_release(struct Memory_Profiler_Classes *classes, uint32_t index) {
+	if (index == 0 || index >= classes->count || !NIL_P(classes->entries[index].klass)) return 0;
+	
+	if (classes->free_count == classes->free_capacity) {
+		size_t capacity = classes->free_capacity ? classes->free_capacity * 2 : 16;
+		uint32_t *free_indices = realloc(classes->free, capacity * sizeof(uint32_t));
+		
+		if (!free_indices) return 0;
+		
+		classes->free = free_indices;
+		classes->free_capacity = capacity;
+	}
+	
+	classes->entries[index].value = Qnil;
+	classes->free[classes->free_count++] = index;
+	
+	return 1;
+}
+
+void Memory_Profiler_Classes_prune(struct Memory_Profiler_Classes *classes) {
+	size_t count = 1;
+	
+	for (size_t index = 1; index < classes->count; index++) {
+		struct Memory_Profiler_Classes_Entry *entry = &classes->entries[index];
+		
+		if (!NIL_P(entry->klass) && !NIL_P(entry->value)) {
+			classes->entries[count++] = *entry;
+		}
+	}
+	
+	classes->count = count;
+	
+	// Released indices were removed along with the other forgotten classes:
+	classes->free_count = 0;
+	
+	memset(classes->slots, 0, classes->slots_capacity * sizeof(uint32_t));
+	Memory_Profiler_Classes_rehash(classes, classes->slots, classes->slots_capacity);
+}
+
+void Memory_Profiler_Classes_mark(struct Memory_Profiler_Classes *classes) {
+	if (!classes) return;
+	
+	for (size_t index = 1; index < classes->count; index++) {
+		struct Memory_Profiler_Classes_Entry *entry = &classes->entries[index];
+		
+		if (!classes->weak) {
+			rb_gc_mark_movable(entry->klass);
+		}
+		
+		rb_gc_mark_movable(entry->value);
+	}
+}
+
+void Memory_Profiler_Classes_compact(struct Memory_Profiler_Classes *classes) {
+	if (!classes) return;
+	
+	int moved = 0;
+	
+	for (size_t index = 1; index < classes->count; index++) {
+		struct Memory_Profiler_Classes_Entry *entry = &classes->entries[index];
+		VALUE klass = rb_gc_location(entry->klass);
+		
+		if (klass != entry->klass) {
+			entry->klass = klass;
+			moved = 1;
+		}
+		
+		entry->value = rb_gc_location(entry->value);
+	}
+	
+	// The map is keyed by address, so it's rebuilt in place (without allocating):
+	if (moved) {
+		memset(classes->slots, 0, classes->slots_capacity * sizeof(uint32_t));
+		Memory_Profiler_Classes_rehash(classes, classes->slots, classes->slots_capacity);
+	}
+}
+
+size_t Memory_Profiler_Classes_memsize(struct Memory_Profiler_Classes *classes) {
+	if (!classes) return 0;
+	
+	return sizeof(struct Memory_Profiler_Classes)
+		+ classes->capacity * sizeof(struct Memory_Profiler_Classes_Entry)
+		+ classes->slots_capacity * sizeof(uint32_t)
+		+ classes->free_capacity * sizeof(uint32_t);
+}
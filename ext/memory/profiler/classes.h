@@ -0,0 +1,92 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A class and the value associated with it.
+struct Memory_Profiler_Classes_Entry {
+	// The class, or Qnil once it has been forgotten (see Memory_Profiler_Classes_forget):
+	VALUE klass;
+	
+	// The value associated with the class by the caller (e.g. its allocations), or Qnil. It can still be looked up by index after the class is forgotten:
+	VALUE value;
+};
+
+// Interns classes as small integer indices, so that they can be stored compactly (e.g. in queued events).
+// Uses system malloc/free (not ruby_xmalloc), so classes can be interned from the event hook.
+// Index 0 is reserved to mean "no class".
+struct Memory_Profiler_Classes {
+	// Index => class and value:
+	struct Memory_Profiler_Classes_Entry *entries;
+	size_t count;
+	size_t capacity;
+	
+	// Open addressing map (linear probing) from class to index (0 = empty slot), capacity is a power of two:
+	uint32_t *slots;
+	size_t slots_capacity;
+	
+	// Whether classes are weak (not marked), which is only safe while their frees are observed and forgotten. Otherwise they are marked, but may still move:
+	int weak;
+	
+	// Indices released for reuse by new classes (see Memory_Profiler_Classes_release):
+	uint32_t *free;
+	size_t free_count;
+	size_t free_capacity;
+};
+
+// Create a new, empty class registry.
+struct Memory_Profiler_Classes* Memory_Profiler_Classes_new(void);
+
+// Free the registry and all its memory.
+void Memory_Profiler_Classes_free(struct Memory_Profiler_Classes *classes);
+
+// Get the index of a class, adding it to the registry if required.
+// Returns 0 if the class could not be added (allocation failure).
+// The caller is responsible for the write barrier when a class is added.
+uint32_t Memory_Profiler_Classes_intern(struct Memory_Profiler_Classes *classes, VALUE klass);
+
+// Get the index of a class, or 0 if it is not in the registry. Safe to call during GC.
+uint32_t Memory_Profiler_Classes_find(struct Memory_Profiler_Classes *classes, VALUE klass);
+
+// Get the class for an index, or Qnil if the index is invalid or the class was forgotten.
+static inline VALUE Memory_Profiler_Classes_get(struct Memory_Profiler_Classes *classes, uint32_t index) {
+	if (index == 0 || index >= classes->count) return Qnil;
+	
+	return classes->entries[index].klass;
+}
+
+// Get the value for an index, or Qnil if the index is invalid.
+static inline VALUE Memory_Profiler_Classes_value(struct Memory_Profiler_Classes *classes, uint32_t index) {
+	if (index == 0 || index >= classes->count) return Qnil;
+	
+	return classes->entries[index].value;
+}
+
+// Set the value for an index. The caller is responsible for the write barrier.
+void Memory_Profiler_Classes_set_value(struct Memory_Profiler_Classes *classes, uint32_t index, VALUE value);
+
+// Forget a class that is being freed, so that its address can be reused by a new class. Its index (and value) stay valid, for whatever still refers to it.
+// Returns the index of the class, or 0 if it is not in the registry. Safe to call during GC (from the FREEOBJ hook).
+uint32_t Memory_Profiler_Classes_forget(struct Memory_Profiler_Classes *classes, VALUE klass);
+
+// Release the index of a forgotten class, once nothing refers to it any more, so that it can be reused by a new class. Its value is discarded.
+// Returns 0 if the index could not be recorded (allocation failure), in which case it is not reused until the registry is pruned.
+int Memory_Profiler_Classes_release(struct Memory_Profiler_Classes *classes, uint32_t index);
+
+// Remove forgotten classes and classes without a value, renumbering the rest. Previously returned indices become invalid.
+void Memory_Profiler_Classes_prune(struct Memory_Profiler_Classes *classes);
+
+// Mark all values, and the classes unless they are weak. Classes are movable.
+// Must be called from dmark callback.
+void Memory_Profiler_Classes_mark(struct Memory_Profiler_Classes *classes);
+
+// Update classes and values after compaction, rehashing the classes in place.
+// Must be called from dcompact callback.
+void Memory_Profiler_Classes_compact(struct Memory_Profiler_Classes *classes);
+
+// Get the memory used by the registry.
+size_t Memory_Profiler_Classes_memsize(struct Memory_Profiler_Classes *classes);
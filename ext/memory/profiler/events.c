@@ -6,11 +6,36 @@
 
 #include <ruby/debug.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 enum {
 	DEBUG = 0,
+	
+	// Default queue depth at which the postponed job is re-triggered.
+	DEFAULT_TRIGGER_THRESHOLD = 4096,
+	
+	// Initial capacity of the pending weak event map (must be a power of two).
+	PENDING_INITIAL_CAPACITY = 1024,
+	
+	// Number of log2 buckets in the drain duration histogram.
+	DRAIN_HISTOGRAM_SIZE = 32,
+	
+	// How often (in events) the clock is checked against the drain time budget (must be a power of two).
+	DRAIN_CLOCK_INTERVAL = 16,
+	
+	// Maximum log2 of the weight of events admitted by the :sample overflow policy (so that weights fit the snapshot entries).
+	MAXIMUM_WEIGHT_SHIFT = 15,
 };
 
+// Default time budget for each drain (in nanoseconds).
+static const uint64_t DEFAULT_DRAIN_TIME_BUDGET = 10 * 1000 * 1000;
+
+// Default limit on the memory used by both event queues.
+static const size_t DEFAULT_MEMORY_LIMIT = 64 * 1024 * 1024;
+
+static VALUE sym_drop, sym_sample, sym_synchronous;
+
 // Internal structure for the global event queue system.
 struct Memory_Profiler_Events {
 	// The VALUE wrapper for this struct (needed for write barriers).
@@ -19,10 +44,61 @@ struct Memory_Profiler_Events {
 	// Double-buffered event queues (contains events from all Capture instances).
 	struct Memory_Profiler_Queue queues[2];
 	struct Memory_Profiler_Queue *available, *processing;
-
+	
 	// Postponed job handle for processing the queue.
 	// Postponed job handles are an extremely limited resource, so we only register one global event queue.
 	rb_postponed_job_handle_t postponed_job_handle;
+	
+	// The postponed job is triggered by an enqueue when no run is pending, and again every time the depth of the available queue reaches a multiple of this threshold (0 = only when no run is pending).
+	size_t trigger_threshold;
+	
+	// The postponed job has been triggered and has not finished running yet, so events enqueued in the meantime will be processed without triggering it again.
+	int job_pending;
+	
+	// Number of times the postponed job was triggered, and number of enqueues that didn't need to trigger it.
+	size_t trigger_count;
+	size_t trigger_skipped_count;
+	
+	// Registered captures, indexed by the capture field of events (index 0 is unused, 0 = free slot):
+	VALUE *captures;
+	size_t captures_capacity;
+	
+	// Open addressing map (linear probing) from object address to its pending weak NEWOBJ event, so that FREEOBJ can find it.
+	// Slots hold the event location ((index << 1) | queue) + 1, 0 = empty. Uses system malloc, as it is updated during GC.
+	uint64_t *pending;
+	size_t pending_capacity;
+	size_t pending_count;
+	
+	// Number of weak NEWOBJ events cancelled by a FREEOBJ before they were processed.
+	size_t annihilated_count;
+	
+	// Maximum number of bytes of queue segments (0 = unlimited), and what to do with events beyond it.
+	size_t memory_limit;
+	enum Memory_Profiler_Events_Overflow_Policy overflow_policy;
+	
+	// Number of events rejected because of the memory limit.
+	size_t overflow_count;
+	
+	// The deepest the available queue has been.
+	size_t peak_depth;
+	
+	// Xorshift state for the sampling overflow policy.
+	uint64_t random;
+	
+	// Index of the next event to process in the processing queue (non-zero if events were carried over).
+	size_t processing_index;
+	
+	// Whether the GC hook is installed, which triggers the postponed job for events that were carried over (see Memory_Profiler_Events_gc_exit).
+	int gc_hook;
+	
+	// Limits on each drain run by the postponed job, in nanoseconds and events (0 = unlimited).
+	uint64_t drain_time_budget;
+	size_t drain_event_budget;
+	
+	// Number of drains, number of drains that carried events over to the next run, and a log2 histogram of their durations (in microseconds).
+	size_t drain_count;
+	size_t drain_deferred_count;
+	size_t drain_histogram[DRAIN_HISTOGRAM_SIZE];
 };
 
 static void Memory_Profiler_Events_process_queue(void *arg);
@@ -55,11 +131,38 @@ static VALUE Memory_Profiler_Events_new(void) {
 	// Initialize both queues for double buffering:
 	Memory_Profiler_Queue_initialize(&events->queues[0], sizeof(struct Memory_Profiler_Event));
 	Memory_Profiler_Queue_initialize(&events->queues[1], sizeof(struct Memory_Profiler_Event));
-
+	
 	// Start with queues[0] available for incoming events, queues[1] for processing (initially empty):
 	events->available = &events->queues[0];
 	events->processing = &events->queues[1];
 	
+	events->trigger_threshold = DEFAULT_TRIGGER_THRESHOLD;
+	events->job_pending = 0;
+	events->trigger_count = 0;
+	events->trigger_skipped_count = 0;
+	
+	events->captures = NULL;
+	events->captures_capacity = 0;
+	
+	events->pending = NULL;
+	events->pending_capacity = 0;
+	events->pending_count = 0;
+	events->annihilated_count = 0;
+	
+	events->memory_limit = DEFAULT_MEMORY_LIMIT;
+	events->overflow_policy = MEMORY_PROFILER_EVENTS_OVERFLOW_SYNCHRONOUS;
+	events->overflow_count = 0;
+	events->peak_depth = 0;
+	events->random = 0x9E3779B97F4A7C15ULL;
+	
+	events->processing_index = 0;
+	events->gc_hook = 0;
+	events->drain_time_budget = DEFAULT_DRAIN_TIME_BUDGET;
+	events->drain_event_budget = 0;
+	events->drain_count = 0;
+	events->drain_deferred_count = 0;
+	memset(events->drain_histogram, 0, sizeof(events->drain_histogram));
+	
 	// Pre-register the single postponed job for processing the queue:
 	events->postponed_job_handle = rb_postponed_job_preregister(0,
 		// Callback function to process the queue:
@@ -79,7 +182,7 @@ static VALUE Memory_Profiler_Events_new(void) {
 struct Memory_Profiler_Events* Memory_Profiler_Events_instance(void) {
 	static VALUE instance = Qnil;
 	static struct Memory_Profiler_Events *events = NULL;
-
+	
 	if (instance == Qnil) {
 		instance = Memory_Profiler_Events_new();
 		
@@ -94,47 +197,155 @@ struct Memory_Profiler_Events* Memory_Profiler_Events_instance(void) {
 	return events;
 }
 
-// Helper to mark events in a queue.
-static void Memory_Profiler_Events_mark_queue(struct Memory_Profiler_Queue *queue, int skip_none) {
-	for (size_t i = 0; i < queue->count; i++) {
-		struct Memory_Profiler_Event *event = Memory_Profiler_Queue_at(queue, i);
+#pragma mark - Pending Weak Events
+
+static inline size_t Memory_Profiler_Events_pending_hash(VALUE object) {
+	return (size_t)((((uint64_t)object >> 3) * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static inline struct Memory_Profiler_Event *Memory_Profiler_Events_pending_event(struct Memory_Profiler_Events *events, uint64_t slot) {
+	uint64_t location = slot - 1;
+	
+	return Memory_Profiler_Queue_at(&events->queues[location & 1], (size_t)(location >> 1));
+}
+
+// Insert a slot value, assuming there is room.
+static void Memory_Profiler_Events_pending_place(uint64_t *pending, size_t capacity, VALUE object, uint64_t slot) {
+	size_t mask = capacity - 1;
+	size_t index = Memory_Profiler_Events_pending_hash(object) & mask;
+	
+	while (pending[index]) {
+		index = (index + 1) & mask;
+	}
+	
+	pending[index] = slot;
+}
+
+// Add a pending weak event at the given location. Returns zero if memory could not be allocated.
+static int Memory_Profiler_Events_pending_insert(struct Memory_Profiler_Events *events, VALUE object, uint64_t location) {
+	// Keep the map at most half full:
+	if ((events->pending_count + 1) * 2 > events->pending_capacity) {
+		size_t capacity = events->pending_capacity ? events->pending_capacity * 2 : PENDING_INITIAL_CAPACITY;
+		uint64_t *pending = calloc(capacity, sizeof(uint64_t));
+		
+		if (!pending) return 0;
+		
+		for (size_t i = 0; i < events->pending_capacity; i++) {
+			uint64_t slot = events->pending[i];
+			
+			if (slot) {
+				struct Memory_Profiler_Event *event = Memory_Profiler_Events_pending_event(events, slot);
+				Memory_Profiler_Events_pending_place(pending, capacity, Memory_Profiler_Event_object(event), slot);
+			}
+		}
 		
-		// Skip already-processed events if requested:
-		if (skip_none && event->type == MEMORY_PROFILER_EVENT_TYPE_NONE) continue;
+		free(events->pending);
+		events->pending = pending;
+		events->pending_capacity = capacity;
+	}
+	
+	Memory_Profiler_Events_pending_place(events->pending, events->pending_capacity, object, location + 1);
+	events->pending_count++;
+	
+	return 1;
+}
+
+// Remove the slot at the given index, shifting back any following entries of the probe sequence (no tombstones).
+static void Memory_Profiler_Events_pending_remove(struct Memory_Profiler_Events *events, size_t index) {
+	size_t mask = events->pending_capacity - 1;
+	size_t hole = index;
+	size_t next = index;
+	
+	while (1) {
+		next = (next + 1) & mask;
+		uint64_t slot = events->pending[next];
+		
+		if (!slot) break;
+		
+		struct Memory_Profiler_Event *event = Memory_Profiler_Events_pending_event(events, slot);
+		size_t home = Memory_Profiler_Events_pending_hash(Memory_Profiler_Event_object(event)) & mask;
 		
-		rb_gc_mark_movable(event->capture);
-		rb_gc_mark_movable(event->klass);
+		// The entry can stay if its home is cyclically within (hole, next]:
+		if (hole <= next ? (hole < home && home <= next) : (hole < home || home <= next)) continue;
 		
-		if (event->type == MEMORY_PROFILER_EVENT_TYPE_NEWOBJ) {
-			rb_gc_mark_movable(event->object);
+		events->pending[hole] = slot;
+		hole = next;
+	}
+	
+	events->pending[hole] = 0;
+	events->pending_count--;
+}
+
+// Remove the pending entry for the event at the given location (when it is processed).
+static void Memory_Profiler_Events_pending_remove_location(struct Memory_Profiler_Events *events, VALUE object, uint64_t location) {
+	if (events->pending_count == 0) return;
+	
+	size_t mask = events->pending_capacity - 1;
+	size_t index = Memory_Profiler_Events_pending_hash(object) & mask;
+	
+	while (events->pending[index]) {
+		if (events->pending[index] == location + 1) {
+			Memory_Profiler_Events_pending_remove(events, index);
+			return;
+		}
+		
+		index = (index + 1) & mask;
+	}
+}
+
+// Re-insert all pending weak events, after their objects moved.
+static void Memory_Profiler_Events_pending_rebuild(struct Memory_Profiler_Events *events) {
+	memset(events->pending, 0, events->pending_capacity * sizeof(uint64_t));
+	
+	for (uint64_t queue = 0; queue < 2; queue++) {
+		for (size_t i = 0; i < events->queues[queue].count; i++) {
+			struct Memory_Profiler_Event *event = Memory_Profiler_Queue_at(&events->queues[queue], i);
+			
+			if (Memory_Profiler_Event_type(event) == MEMORY_PROFILER_EVENT_TYPE_NEWOBJ && Memory_Profiler_Event_weak_p(event)) {
+				Memory_Profiler_Events_pending_place(events->pending, events->pending_capacity, Memory_Profiler_Event_object(event), (((uint64_t)i << 1) | queue) + 1);
+			}
 		}
 	}
 }
 
-// GC mark callback - mark all VALUEs in both event queues.
+#pragma mark - GC Callbacks
+
+// Helper to mark events in a queue. Only pending NEWOBJ objects hold references (captures and classes are retained by their registries).
+static void Memory_Profiler_Events_mark_queue(struct Memory_Profiler_Queue *queue) {
+	for (size_t i = 0; i < queue->count; i++) {
+		struct Memory_Profiler_Event *event = Memory_Profiler_Queue_at(queue, i);
+		
+		// Weak events don't retain their objects:
+		if (Memory_Profiler_Event_type(event) == MEMORY_PROFILER_EVENT_TYPE_NEWOBJ && !Memory_Profiler_Event_weak_p(event)) {
+			rb_gc_mark_movable(Memory_Profiler_Event_object(event));
+		}
+	}
+}
+
+// GC mark callback - mark registered captures and all pending objects in both event queues.
 static void Memory_Profiler_Events_mark(void *ptr) {
 	struct Memory_Profiler_Events *events = ptr;
 	
+	for (size_t i = 1; i < events->captures_capacity; i++) {
+		if (events->captures[i]) rb_gc_mark_movable(events->captures[i]);
+	}
+	
 	// Mark all events in the available queue (receiving new events):
-	Memory_Profiler_Events_mark_queue(events->available, 0);
+	Memory_Profiler_Events_mark_queue(events->available);
 	
-	// Mark all events in the processing queue (currently being processed):
-	Memory_Profiler_Events_mark_queue(events->processing, 1);
+	// Mark all events in the processing queue (already-processed events are cleared to NONE):
+	Memory_Profiler_Events_mark_queue(events->processing);
 }
 
 // Helper to compact events in a queue.
-static void Memory_Profiler_Events_compact_queue(struct Memory_Profiler_Queue *queue, int skip_none) {
+static void Memory_Profiler_Events_compact_queue(struct Memory_Profiler_Queue *queue) {
 	for (size_t i = 0; i < queue->count; i++) {
 		struct Memory_Profiler_Event *event = Memory_Profiler_Queue_at(queue, i);
 		
-		// Skip already-processed events if requested:
-		if (skip_none && event->type == MEMORY_PROFILER_EVENT_TYPE_NONE) continue;
-		
-		event->capture = rb_gc_location(event->capture);
-		event->klass = rb_gc_location(event->klass);
-
-		if (event->type == MEMORY_PROFILER_EVENT_TYPE_NEWOBJ) {
-			event->object = rb_gc_location(event->object);
+		// Weak objects are still alive (otherwise their events would have been annihilated), so they may have moved too:
+		if (Memory_Profiler_Event_type(event) == MEMORY_PROFILER_EVENT_TYPE_NEWOBJ) {
+			VALUE flags = event->object_and_type & MEMORY_PROFILER_EVENT_FLAGS_MASK;
+			event->object_and_type = rb_gc_location(Memory_Profiler_Event_object(event)) | flags;
 		}
 	}
 }
@@ -143,11 +354,20 @@ static void Memory_Profiler_Events_compact_queue(struct Memory_Profiler_Queue *q
 static void Memory_Profiler_Events_compact(void *ptr) {
 	struct Memory_Profiler_Events *events = ptr;
 	
+	for (size_t i = 1; i < events->captures_capacity; i++) {
+		if (events->captures[i]) events->captures[i] = rb_gc_location(events->captures[i]);
+	}
+	
 	// Update objects in the available queue:
-	Memory_Profiler_Events_compact_queue(events->available, 0);
+	Memory_Profiler_Events_compact_queue(events->available);
 	
 	// Update objects in the processing queue:
-	Memory_Profiler_Events_compact_queue(events->processing, 1);
+	Memory_Profiler_Events_compact_queue(events->processing);
+	
+	// The pending map is keyed by address:
+	if (events->pending_count) {
+		Memory_Profiler_Events_pending_rebuild(events);
+	}
 }
 
 // GC free callback.
@@ -155,14 +375,18 @@ static void Memory_Profiler_Events_free(void *ptr) {
 	struct Memory_Profiler_Events *events = ptr;
 	Memory_Profiler_Queue_free(&events->queues[0]);
 	Memory_Profiler_Queue_free(&events->queues[1]);
+	free(events->captures);
+	free(events->pending);
 }
 
 // GC memsize callback.
 static size_t Memory_Profiler_Events_memsize(const void *ptr) {
 	const struct Memory_Profiler_Events *events = ptr;
 	return sizeof(struct Memory_Profiler_Events) 
-		+ (events->queues[0].capacity * events->queues[0].element_size)
-		+ (events->queues[1].capacity * events->queues[1].element_size);
+		+ Memory_Profiler_Queue_memsize(&events->queues[0])
+		+ Memory_Profiler_Queue_memsize(&events->queues[1])
+		+ (events->captures_capacity * sizeof(VALUE))
+		+ (events->pending_capacity * sizeof(uint64_t));
 }
 
 const char *Memory_Profiler_Event_Type_name(enum Memory_Profiler_Event_Type type) {
@@ -171,91 +395,624 @@ const char *Memory_Profiler_Event_Type_name(enum Memory_Profiler_Event_Type type
 			return "NEWOBJ";
 		case MEMORY_PROFILER_EVENT_TYPE_FREEOBJ:
 			return "FREEOBJ";
+		case MEMORY_PROFILER_EVENT_TYPE_ANNIHILATED:
+			return "ANNIHILATED";
 		default:
 			return "NONE";
 	}
 }
 
+// Register a capture, reusing a free slot if possible.
+uint32_t Memory_Profiler_Events_register(VALUE capture) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	size_t index = 1;
+	while (index < events->captures_capacity && events->captures[index]) index++;
+	
+	if (index >= events->captures_capacity) {
+		size_t capacity = events->captures_capacity ? events->captures_capacity * 2 : 8;
+		VALUE *captures = realloc(events->captures, capacity * sizeof(VALUE));
+		
+		if (!captures) {
+			rb_raise(rb_eNoMemError, "Failed to register capture!");
+		}
+		
+		memset(captures + events->captures_capacity, 0, (capacity - events->captures_capacity) * sizeof(VALUE));
+		events->captures = captures;
+		events->captures_capacity = capacity;
+	}
+	
+	RB_OBJ_WRITE(events->self, &events->captures[index], capture);
+	
+	return (uint32_t)index;
+}
+
+void Memory_Profiler_Events_unregister(uint32_t capture) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	if (capture > 0 && capture < events->captures_capacity) {
+		events->captures[capture] = 0;
+	}
+}
+
+enum Memory_Profiler_Events_Overflow_Policy Memory_Profiler_Events_overflow_policy(void) {
+	return Memory_Profiler_Events_instance()->overflow_policy;
+}
+
+// Check whether an event of the given type fits within the memory limit.
+// Returns -1 if it doesn't, otherwise the log2 of the number of events it stands for (0 unless it was sampled).
+static int Memory_Profiler_Events_admit(struct Memory_Profiler_Events *events, enum Memory_Profiler_Event_Type type) {
+	if (!events->memory_limit) return 0;
+	
+	size_t size = (events->queues[0].segments_count + events->queues[1].segments_count) * MEMORY_PROFILER_QUEUE_SEGMENT_SIZE;
+	
+	// A new segment would exceed the limit:
+	if (Memory_Profiler_Queue_full_p(events->available) && size + MEMORY_PROFILER_QUEUE_SEGMENT_SIZE > events->memory_limit) {
+		return -1;
+	}
+	
+	// Beyond half the limit, admit allocations with a probability that falls towards zero at the limit:
+	if (events->overflow_policy == MEMORY_PROFILER_EVENTS_OVERFLOW_SAMPLE && type == MEMORY_PROFILER_EVENT_TYPE_NEWOBJ) {
+		// The processing queue holds its segments until it is drained, so they count as used:
+		size_t used = events->processing->segments_count * MEMORY_PROFILER_QUEUE_SEGMENT_SIZE + events->available->count * sizeof(struct Memory_Profiler_Event);
+		size_t soft_limit = events->memory_limit / 2;
+		
+		if (used > soft_limit) {
+			// The probability is a power of two, at most (limit - used) / (limit - soft_limit), so that admitted events can be weighted exactly by its inverse:
+			size_t remaining = used < events->memory_limit ? events->memory_limit - used : 0;
+			int shift = 1;
+			
+			while (shift < MAXIMUM_WEIGHT_SHIFT && (remaining << shift) < events->memory_limit - soft_limit) shift++;
+			
+			uint64_t x = events->random;
+			x ^= x >> 12;
+			x ^= x << 25;
+			x ^= x >> 27;
+			events->random = x;
+			
+			// Admitted if the top `shift` bits are zero:
+			if (((x * 0x2545F4914F6CDD1DULL) >> (64 - shift)) != 0) return -1;
+			
+			return shift;
+		}
+	}
+	
+	return 0;
+}
+
+// Trigger the postponed job, which runs at the next safe point.
+static void Memory_Profiler_Events_trigger_job(struct Memory_Profiler_Events *events) {
+	rb_postponed_job_trigger(events->postponed_job_handle);
+	events->job_pending = 1;
+	events->trigger_count++;
+}
+
+// Push an event to the available queue (can be called anytime, even during processing), triggering the postponed job if required.
+static struct Memory_Profiler_Event *Memory_Profiler_Events_push(struct Memory_Profiler_Events *events, VALUE object_and_type, uint32_t capture, uint32_t klass) {
+	struct Memory_Profiler_Event *event = NULL;
+	
+	int shift = Memory_Profiler_Events_admit(events, (enum Memory_Profiler_Event_Type)(object_and_type & MEMORY_PROFILER_EVENT_TYPE_MASK));
+	
+	if (shift >= 0) {
+		event = Memory_Profiler_Queue_push(events->available);
+	}
+	
+	// Over the memory limit (or out of memory):
+	if (!event) {
+		events->overflow_count++;
+		return NULL;
+	}
+	
+	event->object_and_type = object_and_type;
+	event->capture = capture;
+	event->klass = klass | ((uint32_t)shift << MEMORY_PROFILER_EVENT_WEIGHT_SHIFT);
+	
+	size_t count = events->available->count;
+	
+	if (count > events->peak_depth) {
+		events->peak_depth = count;
+	}
+	
+	if (DEBUG) fprintf(stderr, "Queued %s to available queue, size: %zu\n", 
+		Memory_Profiler_Event_Type_name(Memory_Profiler_Event_type(event)), count);
+	
+	// A pending run swaps out the whole available queue, so it picks up this event too. Re-triggering at the threshold is a safety net for deep queues:
+	if (!events->job_pending || (events->trigger_threshold && count % events->trigger_threshold == 0)) {
+		Memory_Profiler_Events_trigger_job(events);
+	} else {
+		events->trigger_skipped_count++;
+	}
+	
+	return event;
+}
+
 // Enqueue an event to the available queue (can be called anytime, even during processing).
 int Memory_Profiler_Events_enqueue(
 	enum Memory_Profiler_Event_Type type,
-	VALUE capture,
-	VALUE klass,
+	uint32_t capture,
+	uint32_t klass,
 	VALUE object
 ) {
 	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
 	
 	// Always enqueue to the available queue - it won't be touched during processing:
-	struct Memory_Profiler_Event *event = Memory_Profiler_Queue_push(events->available);
-	if (event) {
-		event->type = type;
-		
-		// Use write barriers when storing VALUEs (required for RUBY_TYPED_WB_PROTECTED):
-		RB_OBJ_WRITE(events->self, &event->capture, capture);
-		RB_OBJ_WRITE(events->self, &event->klass, klass);
-		RB_OBJ_WRITE(events->self, &event->object, object);
+	if (!Memory_Profiler_Events_push(events, object | type, capture, klass)) {
+		return 0;
+	}
+	
+	// Pending NEWOBJ objects are retained by the queue (required for RUBY_TYPED_WB_PROTECTED):
+	if (type == MEMORY_PROFILER_EVENT_TYPE_NEWOBJ) {
+		RB_OBJ_WRITTEN(events->self, Qnil, object);
+	}
+	
+	return 1;
+}
+
+int Memory_Profiler_Events_enqueue_weak(uint32_t capture, uint32_t klass, VALUE object) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	uint64_t location = ((uint64_t)events->available->count << 1) | (uint64_t)(events->available - events->queues);
+	
+	struct Memory_Profiler_Event *event = Memory_Profiler_Events_push(events, object | MEMORY_PROFILER_EVENT_TYPE_NEWOBJ | MEMORY_PROFILER_EVENT_WEAK, capture, klass);
+	if (!event) return 0;
+	
+	if (!Memory_Profiler_Events_pending_insert(events, object, location)) {
+		// The free could not be matched to this event, so retain the object instead:
+		event->object_and_type &= ~(VALUE)MEMORY_PROFILER_EVENT_WEAK;
+		RB_OBJ_WRITTEN(events->self, Qnil, object);
+	}
+	
+	return 1;
+}
+
+void Memory_Profiler_Events_trigger(void) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	if (!events->job_pending) {
+		Memory_Profiler_Events_trigger_job(events);
+	}
+}
+
+int Memory_Profiler_Events_annihilate(uint32_t capture, VALUE object) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	if (events->pending_count == 0) return 0;
+	
+	size_t mask = events->pending_capacity - 1;
+	size_t index = Memory_Profiler_Events_pending_hash(object) & mask;
+	
+	while (events->pending[index]) {
+		struct Memory_Profiler_Event *event = Memory_Profiler_Events_pending_event(events, events->pending[index]);
 		
-		if (DEBUG) fprintf(stderr, "Queued %s to available queue, size: %zu\n", 
-			Memory_Profiler_Event_Type_name(type), events->available->count);
+		if (Memory_Profiler_Event_object(event) == object && event->capture == capture) {
+			Memory_Profiler_Events_pending_remove(events, index);
+			
+			// Keep the capture and class, so that the allocation and free can still be counted:
+			event->object_and_type = MEMORY_PROFILER_EVENT_TYPE_ANNIHILATED;
+			events->annihilated_count++;
+			
+			return 1;
+		}
 		
-		rb_postponed_job_trigger(events->postponed_job_handle);
-		// Success:
-		return 1;
+		index = (index + 1) & mask;
 	}
-
-	// Queue full:
+	
 	return 0;
 }
 
-// Process all queued events immediately (flush the queue).
-// Public API function - called from Capture stop() to ensure all events are processed.
-void Memory_Profiler_Events_process_all(void) {
+void Memory_Profiler_Events_retain(uint32_t capture) {
 	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
-	Memory_Profiler_Events_process_queue((void *)events);
+	
+	if (events->pending_count == 0) return;
+	
+	for (uint64_t queue = 0; queue < 2; queue++) {
+		// Events of the processing queue before the cursor have already been processed:
+		size_t start = &events->queues[queue] == events->processing ? events->processing_index : 0;
+		
+		for (size_t i = start; i < events->queues[queue].count; i++) {
+			struct Memory_Profiler_Event *event = Memory_Profiler_Queue_at(&events->queues[queue], i);
+			
+			if (event->capture != capture || Memory_Profiler_Event_type(event) != MEMORY_PROFILER_EVENT_TYPE_NEWOBJ || !Memory_Profiler_Event_weak_p(event)) continue;
+			
+			VALUE object = Memory_Profiler_Event_object(event);
+			
+			Memory_Profiler_Events_pending_remove_location(events, object, ((uint64_t)i << 1) | queue);
+			event->object_and_type &= ~(VALUE)MEMORY_PROFILER_EVENT_WEAK;
+			RB_OBJ_WRITTEN(events->self, Qnil, object);
+		}
+	}
+}
+
+static uint64_t Memory_Profiler_Events_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// GC hook, installed while events are carried over to a later drain: the job can't trigger itself (it would run again before returning to the application), and the next enqueue may be a long way off. Collections are driven by allocations, so this resumes the drain once the application has run for a while, and before the objects retained by the queue matter.
+// Safe to call from GC: rb_postponed_job_trigger doesn't allocate.
+static void Memory_Profiler_Events_gc_exit(VALUE self, void *ptr) {
+	struct Memory_Profiler_Events *events;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Events, &Memory_Profiler_Events_type, events);
+	
+	if (!events->job_pending) {
+		Memory_Profiler_Events_trigger_job(events);
+	}
+}
+
+// Install the GC hook while events are waiting to be processed, and remove it once there are none.
+static void Memory_Profiler_Events_update_gc_hook(struct Memory_Profiler_Events *events) {
+	int waiting = events->processing_index || events->available->count;
+	
+	if (waiting && !events->gc_hook) {
+		rb_add_event_hook2(
+			(rb_event_hook_func_t)Memory_Profiler_Events_gc_exit,
+			RUBY_INTERNAL_EVENT_GC_EXIT,
+			events->self,
+			RUBY_EVENT_HOOK_FLAG_SAFE | RUBY_EVENT_HOOK_FLAG_RAW_ARG
+		);
+		
+		events->gc_hook = 1;
+	} else if (!waiting && events->gc_hook) {
+		rb_remove_event_hook_with_data((rb_event_hook_func_t)Memory_Profiler_Events_gc_exit, events->self);
+		events->gc_hook = 0;
+	}
+}
+
+// Record the duration of a drain in the log2 histogram.
+static void Memory_Profiler_Events_record_drain(struct Memory_Profiler_Events *events, uint64_t duration) {
+	// Bucket 0 is < 1us, bucket N is [2^(N-1), 2^N) us:
+	uint64_t microseconds = duration / 1000;
+	size_t bucket = 0;
+	
+	while (microseconds && bucket < DRAIN_HISTOGRAM_SIZE - 1) {
+		microseconds >>= 1;
+		bucket++;
+	}
+	
+	events->drain_histogram[bucket]++;
+	events->drain_count++;
+}
+
+// State of a drain, preserved across exceptions raised by callbacks.
+struct Memory_Profiler_Events_Drain {
+	struct Memory_Profiler_Events *events;
+	
+	// Stop once the clock passes the deadline, or the limit of events has been processed:
+	uint64_t deadline;
+	size_t limit;
+	size_t processed;
+	
+	// The capture whose event is being processed (0 if none):
+	VALUE capture;
+};
+
+// Process events from the cursor until the queue or the budget is exhausted.
+// Called under rb_protect: if a callback raises, the cursor has already moved past the faulting event, so the drain can resume from the next one.
+static VALUE Memory_Profiler_Events_drain_protected(VALUE arg) {
+	struct Memory_Profiler_Events_Drain *drain = (struct Memory_Profiler_Events_Drain *)arg;
+	struct Memory_Profiler_Events *events = drain->events;
+	
+	while (events->processing_index < events->processing->count) {
+		if (drain->processed >= drain->limit || ((drain->processed & (DRAIN_CLOCK_INTERVAL - 1)) == 0 && drain->processed && Memory_Profiler_Events_now() >= drain->deadline)) {
+			break;
+		}
+		
+		// Advanced before the event is processed, so a nested drain (e.g. a callback stopping a capture) continues where this one left off:
+		size_t index = events->processing_index++;
+		drain->processed++;
+		
+		struct Memory_Profiler_Event *slot = Memory_Profiler_Queue_at(events->processing, index);
+		
+		// Once processing starts, a weak object is kept alive by the stack, so it no longer needs to be matched with its free:
+		if (Memory_Profiler_Event_type(slot) == MEMORY_PROFILER_EVENT_TYPE_NEWOBJ && Memory_Profiler_Event_weak_p(slot)) {
+			uint64_t queue = (uint64_t)(events->processing - events->queues);
+			Memory_Profiler_Events_pending_remove_location(events, Memory_Profiler_Event_object(slot), ((uint64_t)index << 1) | queue);
+		}
+		
+		// Take the event and clear its slot, so stale data is never marked and the slot may be released by a nested drain:
+		struct Memory_Profiler_Event event = *slot;
+		VALUE object = Memory_Profiler_Event_object(&event);
+		slot->object_and_type = 0;
+		
+		// Events for unregistered captures are discarded:
+		VALUE capture = event.capture < events->captures_capacity ? events->captures[event.capture] : 0;
+		
+		if (capture && Memory_Profiler_Event_type(&event) != MEMORY_PROFILER_EVENT_TYPE_NONE) {
+			drain->capture = capture;
+			Memory_Profiler_Capture_process_event(capture, &event);
+			drain->capture = 0;
+		}
+		
+		// The object is only retained by the stack while it is processed:
+		RB_GC_GUARD(object);
+	}
+	
+	return Qnil;
 }
 
-// Wrapper for rb_protect - processes a single event.
-// rb_protect requires signature: VALUE func(VALUE arg).
-static VALUE Memory_Profiler_Events_process_event_protected(VALUE arg) {
-	struct Memory_Profiler_Event *event = (struct Memory_Profiler_Event *)arg;
-	Memory_Profiler_Capture_process_event(event);
+// Wrapper for rb_protect - flushes a pending batch of a capture.
+static VALUE Memory_Profiler_Events_flush_protected(VALUE capture) {
+	Memory_Profiler_Capture_flush(capture);
 	return Qnil;
 }
 
-// Postponed job callback - processes global event queue.
+// Invoke the callbacks of all batches collected during the drain.
+static void Memory_Profiler_Events_flush(struct Memory_Profiler_Events *events) {
+	// Captures may be unregistered by callbacks, so the registry is re-read on every iteration:
+	for (size_t i = 1; i < events->captures_capacity; i++) {
+		VALUE capture;
+		
+		while ((capture = events->captures[i]) && Memory_Profiler_Capture_flush_pending_p(capture)) {
+			int state = 0;
+			rb_protect(Memory_Profiler_Events_flush_protected, capture, &state);
+			
+			if (state) {
+				rb_warning("Exception in batch processing callback (caught and suppressed): %"PRIsVALUE, rb_errinfo());
+				rb_set_errinfo(Qnil);
+				
+				Memory_Profiler_Capture_process_event_failed(capture);
+			}
+		}
+	}
+}
+
+// Process events, starting with any carried over from a previous drain, otherwise swapping in the available queue.
+// If bounded, stops once the time or event budget is exhausted, leaving the rest for the next drain.
+// Returns true if the processing queue was completely drained.
+static int Memory_Profiler_Events_drain(struct Memory_Profiler_Events *events, int bounded) {
+	uint64_t start = Memory_Profiler_Events_now();
+	
+	struct Memory_Profiler_Events_Drain drain = {
+		.events = events,
+		.deadline = (bounded && events->drain_time_budget) ? start + events->drain_time_budget : UINT64_MAX,
+		.limit = (bounded && events->drain_event_budget) ? events->drain_event_budget : SIZE_MAX,
+		.processed = 0,
+		.capture = 0,
+	};
+	
+	if (events->processing_index == 0) {
+		// Swap the queues: available becomes processing, and the old processing queue (now empty) becomes available. This allows new events to continue enqueueing to the new available queue while we process.
+		struct Memory_Profiler_Queue *queue_to_process = events->available;
+		events->available = events->processing;
+		events->processing = queue_to_process;
+	}
+	
+	if (DEBUG) fprintf(stderr, "Processing event queue: %zu events (from %zu)\n", events->processing->count, events->processing_index);
+	
+	// Process events in order (maintains NEWOBJ before FREEOBJ for same object), with a single protected region for the whole batch:
+	while (1) {
+		int state = 0;
+		rb_protect(Memory_Profiler_Events_drain_protected, (VALUE)&drain, &state);
+		
+		if (!state) break;
+		
+		// Exception occurred, warn and suppress, then resume after the faulting event:
+		rb_warning("Exception in event processing callback (caught and suppressed): %"PRIsVALUE, rb_errinfo());
+		rb_set_errinfo(Qnil);
+		
+		if (drain.capture) {
+			Memory_Profiler_Capture_process_event_failed(drain.capture);
+			drain.capture = 0;
+		}
+	}
+	
+	// Batched callbacks are invoked once per drain:
+	Memory_Profiler_Events_flush(events);
+	
+	int complete = events->processing_index >= events->processing->count;
+	
+	if (complete) {
+		// Clear the processing queue (which is now empty logically):
+		Memory_Profiler_Queue_clear(events->processing);
+		events->processing_index = 0;
+	}
+	
+	Memory_Profiler_Events_record_drain(events, Memory_Profiler_Events_now() - start);
+	
+	return complete;
+}
+
+// Postponed job callback - processes global event queue within the drain budget.
 // This runs when it's safe to call Ruby code (not during allocation or GC).
 // Processes events from ALL Capture instances.
 static void Memory_Profiler_Events_process_queue(void *arg) {
 	struct Memory_Profiler_Events *events = (struct Memory_Profiler_Events *)arg;
 	
-	// Swap the queues: available becomes processing, and the old processing queue (now empty) becomes available. This allows new events to continue enqueueing to the new available queue while we process.
-	struct Memory_Profiler_Queue *queue_to_process = events->available;
-	events->available = events->processing;
-	events->processing = queue_to_process;
+	// Events enqueued while this run drains don't trigger another one:
+	int complete = Memory_Profiler_Events_drain(events, 1);
+	events->job_pending = 0;
+	
+	if (!complete) {
+		events->drain_deferred_count++;
+	}
 	
-	if (DEBUG) fprintf(stderr, "Processing event queue: %zu events\n", events->processing->count);
+	// The rest (and any events queued during this run, e.g. by callbacks) are carried over to a later run, which the next enqueue triggers, or otherwise the next garbage collection:
+	Memory_Profiler_Events_update_gc_hook(events);
+}
 
-	// Process all events in order (maintains NEWOBJ before FREEOBJ for same object):
-	for (size_t i = 0; i < events->processing->count; i++) {
-		struct Memory_Profiler_Event *event = Memory_Profiler_Queue_at(events->processing, i);
-		
-		// Process event with rb_protect to catch any exceptions:
-		int state = 0;
-		rb_protect(Memory_Profiler_Events_process_event_protected, (VALUE)event, &state);
-		
-		if (state) {
-			// Exception occurred, warn and suppress:
-			rb_warning("Exception in event processing callback (caught and suppressed): %"PRIsVALUE, rb_errinfo());
-			rb_set_errinfo(Qnil);
-		}
-		
-		// Clear this event after processing to prevent marking stale data if GC runs:
-		event->type = MEMORY_PROFILER_EVENT_TYPE_NONE;
-		RB_OBJ_WRITE(events->self, &event->capture, Qnil);
-		RB_OBJ_WRITE(events->self, &event->klass, Qnil);
-		RB_OBJ_WRITE(events->self, &event->object, Qnil);
+// Process all queued events immediately (flush the queue), ignoring the drain budget.
+// Public API function - called from Capture stop() to ensure all events are processed.
+void Memory_Profiler_Events_process_all(void) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	// Finish any events carried over from a previous drain:
+	if (events->processing_index) {
+		Memory_Profiler_Events_drain(events, 0);
 	}
 	
-	// Clear the processing queue (which is now empty logically):
-	Memory_Profiler_Queue_clear(events->processing);
+	Memory_Profiler_Events_drain(events, 0);
+	
+	Memory_Profiler_Events_update_gc_hook(events);
+}
+
+int Memory_Profiler_Events_idle_p(void) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	return events->available->count == 0 && events->processing_index >= events->processing->count;
+}
+
+void Memory_Profiler_Events_counters(struct Memory_Profiler_Events_Counters *counters) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	counters->queue_size = events->available->count;
+	counters->overflow_count = events->overflow_count;
+	counters->annihilated_count = events->annihilated_count;
+	counters->drain_count = events->drain_count;
+	counters->peak_depth = events->peak_depth;
+}
+
+// Get statistics about the global event queue.
+VALUE Memory_Profiler_Events_statistics(void) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	VALUE statistics = rb_hash_new();
+	
+	rb_hash_aset(statistics, ID2SYM(rb_intern("queue_size")), SIZET2NUM(events->available->count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("trigger_threshold")), SIZET2NUM(events->trigger_threshold));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("trigger_count")), SIZET2NUM(events->trigger_count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("trigger_skipped_count")), SIZET2NUM(events->trigger_skipped_count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("weak_pending_count")), SIZET2NUM(events->pending_count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("annihilated_count")), SIZET2NUM(events->annihilated_count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("memory_size")), SIZET2NUM(Memory_Profiler_Queue_memsize(&events->queues[0]) + Memory_Profiler_Queue_memsize(&events->queues[1])));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("memory_limit")), SIZET2NUM(events->memory_limit));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("overflow_count")), SIZET2NUM(events->overflow_count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("peak_depth")), SIZET2NUM(events->peak_depth));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("drain_count")), SIZET2NUM(events->drain_count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("drain_deferred_count")), SIZET2NUM(events->drain_deferred_count));
+	
+	// Drain durations, bucket 0 is < 1us and bucket N is [2^(N-1), 2^N) us:
+	VALUE drain_histogram = rb_ary_new_capa(DRAIN_HISTOGRAM_SIZE);
+	for (size_t i = 0; i < DRAIN_HISTOGRAM_SIZE; i++) {
+		rb_ary_push(drain_histogram, SIZET2NUM(events->drain_histogram[i]));
+	}
+	rb_hash_aset(statistics, ID2SYM(rb_intern("drain_histogram")), drain_histogram);
+	
+	return statistics;
+}
+
+// Events.statistics
+static VALUE Memory_Profiler_Events_statistics_method(VALUE module) {
+	return Memory_Profiler_Events_statistics();
+}
+
+// Events.trigger_threshold
+static VALUE Memory_Profiler_Events_trigger_threshold(VALUE module) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	return SIZET2NUM(events->trigger_threshold);
+}
+
+// Events.trigger_threshold = depth
+static VALUE Memory_Profiler_Events_set_trigger_threshold(VALUE module, VALUE threshold) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	events->trigger_threshold = NUM2SIZET(threshold);
+	
+	return threshold;
+}
+
+// Events.memory_limit
+static VALUE Memory_Profiler_Events_memory_limit(VALUE module) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	return SIZET2NUM(events->memory_limit);
+}
+
+// Events.memory_limit = bytes (0 = unlimited)
+static VALUE Memory_Profiler_Events_set_memory_limit(VALUE module, VALUE memory_limit) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	events->memory_limit = NUM2SIZET(memory_limit);
+	
+	return memory_limit;
+}
+
+// Events.overflow_policy
+static VALUE Memory_Profiler_Events_overflow_policy_method(VALUE module) {
+	switch (Memory_Profiler_Events_overflow_policy()) {
+		case MEMORY_PROFILER_EVENTS_OVERFLOW_SAMPLE:
+			return sym_sample;
+		case MEMORY_PROFILER_EVENTS_OVERFLOW_SYNCHRONOUS:
+			return sym_synchronous;
+		default:
+			return sym_drop;
+	}
+}
+
+// Events.overflow_policy = :drop, :sample or :synchronous
+static VALUE Memory_Profiler_Events_set_overflow_policy(VALUE module, VALUE policy) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	if (policy == sym_drop) {
+		events->overflow_policy = MEMORY_PROFILER_EVENTS_OVERFLOW_DROP;
+	} else if (policy == sym_sample) {
+		events->overflow_policy = MEMORY_PROFILER_EVENTS_OVERFLOW_SAMPLE;
+	} else if (policy == sym_synchronous) {
+		events->overflow_policy = MEMORY_PROFILER_EVENTS_OVERFLOW_SYNCHRONOUS;
+	} else {
+		rb_raise(rb_eArgError, "Invalid overflow policy: %"PRIsVALUE"!", policy);
+	}
+	
+	return policy;
+}
+
+// Events.drain_time_budget (seconds, 0 = unlimited)
+static VALUE Memory_Profiler_Events_drain_time_budget(VALUE module) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	return DBL2NUM((double)events->drain_time_budget / 1e9);
+}
+
+// Events.drain_time_budget = seconds
+static VALUE Memory_Profiler_Events_set_drain_time_budget(VALUE module, VALUE budget) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	double seconds = NUM2DBL(budget);
+	if (!(seconds >= 0)) {
+		rb_raise(rb_eArgError, "Drain time budget must not be negative!");
+	}
+	
+	events->drain_time_budget = (uint64_t)(seconds * 1e9);
+	
+	return budget;
+}
+
+// Events.drain_event_budget (0 = unlimited)
+static VALUE Memory_Profiler_Events_drain_event_budget(VALUE module) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	return SIZET2NUM(events->drain_event_budget);
+}
+
+// Events.drain_event_budget = count
+static VALUE Memory_Profiler_Events_set_drain_event_budget(VALUE module, VALUE budget) {
+	struct Memory_Profiler_Events *events = Memory_Profiler_Events_instance();
+	
+	events->drain_event_budget = NUM2SIZET(budget);
+	
+	return budget;
+}
+
+void Init_Memory_Profiler_Events(VALUE Memory_Profiler)
+{
+	sym_drop = ID2SYM(rb_intern("drop"));
+	sym_sample = ID2SYM(rb_intern("sample"));
+	sym_synchronous = ID2SYM(rb_intern("synchronous"));
+	
+	// Events module - configuration and statistics for the global event queue.
+	VALUE Memory_Profiler_Events = rb_define_module_under(Memory_Profiler, "Events");
+	
+	rb_define_singleton_method(Memory_Profiler_Events, "statistics", Memory_Profiler_Events_statistics_method, 0);
+	rb_define_singleton_method(Memory_Profiler_Events, "trigger_threshold", Memory_Profiler_Events_trigger_threshold, 0);
+	rb_define_singleton_method(Memory_Profiler_Events, "trigger_threshold=", Memory_Profiler_Events_set_trigger_threshold, 1);
+	rb_define_singleton_method(Memory_Profiler_Events, "memory_limit", Memory_Profiler_Events_memory_limit, 0);
+	rb_define_singleton_method(Memory_Profiler_Events, "memory_limit=", Memory_Profiler_Events_set_memory_limit, 1);
+	rb_define_singleton_method(Memory_Profiler_Events, "overflow_policy", Memory_Profiler_Events_overflow_policy_method, 0);
+	rb_define_singleton_method(Memory_Profiler_Events, "overflow_policy=", Memory_Profiler_Events_set_overflow_policy, 1);
+	rb_define_singleton_method(Memory_Profiler_Events, "drain_time_budget", Memory_Profiler_Events_drain_time_budget, 0);
+	rb_define_singleton_method(Memory_Profiler_Events, "drain_time_budget=", Memory_Profiler_Events_set_drain_time_budget, 1);
+	rb_define_singleton_method(Memory_Profiler_Events, "drain_event_budget", Memory_Profiler_Events_drain_event_budget, 0);
+	rb_define_singleton_method(Memory_Profiler_Events, "drain_event_budget=", Memory_Profiler_Events_set_drain_event_budget, 1);
 }
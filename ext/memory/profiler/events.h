@@ -4,46 +4,143 @@
 #pragma once
 
 #include <ruby.h>
+#include <stdint.h>
 #include "queue.h"
 
-// Event types
+// Event types (packed into the low bits of the object pointer, so they must fit in MEMORY_PROFILER_EVENT_TYPE_MASK):
 enum Memory_Profiler_Event_Type {
 	MEMORY_PROFILER_EVENT_TYPE_NONE = 0,
 	MEMORY_PROFILER_EVENT_TYPE_NEWOBJ,
 	MEMORY_PROFILER_EVENT_TYPE_FREEOBJ,
+	// A weak NEWOBJ whose object was freed before it was processed (the object is no longer available):
+	MEMORY_PROFILER_EVENT_TYPE_ANNIHILATED,
 };
 
-// Event queue item - stores all info needed to process an event
+enum {
+	// Heap objects are at least 8-byte aligned, so the low bits of the pointer are free to hold the type and flags:
+	MEMORY_PROFILER_EVENT_TYPE_MASK = 0x3,
+	
+	// The object of a NEWOBJ event is not retained by the queue:
+	MEMORY_PROFILER_EVENT_WEAK = 0x4,
+	
+	MEMORY_PROFILER_EVENT_FLAGS_MASK = 0x7,
+};
+
+// The klass field of a NEWOBJ event holds a stack index (which determines the class) instead of a class index.
+// The object table stores the klass field in 24 bits, so class and stack indices are kept below this bit:
+#define MEMORY_PROFILER_EVENT_KLASS_STACK ((uint32_t)0x00800000)
+
+// The top 8 bits of the klass field hold the log2 of the number of allocations the event stands for (see Memory_Profiler_Event_weight):
+#define MEMORY_PROFILER_EVENT_KLASS_MASK ((uint32_t)0x00FFFFFF)
+#define MEMORY_PROFILER_EVENT_WEIGHT_SHIFT 24
+
+// Event queue item - stores all info needed to process an event in 16 bytes.
 struct Memory_Profiler_Event {
-	enum Memory_Profiler_Event_Type type;
+	// The object pointer being allocated or freed, with the event type in the low bits (0 = processed/none):
+	VALUE object_and_type;
 	
-	// Which Capture instance this event belongs to:
-	VALUE capture;
+	// Which Capture instance this event belongs to (index into the capture registry):
+	uint32_t capture;
 	
-	// The class of the allocated object (Qnil for FREEOBJ):
-	VALUE klass;
+	// The class of the allocated object (index into the capture's class or stack registry, 0 for FREEOBJ), and its weight:
+	uint32_t klass;
+};
 
-	// The object pointer being alllocated or freed.
-	VALUE object;
+// The class (or stack) index of a NEWOBJ event.
+inline static uint32_t Memory_Profiler_Event_klass(const struct Memory_Profiler_Event *event) {
+	return event->klass & MEMORY_PROFILER_EVENT_KLASS_MASK;
+}
+
+// The number of allocations a NEWOBJ event stands for: 1, unless it was admitted by the :sample overflow policy, in which case it also stands for the allocations that were rejected in its place.
+inline static uint32_t Memory_Profiler_Event_weight(const struct Memory_Profiler_Event *event) {
+	return (uint32_t)1 << (event->klass >> MEMORY_PROFILER_EVENT_WEIGHT_SHIFT);
+}
+
+inline static enum Memory_Profiler_Event_Type Memory_Profiler_Event_type(const struct Memory_Profiler_Event *event) {
+	return (enum Memory_Profiler_Event_Type)(event->object_and_type & MEMORY_PROFILER_EVENT_TYPE_MASK);
+}
+
+inline static VALUE Memory_Profiler_Event_object(const struct Memory_Profiler_Event *event) {
+	return event->object_and_type & ~(VALUE)MEMORY_PROFILER_EVENT_FLAGS_MASK;
+}
+
+inline static int Memory_Profiler_Event_weak_p(const struct Memory_Profiler_Event *event) {
+	return (event->object_and_type & MEMORY_PROFILER_EVENT_WEAK) != 0;
+}
+
+// What to do with events that would exceed the queue's memory limit.
+enum Memory_Profiler_Events_Overflow_Policy {
+	// Discard the event.
+	MEMORY_PROFILER_EVENTS_OVERFLOW_DROP = 0,
+	// Admit NEWOBJ events with decreasing probability once the queue is half full, discarding the rest. Admitted events are weighted by the inverse of the probability, so counts remain unbiased.
+	MEMORY_PROFILER_EVENTS_OVERFLOW_SAMPLE,
+	// Reject the event, so the caller records it immediately (without invoking callbacks).
+	MEMORY_PROFILER_EVENTS_OVERFLOW_SYNCHRONOUS,
 };
 
 struct Memory_Profiler_Events;
 
 struct Memory_Profiler_Events* Memory_Profiler_Events_instance(void);
 
+// Register a capture so that its events can refer to it by index. Returns the index (never 0).
+// Registered captures are retained by the event queue until unregistered.
+uint32_t Memory_Profiler_Events_register(VALUE capture);
+
+// Unregister a capture. Any remaining events for it are discarded.
+void Memory_Profiler_Events_unregister(uint32_t capture);
+
+// Get the current overflow policy.
+enum Memory_Profiler_Events_Overflow_Policy Memory_Profiler_Events_overflow_policy(void);
+
 // Enqueue an event to the global queue.
 // object parameter semantics:
 //   - NEWOBJ: the actual object being allocated (queue retains it)
-//   - FREEOBJ: Array with state data for postponed processing
-// Returns non-zero on success, zero on failure.
-// Ruby 3.5 compatible: no FL_SEEN_OBJ_ID or object_id needed
+//   - FREEOBJ: the object being freed (not retained, only used as a key)
+// Returns non-zero on success, zero on failure (including when the memory limit was reached, see the overflow policy).
 int Memory_Profiler_Events_enqueue(
 	enum Memory_Profiler_Event_Type type,
-	VALUE capture,
-	VALUE klass,
+	uint32_t capture,
+	uint32_t klass,
 	VALUE object
 );
 
+// Enqueue a NEWOBJ event without retaining the object.
+// If the object is freed before the event is processed, the event becomes ANNIHILATED (see Memory_Profiler_Events_annihilate).
+// Returns non-zero on success, zero on failure.
+int Memory_Profiler_Events_enqueue_weak(uint32_t capture, uint32_t klass, VALUE object);
+
+// Cancel a pending weak NEWOBJ event for the given capture and object (which is being freed).
+// Returns non-zero if a pending event was found, in which case no FREEOBJ event is required.
+int Memory_Profiler_Events_annihilate(uint32_t capture, VALUE object);
+
+// Retain the objects of a capture's pending weak NEWOBJ events, so that they no longer need to be annihilated (e.g. once its event hook is removed).
+void Memory_Profiler_Events_retain(uint32_t capture);
+
+// Request a drain even if no events are queued, so that captures can flush work deferred by the event hook (see Memory_Profiler_Capture_flush_pending_p).
+// Safe to call from the event hook.
+void Memory_Profiler_Events_trigger(void);
+
+// Whether every queued event has been processed (so none refers to a class index any more).
+int Memory_Profiler_Events_idle_p(void);
+
 // Process all queued events immediately (flush the queue)
 // Called from Capture stop() to ensure all events are processed before stopping
 void Memory_Profiler_Events_process_all(void);
+
+// Counters of the global event queue, which can be read without allocating (e.g. from the event hook).
+struct Memory_Profiler_Events_Counters {
+	size_t queue_size;
+	size_t overflow_count;
+	size_t annihilated_count;
+	size_t drain_count;
+	size_t peak_depth;
+};
+
+// Read the counters of the global event queue.
+void Memory_Profiler_Events_counters(struct Memory_Profiler_Events_Counters *counters);
+
+// Get statistics about the global event queue as a Hash.
+VALUE Memory_Profiler_Events_statistics(void);
+
+// Initialize the Events module.
+void Init_Memory_Profiler_Events(VALUE Memory_Profiler);
@@ -0,0 +1,158 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+// The extension is compiled as C99, which hides the POSIX interfaces used here:
+#define _POSIX_C_SOURCE 200809L
+
+#include "export.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	// Number of allocations between checks of the clock:
+	CLOCK_INTERVAL = 256,
+};
+
+// The layout is part of the file format:
+_Static_assert(sizeof(struct Memory_Profiler_Export_Header) == 256, "export header must be 256 bytes");
+_Static_assert(sizeof(struct Memory_Profiler_Export_Class) == 128, "export class record must be 128 bytes");
+
+static uint64_t Memory_Profiler_Export_clock(clockid_t clock) {
+	struct timespec now;
+	clock_gettime(clock, &now);
+	
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Unlink the segment, unless the path no longer refers to the file this process created (e.g. it was removed and the name reused by someone else):
+static void Memory_Profiler_Export_unlink(struct Memory_Profiler_Export *export) {
+	struct stat status;
+	
+	if (lstat(export->path, &status) == 0 && status.st_dev == export->device && status.st_ino == export->inode) {
+		unlink(export->path);
+	}
+}
+
+struct Memory_Profiler_Export *Memory_Profiler_Export_open(const char *path, size_t capacity, uint64_t interval) {
+	struct Memory_Profiler_Export *export = calloc(1, sizeof(struct Memory_Profiler_Export));
+	if (!export) return NULL;
+	
+	export->path = strdup(path);
+	export->size = sizeof(struct Memory_Profiler_Export_Header) + capacity * sizeof(struct Memory_Profiler_Export_Class);
+	export->capacity = capacity;
+	export->interval = interval;
+	export->countdown = CLOCK_INTERVAL;
+	
+	// Only ever create a new file, private to this user: an existing file (or a symbolic link planted at the path) is an error rather than something to truncate or follow:
+	int fd = export->path ? open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600) : -1;
+	
+	struct stat status;
+	if (fd < 0 || fstat(fd, &status) != 0 || ftruncate(fd, (off_t)export->size) != 0) {
+		int error = errno;
+		if (fd >= 0) {
+			// The file was created above, so it is ours to remove:
+			close(fd);
+			unlink(path);
+		}
+		free(export->path);
+		free(export);
+		errno = error;
+		return NULL;
+	}
+	
+	export->device = status.st_dev;
+	export->inode = status.st_ino;
+	
+	export->memory = mmap(NULL, export->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	
+	// The mapping keeps the file open:
+	int error = errno;
+	close(fd);
+	
+	if (export->memory == MAP_FAILED) {
+		Memory_Profiler_Export_unlink(export);
+		free(export->path);
+		free(export);
+		errno = error;
+		return NULL;
+	}
+	
+	// The file is zero filled, so it is only valid once the magic number is written:
+	export->header = export->memory;
+	export->classes = (struct Memory_Profiler_Export_Class *)((char *)export->memory + sizeof(struct Memory_Profiler_Export_Header));
+	
+	export->header->version = MEMORY_PROFILER_EXPORT_VERSION;
+	export->header->header_size = sizeof(struct Memory_Profiler_Export_Header);
+	export->header->class_size = sizeof(struct Memory_Profiler_Export_Class);
+	export->header->capacity = capacity;
+	export->header->pid = (uint64_t)getpid();
+	
+	atomic_thread_fence(memory_order_release);
+	export->header->magic = MEMORY_PROFILER_EXPORT_MAGIC;
+	
+	return export;
+}
+
+int Memory_Profiler_Export_owner_p(struct Memory_Profiler_Export *export) {
+	return export->header->pid == (uint64_t)getpid();
+}
+
+void Memory_Profiler_Export_close(struct Memory_Profiler_Export *export) {
+	// A forked child leaves the segment to its parent:
+	if (Memory_Profiler_Export_owner_p(export)) {
+		Memory_Profiler_Export_unlink(export);
+	}
+	
+	munmap(export->memory, export->size);
+	
+	free(export->path);
+	free(export);
+}
+
+int Memory_Profiler_Export_due_p(struct Memory_Profiler_Export *export) {
+	if (--export->countdown) return 0;
+	export->countdown = CLOCK_INTERVAL;
+	
+	return Memory_Profiler_Export_clock(CLOCK_MONOTONIC) >= export->deadline;
+}
+
+void Memory_Profiler_Export_begin(struct Memory_Profiler_Export *export) {
+	struct Memory_Profiler_Export_Header *header = export->header;
+	
+	// Mark the update as in progress before any field changes:
+	__atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELAXED);
+	atomic_thread_fence(memory_order_release);
+}
+
+void Memory_Profiler_Export_end(struct Memory_Profiler_Export *export, size_t class_count) {
+	struct Memory_Profiler_Export_Header *header = export->header;
+	
+	header->class_count = class_count;
+	header->update_count += 1;
+	header->updated_at = Memory_Profiler_Export_clock(CLOCK_REALTIME);
+	
+	// Publish the update, after all fields are written:
+	__atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELEASE);
+	
+	export->deadline = Memory_Profiler_Export_clock(CLOCK_MONOTONIC) + export->interval;
+}
+
+void Memory_Profiler_Export_name(struct Memory_Profiler_Export_Class *record, const char *name, size_t length) {
+	if (length >= MEMORY_PROFILER_EXPORT_NAME_SIZE) {
+		length = MEMORY_PROFILER_EXPORT_NAME_SIZE - 1;
+		
+		// Don't split a UTF-8 character:
+		while (length > 0 && ((unsigned char)name[length] & 0xC0) == 0x80) length--;
+	}
+	
+	memcpy(record->name, name, length);
+	memset(record->name + length, 0, MEMORY_PROFILER_EXPORT_NAME_SIZE - length);
+}
@@ -0,0 +1,117 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A shared memory segment (a file, typically under /dev/shm) holding a copy of a capture's counters, so that another process can read them without interrupting this one.
+//
+// The layout is fixed for a given version: a header followed by `capacity` class records, all fields in native byte order. It is updated with a sequence lock: `sequence` is odd while an update is in progress, so a reader copies the segment and retries if `sequence` was odd or changed in the meantime.
+
+enum {
+	// "MPRF", identifying the file:
+	MEMORY_PROFILER_EXPORT_MAGIC = 0x4652504D,
+	MEMORY_PROFILER_EXPORT_VERSION = 1,
+	
+	// Class names are truncated to fit (and always NUL terminated):
+	MEMORY_PROFILER_EXPORT_NAME_SIZE = 112,
+};
+
+struct Memory_Profiler_Export_Header {
+	uint32_t magic;
+	uint32_t version;
+	
+	// Odd while an update is in progress:
+	uint64_t sequence;
+	
+	// The size of this header and of each class record, in bytes, and the number of class records:
+	uint64_t header_size;
+	uint64_t class_size;
+	uint64_t capacity;
+	
+	// The number of valid class records, and the number of tracked classes (which may exceed the capacity):
+	uint64_t class_count;
+	uint64_t tracked_count;
+	
+	// The process writing the segment:
+	uint64_t pid;
+	
+	// The number of updates, and the time of the last one (CLOCK_REALTIME, in nanoseconds):
+	uint64_t update_count;
+	uint64_t updated_at;
+	
+	// Capture counters (see Capture#new_count, Capture#free_count and Capture#statistics):
+	uint64_t new_count;
+	uint64_t free_count;
+	uint64_t dropped_count;
+	uint64_t folded_count;
+	
+	// Event queue counters (see Memory_Profiler_Events_Counters):
+	uint64_t queue_size;
+	uint64_t overflow_count;
+	uint64_t annihilated_count;
+	uint64_t drain_count;
+	uint64_t peak_depth;
+	
+	// Object table counters:
+	uint64_t table_size;
+	uint64_t table_capacity;
+	uint64_t table_tombstones;
+	uint64_t table_memory_size;
+	
+	// Room for future counters, keeping the header at 256 bytes:
+	uint64_t reserved[9];
+};
+
+struct Memory_Profiler_Export_Class {
+	char name[MEMORY_PROFILER_EXPORT_NAME_SIZE];
+	
+	// Allocations and frees of the class, scaled by the sample interval:
+	uint64_t new_count;
+	uint64_t free_count;
+};
+
+struct Memory_Profiler_Export {
+	// The path of the segment, which is unlinked when it is closed, and the file this process created there:
+	char *path;
+	dev_t device;
+	ino_t inode;
+	
+	void *memory;
+	size_t size;
+	
+	struct Memory_Profiler_Export_Header *header;
+	struct Memory_Profiler_Export_Class *classes;
+	size_t capacity;
+	
+	// Minimum time between updates from the event hook (CLOCK_MONOTONIC, in nanoseconds), and when the next one is due:
+	uint64_t interval;
+	uint64_t deadline;
+	
+	// Allocations until the clock is checked again:
+	unsigned countdown;
+};
+
+// Create and map a new segment at path, with room for capacity classes. The file is created with mode 0600, and must not already exist. Returns NULL and sets errno on failure (EEXIST if the path exists).
+struct Memory_Profiler_Export *Memory_Profiler_Export_open(const char *path, size_t capacity, uint64_t interval);
+
+// Whether the segment belongs to this process. After a fork, the child inherits the mapping, but must not update or unlink its parent's segment.
+int Memory_Profiler_Export_owner_p(struct Memory_Profiler_Export *export);
+
+// Unmap the segment (unlinking it, if this process owns it), and free the export.
+void Memory_Profiler_Export_close(struct Memory_Profiler_Export *export);
+
+// Check whether an update is due, called on every allocation. Only reads the clock every few allocations, and does not allocate.
+int Memory_Profiler_Export_due_p(struct Memory_Profiler_Export *export);
+
+// Start an update: the header and class records may be written until Memory_Profiler_Export_end is called.
+void Memory_Profiler_Export_begin(struct Memory_Profiler_Export *export);
+
+// Finish an update with the given number of class records.
+void Memory_Profiler_Export_end(struct Memory_Profiler_Export *export, size_t class_count);
+
+// Copy a class name into a record, truncating it if necessary.
+void Memory_Profiler_Export_name(struct Memory_Profiler_Export_Class *record, const char *name, size_t length);
@@ -3,6 +3,7 @@
 
 // Provides a simple queue for storing elements directly (not as pointers).
 // Elements are enqueued during GC and batch-processed afterward.
+// Storage is a chain of fixed-size segments, so growing never copies (or reallocates) existing elements, and idle segments are released when the queue is cleared.
 
 #pragma once
 
@@ -10,14 +11,22 @@
 #include <string.h>
 #include <assert.h>
 
-static const size_t MEMORY_PROFILER_QUEUE_DEFAULT_COUNT = 128;
+// The size of each segment in bytes:
+static const size_t MEMORY_PROFILER_QUEUE_SEGMENT_SIZE = 64 * 1024;
+
+// The number of segments kept allocated when the queue is cleared:
+static const size_t MEMORY_PROFILER_QUEUE_RETAINED_SEGMENTS = 1;
 
 struct Memory_Profiler_Queue {
-	// The queue storage (elements stored directly, not as pointers):
-	void *base;
+	// The segment storage (elements stored directly, not as pointers):
+	void **segments;
+	
+	// The number of allocated segments, and the capacity of the segments array:
+	size_t segments_count;
+	size_t segments_capacity;
 	
-	// The allocated capacity (number of elements):
-	size_t capacity;
+	// The number of elements in each segment:
+	size_t segment_capacity;
 	
 	// The number of used elements:
 	size_t count;
@@ -29,8 +38,10 @@ struct Memory_Profiler_Queue {
 // Initialize an empty queue
 inline static void Memory_Profiler_Queue_initialize(struct Memory_Profiler_Queue *queue, size_t element_size)
 {
-	queue->base = NULL;
-	queue->capacity = 0;
+	queue->segments = NULL;
+	queue->segments_count = 0;
+	queue->segments_capacity = 0;
+	queue->segment_capacity = MEMORY_PROFILER_QUEUE_SEGMENT_SIZE / element_size;
 	queue->count = 0;
 	queue->element_size = element_size;
 }
@@ -38,85 +49,81 @@ inline static void Memory_Profiler_Queue_initialize(struct Memory_Profiler_Queue
 // Free the queue and its contents
 inline static void Memory_Profiler_Queue_free(struct Memory_Profiler_Queue *queue)
 {
-	if (queue->base) {
-		free(queue->base);
-		queue->base = NULL;
+	for (size_t i = 0; i < queue->segments_count; i++) {
+		free(queue->segments[i]);
 	}
 	
-	queue->capacity = 0;
+	free(queue->segments);
+	queue->segments = NULL;
+	queue->segments_count = 0;
+	queue->segments_capacity = 0;
 	queue->count = 0;
 }
 
-// Resize the queue to have at least the given capacity
-inline static int Memory_Profiler_Queue_resize(struct Memory_Profiler_Queue *queue, size_t required_capacity)
+// The number of bytes of element storage currently allocated:
+inline static size_t Memory_Profiler_Queue_memsize(const struct Memory_Profiler_Queue *queue)
 {
-	if (required_capacity <= queue->capacity) {
-		// Already big enough:
-		return 0;
-	}
-	
-	size_t new_capacity = queue->capacity;
-	
-	// If the queue is empty, we need to set the initial size:
-	if (new_capacity == 0) {
-		new_capacity = MEMORY_PROFILER_QUEUE_DEFAULT_COUNT;
-	}
-	
-	// Double until we reach required capacity
-	while (new_capacity < required_capacity) {
-		// Check for overflow
-		if (new_capacity > (SIZE_MAX / (2 * queue->element_size))) {
-			return -1; // Would overflow
+	return queue->segments_count * MEMORY_PROFILER_QUEUE_SEGMENT_SIZE + queue->segments_capacity * sizeof(void *);
+}
+
+// Whether the next push requires a new segment:
+inline static int Memory_Profiler_Queue_full_p(const struct Memory_Profiler_Queue *queue)
+{
+	return queue->count >= queue->segments_count * queue->segment_capacity;
+}
+
+// Append a new segment, returning 0 on failure
+inline static int Memory_Profiler_Queue_grow(struct Memory_Profiler_Queue *queue)
+{
+	if (queue->segments_count == queue->segments_capacity) {
+		size_t segments_capacity = queue->segments_capacity ? queue->segments_capacity * 2 : 8;
+		void **segments = realloc(queue->segments, segments_capacity * sizeof(void *));
+		if (segments == NULL) {
+			return 0; // Allocation failed
 		}
-		new_capacity *= 2;
+		
+		queue->segments = segments;
+		queue->segments_capacity = segments_capacity;
 	}
 	
-	// Check final size doesn't overflow
-	if (new_capacity > (SIZE_MAX / queue->element_size)) {
-		return -1; // Too large
+	void *segment = malloc(MEMORY_PROFILER_QUEUE_SEGMENT_SIZE);
+	if (segment == NULL) {
+		return 0; // Allocation failed
 	}
 	
-	// Reallocate
-	void *new_base = realloc(queue->base, new_capacity * queue->element_size);
-	if (new_base == NULL) {
-		return -1; // Allocation failed
-	}
-	
-	queue->base = new_base;
-	queue->capacity = new_capacity;
+	queue->segments[queue->segments_count++] = segment;
 	
 	return 1; // Success
 }
 
-// Push a new element onto the end of the queue, returning pointer to the allocated space
-// WARNING: The returned pointer is only valid until the next push operation
+// Push a new element onto the end of the queue, returning pointer to the allocated space (or NULL if a segment could not be allocated)
+// Elements never move, so the returned pointer is valid until the queue is cleared
 inline static void* Memory_Profiler_Queue_push(struct Memory_Profiler_Queue *queue)
 {
-	// Ensure we have capacity
-	size_t new_count = queue->count + 1;
-	if (new_count > queue->capacity) {
-		if (Memory_Profiler_Queue_resize(queue, new_count) == -1) {
+	if (Memory_Profiler_Queue_full_p(queue)) {
+		if (!Memory_Profiler_Queue_grow(queue)) {
 			return NULL;
 		}
 	}
 	
-	// Calculate pointer to the new element
-	void *element = (char*)queue->base + (queue->count * queue->element_size);
-	queue->count++;
+	size_t index = queue->count++;
 	
-	return element;
+	return (char*)queue->segments[index / queue->segment_capacity] + (index % queue->segment_capacity) * queue->element_size;
 }
 
-// Clear the queue (reset count to 0, reusing allocated memory)
+// Clear the queue (reset count to 0), releasing all but the first segments
 inline static void Memory_Profiler_Queue_clear(struct Memory_Profiler_Queue *queue)
 {
 	queue->count = 0;
+	
+	while (queue->segments_count > MEMORY_PROFILER_QUEUE_RETAINED_SEGMENTS) {
+		free(queue->segments[--queue->segments_count]);
+	}
 }
 
 // Get element at index (for iteration)
-// WARNING: Do not hold these pointers across push operations
 inline static void* Memory_Profiler_Queue_at(struct Memory_Profiler_Queue *queue, size_t index)
 {
 	assert(index < queue->count);
-	return (char*)queue->base + (index * queue->element_size);
+	return (char*)queue->segments[index / queue->segment_capacity] + (index % queue->segment_capacity) * queue->element_size;
 }
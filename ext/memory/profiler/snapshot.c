@@ -0,0 +1,242 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "snapshot.h"
+
+#include <string.h>
+
+enum {
+	// Addresses are sorted by digits of this many bits:
+	RADIX_BITS = 11,
+	RADIX_SIZE = 1 << RADIX_BITS,
+};
+
+static VALUE Memory_Profiler_Snapshot = Qnil;
+
+static void Memory_Profiler_Snapshot_mark(void *ptr) {
+	struct Memory_Profiler_Snapshot *snapshot = ptr;
+	
+	// The entries are addresses, not references - only the classes are retained:
+	rb_gc_mark_movable(snapshot->classes);
+}
+
+static void Memory_Profiler_Snapshot_compact(void *ptr) {
+	struct Memory_Profiler_Snapshot *snapshot = ptr;
+	
+	snapshot->classes = rb_gc_location(snapshot->classes);
+}
+
+static void Memory_Profiler_Snapshot_free(void *ptr) {
+	struct Memory_Profiler_Snapshot *snapshot = ptr;
+	
+	xfree(snapshot->entries);
+	xfree(snapshot->counts);
+	xfree(snapshot);
+}
+
+static size_t Memory_Profiler_Snapshot_memsize(const void *ptr) {
+	const struct Memory_Profiler_Snapshot *snapshot = ptr;
+	
+	return sizeof(struct Memory_Profiler_Snapshot)
+		+ snapshot->count * sizeof(struct Memory_Profiler_Snapshot_Entry)
+		+ (NIL_P(snapshot->classes) ? 0 : RARRAY_LEN(snapshot->classes) * sizeof(size_t));
+}
+
+static const rb_data_type_t Memory_Profiler_Snapshot_type = {
+	"Memory::Profiler::Snapshot",
+	{
+		.dmark = Memory_Profiler_Snapshot_mark,
+		.dcompact = Memory_Profiler_Snapshot_compact,
+		.dfree = Memory_Profiler_Snapshot_free,
+		.dsize = Memory_Profiler_Snapshot_memsize,
+	},
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static struct Memory_Profiler_Snapshot *Memory_Profiler_Snapshot_get(VALUE self) {
+	struct Memory_Profiler_Snapshot *snapshot;
+	TypedData_Get_Struct(self, struct Memory_Profiler_Snapshot, &Memory_Profiler_Snapshot_type, snapshot);
+	
+	return snapshot;
+}
+
+// Sort entries by address, with a least significant digit radix sort of their offset from the lowest address (addresses are unique, as the object table is keyed by them).
+static void Memory_Profiler_Snapshot_sort(struct Memory_Profiler_Snapshot *snapshot) {
+	if (snapshot->count < 2) return;
+	
+	uint64_t minimum = UINT64_MAX, maximum = 0;
+	
+	for (size_t index = 0; index < snapshot->count; index++) {
+		uint64_t address = snapshot->entries[index].address;
+		if (address < minimum) minimum = address;
+		if (address > maximum) maximum = address;
+	}
+	
+	uint64_t range = maximum - minimum;
+	
+	size_t *offsets = ALLOC_N(size_t, RADIX_SIZE);
+	struct Memory_Profiler_Snapshot_Entry *source = snapshot->entries;
+	struct Memory_Profiler_Snapshot_Entry *target = ALLOC_N(struct Memory_Profiler_Snapshot_Entry, snapshot->count);
+	
+	for (int shift = 0; shift < 64 && (range >> shift) != 0; shift += RADIX_BITS) {
+		memset(offsets, 0, RADIX_SIZE * sizeof(size_t));
+		
+		for (size_t index = 0; index < snapshot->count; index++) {
+			offsets[((source[index].address - minimum) >> shift) & (RADIX_SIZE - 1)]++;
+		}
+		
+		size_t offset = 0;
+		
+		for (size_t digit = 0; digit < RADIX_SIZE; digit++) {
+			size_t count = offsets[digit];
+			offsets[digit] = offset;
+			offset += count;
+		}
+		
+		for (size_t index = 0; index < snapshot->count; index++) {
+			target[offsets[((source[index].address - minimum) >> shift) & (RADIX_SIZE - 1)]++] = source[index];
+		}
+		
+		struct Memory_Profiler_Snapshot_Entry *sorted = target;
+		target = source;
+		source = sorted;
+	}
+	
+	// The buffer that isn't holding the sorted entries is released:
+	snapshot->entries = source;
+	xfree(target);
+	xfree(offsets);
+}
+
+VALUE Memory_Profiler_Snapshot_new(struct Memory_Profiler_Snapshot_Entry *entries, size_t count, VALUE classes, size_t weight) {
+	struct Memory_Profiler_Snapshot *snapshot;
+	VALUE self = TypedData_Make_Struct(Memory_Profiler_Snapshot, struct Memory_Profiler_Snapshot, &Memory_Profiler_Snapshot_type, snapshot);
+	
+	// Owned by the snapshot from here, so that they are freed if anything below raises:
+	snapshot->entries = entries;
+	snapshot->count = count;
+	snapshot->classes = Qnil;
+	snapshot->weight = weight;
+	snapshot->gc_count = rb_gc_count();
+	
+	rb_ary_freeze(classes);
+	RB_OBJ_WRITE(self, &snapshot->classes, classes);
+	
+	snapshot->counts = ZALLOC_N(size_t, RARRAY_LEN(classes));
+	
+	for (size_t index = 0; index < count; index++) {
+		snapshot->counts[entries[index].klass] += entries[index].weight;
+	}
+	
+	Memory_Profiler_Snapshot_sort(snapshot);
+	
+	return rb_obj_freeze(self);
+}
+
+// Snapshot#size
+// The number of objects in the snapshot (not scaled by the sample rate).
+static VALUE Memory_Profiler_Snapshot_size(VALUE self) {
+	return SIZET2NUM(Memory_Profiler_Snapshot_get(self)->count);
+}
+
+// Snapshot#gc_count
+// The value of GC.count when the snapshot was taken.
+static VALUE Memory_Profiler_Snapshot_gc_count(VALUE self) {
+	return SIZET2NUM(Memory_Profiler_Snapshot_get(self)->gc_count);
+}
+
+// Snapshot#counts
+// The number of objects of each class, as a Hash (class => count), scaled like retained counts when sampling.
+static VALUE Memory_Profiler_Snapshot_counts(VALUE self) {
+	struct Memory_Profiler_Snapshot *snapshot = Memory_Profiler_Snapshot_get(self);
+	
+	VALUE counts = rb_hash_new();
+	
+	for (long index = 0; index < RARRAY_LEN(snapshot->classes); index++) {
+		rb_hash_aset(counts, RARRAY_AREF(snapshot->classes, index), SIZET2NUM(snapshot->counts[index] * snapshot->weight));
+	}
+	
+	return counts;
+}
+
+// Add the counts of each class to the [added, removed] pair of its class in result.
+static void Memory_Profiler_Snapshot_diff_counts(VALUE result, VALUE classes, const size_t *counts, size_t weight, long pair_index) {
+	for (long index = 0; index < RARRAY_LEN(classes); index++) {
+		if (!counts[index]) continue;
+		
+		VALUE klass = RARRAY_AREF(classes, index);
+		VALUE pair = rb_hash_lookup(result, klass);
+		
+		if (NIL_P(pair)) {
+			pair = rb_ary_new_from_args(2, INT2FIX(0), INT2FIX(0));
+			rb_hash_aset(result, klass, pair);
+		}
+		
+		rb_ary_store(pair, pair_index, SIZET2NUM(counts[index] * weight));
+	}
+}
+
+// Snapshot#diff(other)
+// Compare with a later snapshot, in a single merge of both (sorted) sets of addresses, returning the number of objects added and removed per class, as a Hash (class => [added, removed]). Classes without changes are omitted.
+// An object at the same address is the same object only if its class and allocation epoch match (where both are known), otherwise it was freed and its address reused.
+// Objects are identified by address, so objects moved by compaction between the snapshots count as both removed and added.
+static VALUE Memory_Profiler_Snapshot_diff(VALUE self, VALUE other) {
+	struct Memory_Profiler_Snapshot *before = Memory_Profiler_Snapshot_get(self);
+	struct Memory_Profiler_Snapshot *after = Memory_Profiler_Snapshot_get(other);
+	
+	// Temporary buffers, released by GC if anything below raises:
+	VALUE removed_buffer, added_buffer;
+	size_t *removed = ALLOCV_N(size_t, removed_buffer, RARRAY_LEN(before->classes) + 1);
+	size_t *added = ALLOCV_N(size_t, added_buffer, RARRAY_LEN(after->classes) + 1);
+	
+	memset(removed, 0, (RARRAY_LEN(before->classes) + 1) * sizeof(size_t));
+	memset(added, 0, (RARRAY_LEN(after->classes) + 1) * sizeof(size_t));
+	
+	size_t i = 0, j = 0;
+	
+	while (i < before->count && j < after->count) {
+		const struct Memory_Profiler_Snapshot_Entry *a = &before->entries[i];
+		const struct Memory_Profiler_Snapshot_Entry *b = &after->entries[j];
+		
+		if (a->address < b->address) {
+			removed[a->klass] += a->weight;
+			i++;
+		} else if (a->address > b->address) {
+			added[b->klass] += b->weight;
+			j++;
+		} else {
+			if ((a->epoch && b->epoch && a->epoch != b->epoch) || RARRAY_AREF(before->classes, a->klass) != RARRAY_AREF(after->classes, b->klass)) {
+				removed[a->klass] += a->weight;
+				added[b->klass] += b->weight;
+			}
+			
+			i++;
+			j++;
+		}
+	}
+	
+	for (; i < before->count; i++) removed[before->entries[i].klass] += before->entries[i].weight;
+	for (; j < after->count; j++) added[after->entries[j].klass] += after->entries[j].weight;
+	
+	VALUE result = rb_hash_new();
+	
+	Memory_Profiler_Snapshot_diff_counts(result, after->classes, added, after->weight, 0);
+	Memory_Profiler_Snapshot_diff_counts(result, before->classes, removed, before->weight, 1);
+	
+	ALLOCV_END(removed_buffer);
+	ALLOCV_END(added_buffer);
+	
+	return result;
+}
+
+void Init_Memory_Profiler_Snapshot(VALUE Memory_Profiler)
+{
+	// Snapshots are taken with Capture#snapshot:
+	Memory_Profiler_Snapshot = rb_define_class_under(Memory_Profiler, "Snapshot", rb_cObject);
+	rb_undef_alloc_func(Memory_Profiler_Snapshot);
+	
+	rb_define_method(Memory_Profiler_Snapshot, "size", Memory_Profiler_Snapshot_size, 0);
+	rb_define_method(Memory_Profiler_Snapshot, "gc_count", Memory_Profiler_Snapshot_gc_count, 0);
+	rb_define_method(Memory_Profiler_Snapshot, "counts", Memory_Profiler_Snapshot_counts, 0);
+	rb_define_method(Memory_Profiler_Snapshot, "diff", Memory_Profiler_Snapshot_diff, 1);
+}
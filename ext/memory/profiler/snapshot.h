@@ -0,0 +1,46 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// An object recorded in a snapshot.
+struct Memory_Profiler_Snapshot_Entry {
+	// The object address (objects are not retained, so it may have been freed since):
+	uint64_t address;
+	
+	// The index of the object's class in the snapshot's classes:
+	uint32_t klass;
+	
+	// The GC count when the object was allocated, truncated to 16 bits (0 if it is no longer known, for objects older than the capture's epoch window), so that a new object at the address of a freed one is not mistaken for it:
+	uint16_t epoch;
+	
+	// The number of sampled allocations the object stands for (see Memory_Profiler_Object_Table_Entry), in units of the snapshot's weight:
+	uint16_t weight;
+};
+
+// An immutable set of the objects recorded by a capture, sorted by address, with the number of objects of each class.
+struct Memory_Profiler_Snapshot {
+	struct Memory_Profiler_Snapshot_Entry *entries;
+	size_t count;
+	
+	// The classes of the entries (an Array), and the total weight of the entries of each:
+	VALUE classes;
+	size_t *counts;
+	
+	// The number of allocations each unit of entry weight stands for (the capture's sample interval):
+	size_t weight;
+	
+	// The number of garbage collections when the snapshot was taken:
+	size_t gc_count;
+};
+
+// Create a snapshot from entries allocated with ALLOC_N, taking ownership of them. Entry classes are indices into classes (an Array, which is frozen).
+// The entries are sorted by address.
+VALUE Memory_Profiler_Snapshot_new(struct Memory_Profiler_Snapshot_Entry *entries, size_t count, VALUE classes, size_t weight);
+
+// Initialize the Snapshot class.
+void Init_Memory_Profiler_Snapshot(VALUE Memory_Profiler);
@@ -0,0 +1,368 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "stacks.h"
+#include "events.h"
+
+#include <ruby/debug.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	INITIAL_CAPACITY = 64,
+	INITIAL_FRAMES_CAPACITY = 1024,
+};
+
+struct Memory_Profiler_Stacks* Memory_Profiler_Stacks_new(void) {
+	struct Memory_Profiler_Stacks *stacks = calloc(1, sizeof(struct Memory_Profiler_Stacks));
+	
+	if (!stacks) {
+		return NULL;
+	}
+	
+	stacks->frames_count = 1;
+	stacks->frames_capacity = INITIAL_FRAMES_CAPACITY;
+	stacks->frames = calloc(stacks->frames_capacity, sizeof(struct Memory_Profiler_Stacks_Frame));
+	
+	stacks->frame_slots_capacity = INITIAL_FRAMES_CAPACITY * 2;
+	stacks->frame_slots = calloc(stacks->frame_slots_capacity, sizeof(uint32_t));
+	
+	stacks->stack_frames_count = 0;
+	stacks->stack_frames_capacity = INITIAL_FRAMES_CAPACITY;
+	stacks->stack_frames = malloc(stacks->stack_frames_capacity * sizeof(uint32_t));
+	
+	stacks->count = 1;
+	stacks->capacity = INITIAL_CAPACITY;
+	stacks->stacks = calloc(stacks->capacity, sizeof(struct Memory_Profiler_Stack));
+	
+	stacks->slots_capacity = INITIAL_CAPACITY * 2;
+	stacks->slots = calloc(stacks->slots_capacity, sizeof(uint32_t));
+	
+	if (!stacks->frames || !stacks->frame_slots || !stacks->stack_frames || !stacks->stacks || !stacks->slots) {
+		Memory_Profiler_Stacks_free(stacks);
+		return NULL;
+	}
+	
+	return stacks;
+}
+
+void Memory_Profiler_Stacks_free(struct Memory_Profiler_Stacks *stacks) {
+	if (stacks) {
+		free(stacks->frames);
+		free(stacks->frame_slots);
+		free(stacks->stack_frames);
+		free(stacks->stacks);
+		free(stacks->slots);
+		free(stacks);
+	}
+}
+
+void Memory_Profiler_Stacks_clear(struct Memory_Profiler_Stacks *stacks) {
+	stacks->frames_count = 1;
+	memset(stacks->frame_slots, 0, stacks->frame_slots_capacity * sizeof(uint32_t));
+	
+	stacks->stack_frames_count = 0;
+	
+	stacks->count = 1;
+	memset(stacks->slots, 0, stacks->slots_capacity * sizeof(uint32_t));
+}
+
+static inline uint64_t Memory_Profiler_Stacks_mix(uint64_t hash, uint64_t value) {
+	hash ^= value;
+	hash *= 0x9E3779B97F4A7C15ULL;
+	
+	return hash ^ (hash >> 29);
+}
+
+static inline uint32_t Memory_Profiler_Stacks_frame_hash(VALUE frame, VALUE caller, int line) {
+	uint64_t hash = Memory_Profiler_Stacks_mix(0, frame);
+	hash = Memory_Profiler_Stacks_mix(hash, caller);
+	hash = Memory_Profiler_Stacks_mix(hash, (uint64_t)line);
+	
+	return (uint32_t)(hash >> 32);
+}
+
+// Find the empty slot for a new index with the given hash.
+static inline size_t Memory_Profiler_Stacks_empty_slot(const uint32_t *slots, size_t slots_capacity, uint32_t hash) {
+	size_t mask = slots_capacity - 1;
+	size_t slot = hash & mask;
+	
+	while (slots[slot]) {
+		slot = (slot + 1) & mask;
+	}
+	
+	return slot;
+}
+
+// Double the capacity of an open addressing map, reinserting every index by its stored hash.
+static uint32_t *Memory_Profiler_Stacks_rehash(size_t slots_capacity, size_t count, const void *items, size_t item_size, size_t hash_offset) {
+	uint32_t *slots = calloc(slots_capacity, sizeof(uint32_t));
+	
+	if (!slots) return NULL;
+	
+	for (uint32_t index = 1; index < count; index++) {
+		uint32_t hash;
+		memcpy(&hash, (const char *)items + index * item_size + hash_offset, sizeof(hash));
+		
+		slots[Memory_Profiler_Stacks_empty_slot(slots, slots_capacity, hash)] = index;
+	}
+	
+	return slots;
+}
+
+// Get the index of a frame, adding it if required. Returns 0 on allocation failure.
+static uint32_t Memory_Profiler_Stacks_intern_frame(struct Memory_Profiler_Stacks *stacks, VALUE frame, VALUE caller, int line, uint32_t hash) {
+	struct Memory_Profiler_Stacks_Frame *frames = stacks->frames;
+	size_t mask = stacks->frame_slots_capacity - 1;
+	size_t slot = hash & mask;
+	
+	while (stacks->frame_slots[slot]) {
+		uint32_t index = stacks->frame_slots[slot];
+		
+		if (frames[index].frame == frame && frames[index].caller == caller && frames[index].line == line) {
+			return index;
+		}
+		
+		slot = (slot + 1) & mask;
+	}
+	
+	if (stacks->frames_count >= UINT32_MAX) return 0;
+	
+	if (stacks->frames_count == stacks->frames_capacity) {
+		frames = realloc(stacks->frames, stacks->frames_capacity * 2 * sizeof(struct Memory_Profiler_Stacks_Frame));
+		if (!frames) return 0;
+		
+		stacks->frames = frames;
+		stacks->frames_capacity *= 2;
+	}
+	
+	// Keep the map at most half full:
+	if ((stacks->frames_count + 1) * 2 > stacks->frame_slots_capacity) {
+		size_t frame_slots_capacity = stacks->frame_slots_capacity * 2;
+		uint32_t *frame_slots = Memory_Profiler_Stacks_rehash(frame_slots_capacity, stacks->frames_count, frames, sizeof(*frames), offsetof(struct Memory_Profiler_Stacks_Frame, hash));
+		if (!frame_slots) return 0;
+		
+		free(stacks->frame_slots);
+		stacks->frame_slots = frame_slots;
+		stacks->frame_slots_capacity = frame_slots_capacity;
+		
+		slot = Memory_Profiler_Stacks_empty_slot(stacks->frame_slots, stacks->frame_slots_capacity, hash);
+	}
+	
+	uint32_t index = (uint32_t)stacks->frames_count++;
+	
+	frames[index].frame = frame;
+	frames[index].caller = caller;
+	frames[index].line = line;
+	frames[index].hash = hash;
+	
+	stacks->frame_slots[slot] = index;
+	
+	return index;
+}
+
+// Whether an existing stack matches the given (resolved) frames.
+static inline int Memory_Profiler_Stacks_equal_p(struct Memory_Profiler_Stacks *stacks, struct Memory_Profiler_Stack *stack, uint32_t hash, VALUE klass, const VALUE *frames, const VALUE *callers, const int *lines, int depth) {
+	if (stack->hash != hash || stack->klass != klass || stack->depth != (uint32_t)depth) return 0;
+	
+	const uint32_t *indices = Memory_Profiler_Stacks_frames(stacks, stack);
+	
+	for (int i = 0; i < depth; i++) {
+		struct Memory_Profiler_Stacks_Frame *frame = &stacks->frames[indices[i]];
+		
+		if (frame->frame != frames[i] || frame->caller != callers[i] || frame->line != lines[i]) return 0;
+	}
+	
+	return 1;
+}
+
+uint32_t Memory_Profiler_Stacks_intern(struct Memory_Profiler_Stacks *stacks, VALUE klass, const VALUE *frames, const int *lines, int depth) {
+	if (depth > MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH) depth = MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH;
+	
+	VALUE callers[MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH];
+	int resolved_lines[MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH];
+	uint32_t hashes[MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH];
+	
+	// C function frames have no line number, resolve them to the nearest Ruby caller (outer frames come later):
+	VALUE caller = 0;
+	int caller_line = 0;
+	
+	for (int i = depth - 1; i >= 0; i--) {
+		if (lines[i]) {
+			callers[i] = 0;
+			resolved_lines[i] = lines[i];
+			
+			caller = frames[i];
+			caller_line = lines[i];
+		} else {
+			callers[i] = caller;
+			resolved_lines[i] = caller_line;
+		}
+	}
+	
+	uint64_t stack_hash = Memory_Profiler_Stacks_mix(0, klass);
+	
+	for (int i = 0; i < depth; i++) {
+		hashes[i] = Memory_Profiler_Stacks_frame_hash(frames[i], callers[i], resolved_lines[i]);
+		stack_hash = Memory_Profiler_Stacks_mix(stack_hash, hashes[i]);
+	}
+	
+	uint32_t hash = (uint32_t)(stack_hash >> 32);
+	
+	size_t mask = stacks->slots_capacity - 1;
+	size_t slot = hash & mask;
+	
+	while (stacks->slots[slot]) {
+		uint32_t index = stacks->slots[slot];
+		
+		if (Memory_Profiler_Stacks_equal_p(stacks, &stacks->stacks[index], hash, klass, frames, callers, resolved_lines, depth)) {
+			return index;
+		}
+		
+		slot = (slot + 1) & mask;
+	}
+	
+	// Indices stay below the stack tag, so that events can tag them and they fit in the object table (see MEMORY_PROFILER_EVENT_KLASS_STACK):
+	if (stacks->count >= MEMORY_PROFILER_EVENT_KLASS_STACK) return 0;
+	
+	if (stacks->count == stacks->capacity) {
+		struct Memory_Profiler_Stack *array = realloc(stacks->stacks, stacks->capacity * 2 * sizeof(struct Memory_Profiler_Stack));
+		if (!array) return 0;
+		
+		stacks->stacks = array;
+		stacks->capacity *= 2;
+	}
+	
+	if (stacks->stack_frames_count + depth > stacks->stack_frames_capacity) {
+		size_t stack_frames_capacity = stacks->stack_frames_capacity * 2;
+		while (stack_frames_capacity < stacks->stack_frames_count + depth) {
+			stack_frames_capacity *= 2;
+		}
+		
+		uint32_t *stack_frames = realloc(stacks->stack_frames, stack_frames_capacity * sizeof(uint32_t));
+		if (!stack_frames) return 0;
+		
+		stacks->stack_frames = stack_frames;
+		stacks->stack_frames_capacity = stack_frames_capacity;
+	}
+	
+	// Keep the map at most half full:
+	if ((stacks->count + 1) * 2 > stacks->slots_capacity) {
+		size_t slots_capacity = stacks->slots_capacity * 2;
+		uint32_t *slots = Memory_Profiler_Stacks_rehash(slots_capacity, stacks->count, stacks->stacks, sizeof(struct Memory_Profiler_Stack), offsetof(struct Memory_Profiler_Stack, hash));
+		if (!slots) return 0;
+		
+		free(stacks->slots);
+		stacks->slots = slots;
+		stacks->slots_capacity = slots_capacity;
+		
+		slot = Memory_Profiler_Stacks_empty_slot(stacks->slots, stacks->slots_capacity, hash);
+	}
+	
+	uint32_t *indices = stacks->stack_frames + stacks->stack_frames_count;
+	
+	for (int i = 0; i < depth; i++) {
+		indices[i] = Memory_Profiler_Stacks_intern_frame(stacks, frames[i], callers[i], resolved_lines[i], hashes[i]);
+		if (!indices[i]) return 0;
+	}
+	
+	uint32_t index = (uint32_t)stacks->count++;
+	struct Memory_Profiler_Stack *stack = &stacks->stacks[index];
+	
+	stack->klass = klass;
+	stack->offset = stacks->stack_frames_count;
+	stack->depth = (uint32_t)depth;
+	stack->hash = hash;
+	stack->new_count = 0;
+	stack->free_count = 0;
+	stack->node = 0;
+	stack->node_retained_count = 0;
+	
+	stacks->stack_frames_count += depth;
+	stacks->slots[slot] = index;
+	
+	return index;
+}
+
+struct Memory_Profiler_Stack* Memory_Profiler_Stacks_get(struct Memory_Profiler_Stacks *stacks, uint32_t index) {
+	if (index == 0 || index >= stacks->count) {
+		return NULL;
+	}
+	
+	return &stacks->stacks[index];
+}
+
+VALUE Memory_Profiler_Stacks_location(struct Memory_Profiler_Stacks *stacks, uint32_t index) {
+	if (index == 0 || index >= stacks->frames_count) {
+		return rb_str_new_cstr("<unknown>");
+	}
+	
+	struct Memory_Profiler_Stacks_Frame *frame = &stacks->frames[index];
+	
+	VALUE path = rb_profile_frame_path(frame->caller ? frame->caller : frame->frame);
+	VALUE label = rb_profile_frame_full_label(frame->frame);
+	
+	if (NIL_P(path)) {
+		return rb_sprintf("<unknown>:in '%"PRIsVALUE"'", label);
+	}
+	
+	return rb_sprintf("%"PRIsVALUE":%d:in '%"PRIsVALUE"'", path, frame->line, label);
+}
+
+VALUE Memory_Profiler_Stacks_locations(struct Memory_Profiler_Stacks *stacks, struct Memory_Profiler_Stack *stack) {
+	VALUE locations = rb_ary_new_capa(stack->depth);
+	
+	// Copied, as symbolizing allocates, which may intern new stacks:
+	uint32_t depth = stack->depth;
+	uint32_t indices[MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH];
+	memcpy(indices, Memory_Profiler_Stacks_frames(stacks, stack), depth * sizeof(uint32_t));
+	
+	for (uint32_t i = 0; i < depth; i++) {
+		rb_ary_push(locations, Memory_Profiler_Stacks_location(stacks, indices[i]));
+	}
+	
+	return locations;
+}
+
+void Memory_Profiler_Stacks_remap_nodes(struct Memory_Profiler_Stacks *stacks, VALUE klass, const uint32_t *remap) {
+	for (size_t index = 1; index < stacks->count; index++) {
+		struct Memory_Profiler_Stack *stack = &stacks->stacks[index];
+		
+		if (stack->klass != klass || !stack->node) continue;
+		
+		stack->node = remap ? remap[stack->node] : 0;
+		
+		// Live allocations of a discarded node are no longer counted in the tree:
+		if (!stack->node) {
+			stack->node_retained_count = 0;
+		}
+	}
+}
+
+void Memory_Profiler_Stacks_mark(struct Memory_Profiler_Stacks *stacks) {
+	if (!stacks) return;
+	
+	for (size_t index = 1; index < stacks->count; index++) {
+		rb_gc_mark(stacks->stacks[index].klass);
+	}
+	
+	for (size_t index = 1; index < stacks->frames_count; index++) {
+		rb_gc_mark(stacks->frames[index].frame);
+		
+		if (stacks->frames[index].caller) {
+			rb_gc_mark(stacks->frames[index].caller);
+		}
+	}
+}
+
+size_t Memory_Profiler_Stacks_memsize(struct Memory_Profiler_Stacks *stacks) {
+	if (!stacks) return 0;
+	
+	return sizeof(struct Memory_Profiler_Stacks)
+		+ stacks->frames_capacity * sizeof(struct Memory_Profiler_Stacks_Frame)
+		+ stacks->frame_slots_capacity * sizeof(uint32_t)
+		+ stacks->stack_frames_capacity * sizeof(uint32_t)
+		+ stacks->capacity * sizeof(struct Memory_Profiler_Stack)
+		+ stacks->slots_capacity * sizeof(uint32_t);
+}
@@ -0,0 +1,110 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	// Maximum number of frames in a stack.
+	MEMORY_PROFILER_STACKS_MAXIMUM_DEPTH = 128,
+};
+
+// An interned frame: a profile frame (from rb_profile_frames), and the location it is reported at.
+struct Memory_Profiler_Stacks_Frame {
+	VALUE frame;
+	
+	// C functions have no location of their own, so like Thread::Backtrace::Location, they are reported at the location of the nearest Ruby caller (0 = none, or not a C function):
+	VALUE caller;
+	int line;
+	
+	uint32_t hash;
+};
+
+// A unique allocation stack (per class), and the allocations recorded with it.
+struct Memory_Profiler_Stack {
+	// The class of the allocated objects:
+	VALUE klass;
+	
+	// The frame indices of the stack, innermost first (offset into the shared stack frame storage):
+	size_t offset;
+	uint32_t depth;
+	
+	uint32_t hash;
+	
+	// Allocations recorded with this stack, and how many of them have been freed:
+	size_t new_count;
+	size_t free_count;
+	
+	// The leaf node of this stack in its class's call tree (0 = not created yet), and the live allocations counted against it:
+	uint32_t node;
+	size_t node_retained_count;
+};
+
+// Hash-conses allocation stacks captured with rb_profile_frames, so that each object only needs to store a small stack index.
+// Uses system malloc/free (not ruby_xmalloc), so stacks can be interned from the event hook.
+// Index 0 is reserved to mean "no stack" (and "no frame").
+struct Memory_Profiler_Stacks {
+	// Index => frame:
+	struct Memory_Profiler_Stacks_Frame *frames;
+	size_t frames_count;
+	size_t frames_capacity;
+	
+	// Open addressing map from frame to index (0 = empty slot), capacity is a power of two:
+	uint32_t *frame_slots;
+	size_t frame_slots_capacity;
+	
+	// Frame indices of all stacks:
+	uint32_t *stack_frames;
+	size_t stack_frames_count;
+	size_t stack_frames_capacity;
+	
+	// Index => stack:
+	struct Memory_Profiler_Stack *stacks;
+	size_t count;
+	size_t capacity;
+	
+	// Open addressing map from stack to index (0 = empty slot), capacity is a power of two:
+	uint32_t *slots;
+	size_t slots_capacity;
+};
+
+// Create a new, empty stack table.
+struct Memory_Profiler_Stacks* Memory_Profiler_Stacks_new(void);
+
+// Free the table and all its memory.
+void Memory_Profiler_Stacks_free(struct Memory_Profiler_Stacks *stacks);
+
+// Remove all stacks and frames. Previously returned indices become invalid.
+void Memory_Profiler_Stacks_clear(struct Memory_Profiler_Stacks *stacks);
+
+// Get the index of a stack (as returned by rb_profile_frames), adding it to the table if required.
+// Returns 0 if the stack could not be added (allocation failure).
+// The caller is responsible for the write barriers of the class and frames when a stack or frame is added (i.e. when count or frames_count changes).
+uint32_t Memory_Profiler_Stacks_intern(struct Memory_Profiler_Stacks *stacks, VALUE klass, const VALUE *frames, const int *lines, int depth);
+
+// Get the stack for an index, or NULL if the index is invalid.
+struct Memory_Profiler_Stack* Memory_Profiler_Stacks_get(struct Memory_Profiler_Stacks *stacks, uint32_t index);
+
+// Get the frame indices of a stack, innermost first.
+static inline const uint32_t* Memory_Profiler_Stacks_frames(struct Memory_Profiler_Stacks *stacks, struct Memory_Profiler_Stack *stack) {
+	return stacks->stack_frames + stack->offset;
+}
+
+// Symbolize a frame into a "path:line:in 'label'" string. Allocates, so it must not be called from the event hook.
+VALUE Memory_Profiler_Stacks_location(struct Memory_Profiler_Stacks *stacks, uint32_t frame);
+
+// Symbolize a stack into an array of locations, innermost first.
+VALUE Memory_Profiler_Stacks_locations(struct Memory_Profiler_Stacks *stacks, struct Memory_Profiler_Stack *stack);
+
+// Update the call tree nodes of a class's stacks after its call tree was pruned (remap[node] is the new index of each node, 0 if it was discarded), or cleared (remap is NULL).
+void Memory_Profiler_Stacks_remap_nodes(struct Memory_Profiler_Stacks *stacks, VALUE klass, const uint32_t *remap);
+
+// Mark all classes and frames. They are pinned, so stacks never need to be rehashed.
+// Must be called from dmark callback.
+void Memory_Profiler_Stacks_mark(struct Memory_Profiler_Stacks *stacks);
+
+// Get the memory used by the table.
+size_t Memory_Profiler_Stacks_memsize(struct Memory_Profiler_Stacks *stacks);
@@ -10,38 +10,320 @@ enum {
 	DEBUG = 1,
 	
 	// Performance monitoring thresholds
-
-	// Log warning if probe chain exceeds this
-	WARN_PROBE_LENGTH = 100,
-
-	// Safety limit - abort search if exceeded
-	MAX_PROBE_LENGTH = 10000,
+	
+	// Log warning if probe chain exceeds this many groups
+	WARN_PROBE_LENGTH = 32,
+	
+	// Number of control bytes compared at once
+	GROUP_WIDTH = 16,
+	
+	// Number of previous slots migrated by each insert or lookup during an incremental resize
+	// Growing doubles the capacity, so the migration finishes long before the new slots fill up
+	MIGRATION_STEP = 64,
+	
+	// Control bytes: full slots hold the low 7 bits of the hash (high bit clear), empty and deleted slots have the high bit set
+	CONTROL_EMPTY = 0x80,
+	CONTROL_DELETED = 0xFE,
+	
+	// Initial capacity of the data vector, allocated when the first data is stored
+	DATA_INITIAL_CAPACITY = 16,
 };
 
-// Use the Entry struct from header
-// (No local definition needed)
 const size_t INITIAL_CAPACITY = 1024;
-const float LOAD_FACTOR = 0.50;  // Reduced from 0.75 to avoid clustering
 
+// Shrink (by half) when fewer than 1/8 of the slots are used
+const size_t SHRINK_FACTOR = 8;
+
+// Maximum load (count + tombstones), as a fraction of capacity: 7/8
+const size_t LOAD_FACTOR_NUMERATOR = 7;
+const size_t LOAD_FACTOR_DENOMINATOR = 8;
+
+// Compressed keys are offsets in units of 8 bytes, covering 32GiB, and the key base is placed half way below the first object
+const int KEY_SHIFT = 3;
+const uint64_t KEY_RANGE = (uint64_t)1 << 35;
+
+// Compressed entries are packed without padding:
+_Static_assert(sizeof(struct Memory_Profiler_Object_Table_Slot) == 9, "compressed object table entries must be 9 bytes");
+
+// Groups are compared with SSE2 where the compiler targets it, chosen at compile time rather than by runtime CPU detection: SSE2 is part of the x86-64 baseline, so every x86-64 build uses it, and other targets use the portable loop below.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+// Bitmask of the slots in the group (starting at control) whose control byte is equal to value
+static inline uint32_t group_match(const uint8_t *control, uint8_t value) {
+	__m128i group = _mm_loadu_si128((const __m128i *)control);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)value)));
+}
+
+// Bitmask of the slots in the group that are empty or deleted
+static inline uint32_t group_match_available(const uint8_t *control) {
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)control));
+}
+#else
+// Portable fallback, one control byte at a time
+static inline uint32_t group_match(const uint8_t *control, uint8_t value) {
+	uint32_t mask = 0;
+	
+	for (int i = 0; i < GROUP_WIDTH; i++) {
+		if (control[i] == value) mask |= (uint32_t)1 << i;
+	}
+	
+	return mask;
+}
+
+static inline uint32_t group_match_available(const uint8_t *control) {
+	uint32_t mask = 0;
+	
+	for (int i = 0; i < GROUP_WIDTH; i++) {
+		if (control[i] & CONTROL_EMPTY) mask |= (uint32_t)1 << i;
+	}
+	
+	return mask;
+}
+#endif
+
+static inline int control_full_p(uint8_t control) {
+	return (control & CONTROL_EMPTY) == 0;
+}
+
+// Hash function for object addresses
+// A single multiply with xor-shifts is enough to spread aligned, mostly consecutive addresses over both the low bits (slot) and the control byte
+static inline uint64_t hash_object(VALUE object) {
+	uint64_t hash = (uint64_t)object >> 3;
+	
+	hash ^= hash >> 29;
+	hash *= 0xBF58476D1CE4E5B9ULL;
+	hash ^= hash >> 32;
+	
+	return hash;
+}
+
+// The slot where probing starts
+static inline size_t hash_position(uint64_t hash, size_t capacity) {
+	return (size_t)(hash >> 7) & (capacity - 1);
+}
+
+// The control byte stored for a full slot
+static inline uint8_t hash_control(uint64_t hash) {
+	return (uint8_t)(hash & 0x7F);
+}
+
+// Filter index, using the high bits of a Fibonacci hash (independent of the probing hash).
+static inline size_t filter_index(size_t shift, VALUE object) {
+	return (size_t)((((uint64_t)object >> 3) * 0x9E3779B97F4A7C15ULL) >> shift);
+}
+
+static inline void filter_increment(struct Memory_Profiler_Object_Table_Slots *slots, VALUE object) {
+	uint8_t *counter = &slots->filter[filter_index(slots->filter_shift, object)];
+	if (*counter != UINT8_MAX) (*counter)++;
+}
+
+static inline void filter_decrement(struct Memory_Profiler_Object_Table_Slots *slots, VALUE object) {
+	uint8_t *counter = &slots->filter[filter_index(slots->filter_shift, object)];
+	// Saturated counters have lost track of their exact count, so leave them set:
+	if (*counter != UINT8_MAX && *counter > 0) (*counter)--;
+}
+
+static inline size_t filter_size(const struct Memory_Profiler_Object_Table_Slots *slots) {
+	return (size_t)1 << (64 - slots->filter_shift);
+}
+
+#pragma mark - Keys
+
+static inline size_t entry_size(const struct Memory_Profiler_Object_Table *table) {
+	return table->wide_keys ? sizeof(struct Memory_Profiler_Object_Table_Wide_Slot) : sizeof(struct Memory_Profiler_Object_Table_Slot);
+}
+
+// Encode an object address as stored in the keys. Returns 0 if it's out of range of the compressed keys.
+static inline int key_encode(const struct Memory_Profiler_Object_Table *table, VALUE object, uint64_t *key) {
+	if (table->wide_keys) {
+		*key = (uint64_t)object;
+		return 1;
+	}
+	
+	// Addresses below the base wrap around, and are out of range too:
+	uint64_t offset = (uint64_t)object - (uint64_t)table->key_base;
+	if (offset >= KEY_RANGE || (offset & ((1 << KEY_SHIFT) - 1))) return 0;
+	
+	*key = offset >> KEY_SHIFT;
+	return 1;
+}
+
+static inline VALUE key_decode(const struct Memory_Profiler_Object_Table *table, uint64_t key) {
+	if (table->wide_keys) return (VALUE)key;
+	
+	return table->key_base + (VALUE)(key << KEY_SHIFT);
+}
+
+static inline uint64_t key_load(const struct Memory_Profiler_Object_Table *table, const struct Memory_Profiler_Object_Table_Slots *slots, size_t index) {
+	if (table->wide_keys) return ((const struct Memory_Profiler_Object_Table_Wide_Slot *)slots->entries)[index].key;
+	
+	uint32_t key;
+	memcpy(&key, ((const struct Memory_Profiler_Object_Table_Slot *)slots->entries)[index].key, sizeof(key));
+	
+	return key;
+}
+
+static inline uint32_t klass_load(const struct Memory_Profiler_Object_Table *table, const struct Memory_Profiler_Object_Table_Slots *slots, size_t index) {
+	if (table->wide_keys) return ((const struct Memory_Profiler_Object_Table_Wide_Slot *)slots->entries)[index].klass;
+	
+	const uint8_t *klass = ((const struct Memory_Profiler_Object_Table_Slot *)slots->entries)[index].klass;
+	
+	return (uint32_t)klass[0] | ((uint32_t)klass[1] << 8) | ((uint32_t)klass[2] << 16);
+}
+
+static inline uint16_t epoch_load(const struct Memory_Profiler_Object_Table *table, const struct Memory_Profiler_Object_Table_Slots *slots, size_t index) {
+	if (table->wide_keys) return ((const struct Memory_Profiler_Object_Table_Wide_Slot *)slots->entries)[index].epoch;
+	
+	uint16_t epoch;
+	memcpy(&epoch, ((const struct Memory_Profiler_Object_Table_Slot *)slots->entries)[index].epoch, sizeof(epoch));
+	
+	return epoch;
+}
+
+// Replace the class and epoch of an entry, keeping its key
+static inline void value_store(const struct Memory_Profiler_Object_Table *table, struct Memory_Profiler_Object_Table_Slots *slots, size_t index, uint32_t klass, uint16_t epoch) {
+	if (table->wide_keys) {
+		struct Memory_Profiler_Object_Table_Wide_Slot *entry = &((struct Memory_Profiler_Object_Table_Wide_Slot *)slots->entries)[index];
+		entry->klass = klass;
+		entry->epoch = epoch;
+	} else {
+		struct Memory_Profiler_Object_Table_Slot *entry = &((struct Memory_Profiler_Object_Table_Slot *)slots->entries)[index];
+		entry->klass[0] = (uint8_t)klass;
+		entry->klass[1] = (uint8_t)(klass >> 8);
+		entry->klass[2] = (uint8_t)(klass >> 16);
+		memcpy(entry->epoch, &epoch, sizeof(epoch));
+	}
+}
+
+static inline void entry_store(const struct Memory_Profiler_Object_Table *table, struct Memory_Profiler_Object_Table_Slots *slots, size_t index, uint64_t key, uint32_t klass, uint16_t epoch) {
+	if (table->wide_keys) {
+		((struct Memory_Profiler_Object_Table_Wide_Slot *)slots->entries)[index].key = key;
+	} else {
+		uint32_t compressed = (uint32_t)key;
+		memcpy(((struct Memory_Profiler_Object_Table_Slot *)slots->entries)[index].key, &compressed, sizeof(compressed));
+	}
+	
+	value_store(table, slots, index, klass, epoch);
+}
+
+// Choose the base of the compressed keys, so that the heap around the first object is in range
+static void choose_key_base(struct Memory_Profiler_Object_Table *table, VALUE object) {
+	uint64_t address = (uint64_t)object & ~(uint64_t)((1 << KEY_SHIFT) - 1);
+	uint64_t below = KEY_RANGE / 2;
+	
+	table->key_base = (VALUE)(address > below ? address - below : 0);
+	table->key_base_set = 1;
+}
+
+// Convert the entries of a set of slots to full addresses, into a newly allocated array
+static struct Memory_Profiler_Object_Table_Wide_Slot* entries_widen(const struct Memory_Profiler_Object_Table *table, const struct Memory_Profiler_Object_Table_Slots *slots) {
+	struct Memory_Profiler_Object_Table_Wide_Slot *entries = calloc(slots->capacity, sizeof(struct Memory_Profiler_Object_Table_Wide_Slot));
+	if (!entries) return NULL;
+	
+	for (size_t i = 0; i < slots->capacity; i++) {
+		if (control_full_p(slots->control[i])) {
+			entries[i].key = (uint64_t)key_decode(table, key_load(table, slots, i));
+			entries[i].klass = klass_load(table, slots, i);
+			entries[i].epoch = epoch_load(table, slots, i);
+		}
+	}
+	
+	return entries;
+}
+
+// Switch all keys (including the previous slots of a resize) to full addresses. Returns 0 if the entries could not be allocated.
+static int widen_keys(struct Memory_Profiler_Object_Table *table) {
+	struct Memory_Profiler_Object_Table_Wide_Slot *entries = entries_widen(table, &table->slots);
+	if (!entries) return 0;
+	
+	if (table->previous.control) {
+		struct Memory_Profiler_Object_Table_Wide_Slot *previous_entries = entries_widen(table, &table->previous);
+		
+		if (!previous_entries) {
+			free(entries);
+			return 0;
+		}
+		
+		free(table->previous.entries);
+		table->previous.entries = previous_entries;
+	}
+	
+	free(table->slots.entries);
+	table->slots.entries = entries;
+	table->wide_keys = 1;
+	
+	if (DEBUG) {
+		fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"info\",\"operation\":\"insert\",\"event\":\"wide_keys\",\"capacity\":%zu,\"count\":%zu}\n", 
+			table->slots.capacity, table->count);
+	}
+	
+	return 1;
+}
+
+#pragma mark - Slots
+
+// Allocate empty slots (and their filter) for the given capacity
+static int allocate_slots(const struct Memory_Profiler_Object_Table *table, struct Memory_Profiler_Object_Table_Slots *slots, size_t capacity) {
+	size_t bits = 4;
+	while (((size_t)1 << bits) < capacity) bits++;
+	
+	slots->capacity = capacity;
+	slots->control = malloc(capacity + GROUP_WIDTH);
+	slots->entries = malloc(capacity * entry_size(table));
+	slots->filter = calloc((size_t)1 << bits, sizeof(uint8_t));
+	slots->filter_shift = 64 - bits;
+	
+	if (!slots->control || !slots->entries || !slots->filter) {
+		free(slots->control);
+		free(slots->entries);
+		free(slots->filter);
+		memset(slots, 0, sizeof(*slots));
+		return 0;
+	}
+	
+	memset(slots->control, CONTROL_EMPTY, capacity + GROUP_WIDTH);
+	
+	return 1;
+}
+
+static void free_slots(struct Memory_Profiler_Object_Table_Slots *slots) {
+	free(slots->control);
+	free(slots->entries);
+	free(slots->filter);
+	memset(slots, 0, sizeof(*slots));
+}
 
-VALUE TOMBSTONE = Qnil;
+static size_t slots_memsize(const struct Memory_Profiler_Object_Table *table, const struct Memory_Profiler_Object_Table_Slots *slots) {
+	if (!slots->control) return 0;
+	
+	return slots->capacity * (1 + entry_size(table)) + GROUP_WIDTH + filter_size(slots);
+}
+
+// Set the control byte of a slot, keeping the copy of the first group in sync
+static inline void set_control(struct Memory_Profiler_Object_Table_Slots *slots, size_t index, uint8_t value) {
+	slots->control[index] = value;
+	
+	if (index < GROUP_WIDTH) {
+		slots->control[slots->capacity + index] = value;
+	}
+}
 
 // Create a new table
 struct Memory_Profiler_Object_Table* Memory_Profiler_Object_Table_new(size_t initial_capacity) {
-	struct Memory_Profiler_Object_Table *table = malloc(sizeof(struct Memory_Profiler_Object_Table));
+	struct Memory_Profiler_Object_Table *table = calloc(1, sizeof(struct Memory_Profiler_Object_Table));
 	
 	if (!table) {
 		return NULL;
 	}
 	
-	table->capacity = initial_capacity > 0 ? initial_capacity : INITIAL_CAPACITY;
-	table->count = 0;
-	table->tombstones = 0;
+	// Round up to a power of two (at least one group), so that hashes can be reduced with a mask:
+	size_t capacity = GROUP_WIDTH;
+	while (capacity < (initial_capacity > 0 ? initial_capacity : INITIAL_CAPACITY)) capacity *= 2;
 	
-	// Use calloc to zero out entries (0 = empty slot)
-	table->entries = calloc(table->capacity, sizeof(struct Memory_Profiler_Object_Table_Entry));
+	table->minimum_capacity = capacity;
 	
-	if (!table->entries) {
+	if (!allocate_slots(table, &table->slots, capacity)) {
 		free(table);
 		return NULL;
 	}
@@ -49,357 +331,698 @@ struct Memory_Profiler_Object_Table* Memory_Profiler_Object_Table_new(size_t ini
 	return table;
 }
 
+// Free the previous slots once a resize has finished
+static void free_previous(struct Memory_Profiler_Object_Table *table) {
+	free_slots(&table->previous);
+	
+	table->previous_count = 0;
+	table->migrate_index = 0;
+}
+
 // Free the table
 void Memory_Profiler_Object_Table_free(struct Memory_Profiler_Object_Table *table) {
 	if (table) {
-		free(table->entries);
+		free_previous(table);
+		free_slots(&table->slots);
+		free(table->data);
+		free(table->data_slots);
 		free(table);
 	}
 }
 
-// Hash function for object addresses
-// Uses multiplicative hashing with bit mixing to reduce clustering
-static inline size_t hash_object(VALUE object, size_t capacity) {
-	size_t hash = (size_t)object;
+#pragma mark - Data
+
+static inline size_t data_position(VALUE object, size_t capacity) {
+	return (size_t)hash_object(object) & (capacity - 1);
+}
+
+// Find the index slot of an object's data, returns SIZE_MAX if it has no data
+static size_t data_find_slot(const struct Memory_Profiler_Object_Table *table, VALUE object) {
+	if (table->data_count == 0) return SIZE_MAX;
+	
+	size_t mask = table->data_slots_capacity - 1;
+	
+	for (size_t index = data_position(object, table->data_slots_capacity); table->data_slots[index]; index = (index + 1) & mask) {
+		if (table->data[table->data_slots[index] - 1].object == object) return index;
+	}
+	
+	return SIZE_MAX;
+}
+
+// Find the index slot of a position in the data vector (exact, even if a dead object's data shares the address of a moved object)
+static size_t data_find_position(const struct Memory_Profiler_Object_Table *table, size_t position) {
+	size_t mask = table->data_slots_capacity - 1;
+	size_t index = data_position(table->data[position].object, table->data_slots_capacity);
 	
-	// Remove alignment bits (objects are typically 8-byte aligned)
-	hash >>= 3;
+	while (table->data_slots[index] != position + 1) {
+		index = (index + 1) & mask;
+	}
+	
+	return index;
+}
+
+// Add a position of the data vector to the index
+static void data_index_insert(struct Memory_Profiler_Object_Table *table, size_t position) {
+	size_t mask = table->data_slots_capacity - 1;
+	size_t index = data_position(table->data[position].object, table->data_slots_capacity);
+	
+	while (table->data_slots[index]) {
+		index = (index + 1) & mask;
+	}
+	
+	table->data_slots[index] = (uint32_t)(position + 1);
+}
+
+// Rebuild the index from the data vector (e.g. after objects moved), without allocating
+static void data_reindex(struct Memory_Profiler_Object_Table *table) {
+	memset(table->data_slots, 0, table->data_slots_capacity * sizeof(uint32_t));
+	
+	for (size_t i = 0; i < table->data_count; i++) {
+		data_index_insert(table, i);
+	}
+}
+
+// Resize the data vector, and its index (which is kept at most half full)
+static int data_resize(struct Memory_Profiler_Object_Table *table, size_t capacity) {
+	uint32_t *slots = malloc(capacity * 2 * sizeof(uint32_t));
+	if (!slots) return 0;
+	
+	struct Memory_Profiler_Object_Table_Data *data = realloc(table->data, capacity * sizeof(struct Memory_Profiler_Object_Table_Data));
+	
+	if (!data) {
+		free(slots);
+		return 0;
+	}
+	
+	free(table->data_slots);
+	table->data = data;
+	table->data_capacity = capacity;
+	table->data_slots = slots;
+	table->data_slots_capacity = capacity * 2;
+	
+	data_reindex(table);
+	
+	return 1;
+}
+
+// Get the data of an object, or NULL if it has none
+static inline struct Memory_Profiler_Object_Table_Data* data_find(const struct Memory_Profiler_Object_Table *table, VALUE object) {
+	size_t index = data_find_slot(table, object);
+	
+	return index == SIZE_MAX ? NULL : &table->data[table->data_slots[index] - 1];
+}
+
+// Get the data of an object, appending it to the data vector (without callback data, and with a weight of 1) if it has none yet. Returns NULL if it could not be allocated.
+static struct Memory_Profiler_Object_Table_Data* data_fetch(struct Memory_Profiler_Object_Table *table, VALUE object) {
+	struct Memory_Profiler_Object_Table_Data *data = data_find(table, object);
+	if (data) return data;
 	
-	// Multiplicative hashing (Knuth's golden ratio method)
-	// This helps distribute consecutive addresses across the table
-	hash *= 2654435761UL;  // 2^32 / phi (golden ratio)
+	if (table->data_count == table->data_capacity) {
+		size_t capacity = table->data_capacity ? table->data_capacity * 2 : DATA_INITIAL_CAPACITY;
+		if (!data_resize(table, capacity)) return NULL;
+	}
 	
-	// Mix high bits into low bits for better distribution
-	hash ^= (hash >> 16);
-	hash *= 0x85ebca6b;
-	hash ^= (hash >> 13);
-	hash *= 0xc2b2ae35;
-	hash ^= (hash >> 16);
+	size_t position = table->data_count++;
+	table->data[position].object = object;
+	table->data[position].data = Qnil;
+	table->data[position].weight = 1;
+	data_index_insert(table, position);
 	
-	return hash % capacity;
+	return &table->data[position];
 }
 
-// Find entry index for an object (linear probing)
-// Returns index if found, or index of empty slot if not found
-// If table is provided (not NULL), logs statistics when probe length is excessive
-static size_t find_entry(struct Memory_Profiler_Object_Table_Entry *entries, size_t capacity, VALUE object, int *found, struct Memory_Profiler_Object_Table *table, const char *operation) {
-	size_t index = hash_object(object, capacity);
-	size_t start = index;
-	size_t probe_count = 0;
+// Remove the data of an object, moving the last data into its place so that the vector stays dense
+static void data_delete(struct Memory_Profiler_Object_Table *table, VALUE object) {
+	size_t hole = data_find_slot(table, object);
+	if (hole == SIZE_MAX) return;
 	
-	*found = 0;
+	size_t position = table->data_slots[hole] - 1;
+	size_t mask = table->data_slots_capacity - 1;
 	
-	do {
-		probe_count++;
+	// Shift the rest of the index cluster back, so that no tombstones are needed:
+	for (size_t index = (hole + 1) & mask; table->data_slots[index]; index = (index + 1) & mask) {
+		size_t home = data_position(table->data[table->data_slots[index] - 1].object, table->data_slots_capacity);
 		
-		// Safety check - prevent infinite loops
-		if (probe_count > MAX_PROBE_LENGTH) {
-			if (DEBUG && table) {
-				double load = (double)table->count / capacity;
-				double tomb_ratio = (double)table->tombstones / capacity;
-				fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"critical\",\"operation\":\"%s\",\"event\":\"max_probes_exceeded\",\"probe_count\":%zu,\"capacity\":%zu,\"count\":%zu,\"tombstones\":%zu,\"load_factor\":%.3f,\"tombstone_ratio\":%.3f}\n", 
-					operation, probe_count, capacity, table->count, table->tombstones, load, tomb_ratio);
-			} else if (DEBUG) {
-				fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"critical\",\"operation\":\"%s\",\"event\":\"max_probes_exceeded\",\"probe_count\":%zu,\"capacity\":%zu}\n", 
-					operation, probe_count, capacity);
-			}
-			return index;
+		// The slot can fill the hole if the hole is between its home and where it is now:
+		if (((index - home) & mask) >= ((index - hole) & mask)) {
+			table->data_slots[hole] = table->data_slots[index];
+			hole = index;
 		}
+	}
+	
+	table->data_slots[hole] = 0;
+	
+	size_t last = table->data_count - 1;
+	
+	if (position != last) {
+		table->data_slots[data_find_position(table, last)] = (uint32_t)(position + 1);
+		table->data[position] = table->data[last];
+	}
+	
+	table->data[last].object = 0;
+	table->data[last].data = 0;
+	table->data[last].weight = 0;
+	table->data_count--;
+	
+	// Shrink when the vector is less than a quarter full:
+	size_t capacity = table->data_capacity;
+	while (capacity > DATA_INITIAL_CAPACITY && table->data_count * 4 < capacity) capacity /= 2;
+	
+	if (capacity != table->data_capacity) {
+		data_resize(table, capacity);
+	}
+}
+
+// Copy the callback data and weight of an entry's object into the entry
+static inline void data_load(const struct Memory_Profiler_Object_Table *table, struct Memory_Profiler_Object_Table_Entry *entry) {
+	const struct Memory_Profiler_Object_Table_Data *data = data_find(table, entry->object);
+	
+	entry->data = data ? data->data : Qnil;
+	entry->weight = data ? data->weight : 1;
+}
+
+#pragma mark - Probing
+
+static void log_long_probe(struct Memory_Profiler_Object_Table *table, const char *operation, size_t probe_count) {
+	double load = (double)table->count / table->slots.capacity;
+	double tomb_ratio = (double)table->tombstones / table->slots.capacity;
+	fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"warning\",\"operation\":\"%s\",\"event\":\"long_probe_chain\",\"probe_count\":%zu,\"capacity\":%zu,\"count\":%zu,\"tombstones\":%zu,\"load_factor\":%.3f,\"tombstone_ratio\":%.3f}\n", 
+		operation, probe_count, table->slots.capacity, table->count, table->tombstones, load, tomb_ratio);
+}
+
+// Find the slot of an encoded key in the given slots (triangular probing over groups, which visits every group once)
+// Returns the index if found, or SIZE_MAX if not found
+static size_t find_entry(struct Memory_Profiler_Object_Table *table, const struct Memory_Profiler_Object_Table_Slots *slots, uint64_t hash, uint64_t key, const char *operation) {
+	uint8_t value = hash_control(hash);
+	size_t capacity = slots->capacity;
+	size_t mask = capacity - 1;
+	size_t position = hash_position(hash, capacity);
+	
+	for (size_t probe_count = 1; probe_count * GROUP_WIDTH <= capacity; probe_count++) {
+		const uint8_t *group = slots->control + position;
 		
-		// Log warning for excessive probing
-		if (DEBUG && probe_count == WARN_PROBE_LENGTH && table) {
-			double load = (double)table->count / capacity;
-			double tomb_ratio = (double)table->tombstones / capacity;
-			fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"warning\",\"operation\":\"%s\",\"event\":\"long_probe_chain\",\"probe_count\":%zu,\"capacity\":%zu,\"count\":%zu,\"tombstones\":%zu,\"load_factor\":%.3f,\"tombstone_ratio\":%.3f}\n", 
-				operation, probe_count, capacity, table->count, table->tombstones, load, tomb_ratio);
+		for (uint32_t matches = group_match(group, value); matches; matches &= matches - 1) {
+			size_t index = (position + __builtin_ctz(matches)) & mask;
+			
+			if (key_load(table, slots, index) == key) {
+				return index;
+			}
 		}
 		
-		if (entries[index].object == 0) {
-			return index;
+		// An empty slot ends the probe sequence - the object would have been inserted there:
+		if (group_match(group, CONTROL_EMPTY)) {
+			return SIZE_MAX;
 		}
 		
-		if (entries[index].object != TOMBSTONE && entries[index].object == object) {
-			*found = 1;
-			return index;
+		if (DEBUG && probe_count == WARN_PROBE_LENGTH) {
+			log_long_probe(table, operation, probe_count);
 		}
 		
-		index = (index + 1) % capacity;
-	} while (index != start);
-	
-	// Table is full
-	if (DEBUG && table) {
-		double load = (double)table->count / capacity;
-		double tomb_ratio = (double)table->tombstones / capacity;
-		fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"error\",\"operation\":\"%s\",\"event\":\"table_full\",\"probe_count\":%zu,\"capacity\":%zu,\"count\":%zu,\"tombstones\":%zu,\"load_factor\":%.3f,\"tombstone_ratio\":%.3f}\n", 
-			operation, probe_count, capacity, table->count, table->tombstones, load, tomb_ratio);
+		position = (position + probe_count * GROUP_WIDTH) & mask;
 	}
-	return index;
+	
+	return SIZE_MAX;
 }
 
-// Find slot for inserting an object (linear probing)
-// Returns index to insert at - reuses tombstone slots if found
-// If object exists, returns its index with found=1
-static size_t find_insert_slot(struct Memory_Profiler_Object_Table *table, VALUE object, int *found) {
-	struct Memory_Profiler_Object_Table_Entry *entries = table->entries;
-	size_t capacity = table->capacity;
-	size_t index = hash_object(object, capacity);
-	size_t start = index;
-	size_t first_tombstone = SIZE_MAX;  // Track first tombstone we encounter
-	size_t probe_count = 0;
-	
-	*found = 0;
+// Find the first empty or deleted slot in the probe sequence of a hash
+// Returns SIZE_MAX if the table is full
+static size_t find_available_slot(const struct Memory_Profiler_Object_Table_Slots *slots, uint64_t hash) {
+	size_t mask = slots->capacity - 1;
+	size_t position = hash_position(hash, slots->capacity);
 	
-	do {
-		probe_count++;
+	for (size_t probe_count = 1; probe_count * GROUP_WIDTH <= slots->capacity; probe_count++) {
+		uint32_t available = group_match_available(slots->control + position);
 		
-		// Safety check - prevent infinite loops
-		if (probe_count > MAX_PROBE_LENGTH) {
-			if (DEBUG) {
-				double load = (double)table->count / capacity;
-				double tomb_ratio = (double)table->tombstones / capacity;
-				fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"critical\",\"operation\":\"insert\",\"event\":\"max_probes_exceeded\",\"probe_count\":%zu,\"capacity\":%zu,\"count\":%zu,\"tombstones\":%zu,\"load_factor\":%.3f,\"tombstone_ratio\":%.3f}\n", 
-					probe_count, capacity, table->count, table->tombstones, load, tomb_ratio);
-			}
-			// Return tombstone if we found one, otherwise current position
-			return (first_tombstone != SIZE_MAX) ? first_tombstone : index;
+		if (available) {
+			return (position + __builtin_ctz(available)) & mask;
 		}
 		
-		// Log warning for excessive probing
-		if (DEBUG && probe_count == WARN_PROBE_LENGTH) {
-			double load = (double)table->count / capacity;
-			double tomb_ratio = (double)table->tombstones / capacity;
-			fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"warning\",\"operation\":\"insert\",\"event\":\"long_probe_chain\",\"probe_count\":%zu,\"capacity\":%zu,\"count\":%zu,\"tombstones\":%zu,\"load_factor\":%.3f,\"tombstone_ratio\":%.3f}\n", 
-				probe_count, capacity, table->count, table->tombstones, load, tomb_ratio);
-		}
+		position = (position + probe_count * GROUP_WIDTH) & mask;
+	}
+	
+	return SIZE_MAX;
+}
+
+// Find an object in the current slots, or in the previous slots during a resize
+// Returns the slots it was found in (and its index), or NULL if not found
+static inline struct Memory_Profiler_Object_Table_Slots* find(struct Memory_Profiler_Object_Table *table, VALUE object, size_t *index, const char *operation) {
+	uint64_t key;
+	
+	// Objects out of range of the compressed keys can't be in the table:
+	if (!key_encode(table, object, &key)) return NULL;
+	
+	uint64_t hash = hash_object(object);
+	
+	*index = find_entry(table, &table->slots, hash, key, operation);
+	
+	if (*index != SIZE_MAX) {
+		return &table->slots;
+	}
+	
+	if (table->previous.control) {
+		*index = find_entry(table, &table->previous, hash, key, operation);
 		
-		if (entries[index].object == 0) {
-			// Empty slot - use tombstone if we found one, otherwise this slot
-			return (first_tombstone != SIZE_MAX) ? first_tombstone : index;
+		if (*index != SIZE_MAX) {
+			return &table->previous;
 		}
-		
-		if (entries[index].object == TOMBSTONE) {
-			// Remember first tombstone (but keep searching for existing object)
-			if (first_tombstone == SIZE_MAX) {
-				first_tombstone = index;
-			}
-		} else if (entries[index].object == object) {
-			// Found existing entry
-			*found = 1;
-			return index;
+	}
+	
+	return NULL;
+}
+
+// Insert an entry known not to be in the current slots (when migrating or rebuilding)
+static void insert_rehashed(struct Memory_Profiler_Object_Table *table, uint64_t key, VALUE object, uint32_t klass, uint16_t epoch) {
+	uint64_t hash = hash_object(object);
+	size_t index = find_available_slot(&table->slots, hash);
+	
+	if (table->slots.control[index] == CONTROL_DELETED) {
+		table->tombstones--;
+	}
+	
+	set_control(&table->slots, index, hash_control(hash));
+	entry_store(table, &table->slots, index, key, klass, epoch);
+	filter_increment(&table->slots, object);
+}
+
+#pragma mark - Resizing
+
+// Migrate up to `limit` previous slots into the current ones, freeing the previous slots when they are all migrated
+static void migrate_slots(struct Memory_Profiler_Object_Table *table, size_t limit) {
+	struct Memory_Profiler_Object_Table_Slots *previous = &table->previous;
+	
+	size_t end = previous->capacity;
+	if (limit < end - table->migrate_index) end = table->migrate_index + limit;
+	
+	for (size_t i = table->migrate_index; i < end; i++) {
+		if (control_full_p(previous->control[i])) {
+			uint64_t key = key_load(table, previous, i);
+			insert_rehashed(table, key, key_decode(table, key), klass_load(table, previous, i), epoch_load(table, previous, i));
+			
+			// The entry must no longer be found in the previous slots (it may be deleted from the current ones), but probe sequences through it must continue:
+			set_control(previous, i, CONTROL_DELETED);
+			table->previous_count--;
 		}
-		
-		index = (index + 1) % capacity;
-	} while (index != start);
+	}
 	
-	// Table is full
-	if (DEBUG) {
-		double load = (double)table->count / capacity;
-		double tomb_ratio = (double)table->tombstones / capacity;
-		fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"error\",\"operation\":\"insert\",\"event\":\"table_full\",\"probe_count\":%zu,\"capacity\":%zu,\"count\":%zu,\"tombstones\":%zu,\"load_factor\":%.3f,\"tombstone_ratio\":%.3f}\n", 
-			probe_count, capacity, table->count, table->tombstones, load, tomb_ratio);
-	}
-	// Use tombstone slot if we found one
-	return (first_tombstone != SIZE_MAX) ? first_tombstone : index;
-}
-
-// Resize the table (only called from insert, not during GC)
-// This clears all tombstones
-static void resize_table(struct Memory_Profiler_Object_Table *table) {
-	size_t old_capacity = table->capacity;
-	struct Memory_Profiler_Object_Table_Entry *old_entries = table->entries;
-	
-	// Double capacity
-	table->capacity = old_capacity * 2;
-	table->count = 0;
-	table->tombstones = 0;  // Reset tombstones
-	table->entries = calloc(table->capacity, sizeof(struct Memory_Profiler_Object_Table_Entry));
-	
-	if (!table->entries) {
-		// Resize failed - restore old state
-		table->capacity = old_capacity;
-		table->entries = old_entries;
+	table->migrate_index = end;
+	
+	if (end == previous->capacity) {
+		free_previous(table);
+	}
+}
+
+// Migrate, if a resize is in progress (checked inline, since every insert and lookup calls this)
+static inline void migrate(struct Memory_Profiler_Object_Table *table, size_t limit) {
+	if (table->previous.control) {
+		migrate_slots(table, limit);
+	}
+}
+
+// Start resizing the table to the given capacity (called from insert or delete, which may run in the event hooks during GC, so only system malloc is used, and at the end of compaction, which settles it immediately)
+// This clears all tombstones once the migration finishes
+static void resize_table(struct Memory_Profiler_Object_Table *table, size_t capacity) {
+	// Only one resize at a time:
+	if (table->previous.control) {
+		migrate(table, SIZE_MAX);
+	}
+	
+	struct Memory_Profiler_Object_Table_Slots slots;
+	
+	if (!allocate_slots(table, &slots, capacity)) {
+		// Resize failed - keep the old state
 		return;
 	}
 	
-	// Rehash all non-tombstone entries
-	for (size_t i = 0; i < old_capacity; i++) {
-		// Skip empty slots and tombstones
-		if (old_entries[i].object != 0 && old_entries[i].object != TOMBSTONE) {
-			int found;
-			size_t new_index = find_entry(table->entries, table->capacity, old_entries[i].object, &found, NULL, "resize");
-			table->entries[new_index] = old_entries[i];
-			table->count++;
+	if (capacity > table->slots.capacity) table->grow_count++;
+	else if (capacity < table->slots.capacity) table->shrink_count++;
+	else table->purge_count++;
+	
+	// Entries are migrated from the current slots to the new ones by subsequent operations:
+	table->previous = table->slots;
+	table->previous_count = table->count;
+	table->migrate_index = 0;
+	
+	table->slots = slots;
+	table->tombstones = 0;
+}
+
+#pragma mark - Operations
+
+// Insert object with its class index and allocation epoch
+int Memory_Profiler_Object_Table_insert(struct Memory_Profiler_Object_Table *table, VALUE object, uint32_t klass, uint16_t epoch) {
+	// The class index wouldn't fit in a compressed entry:
+	if (klass >= MEMORY_PROFILER_OBJECT_TABLE_KLASS_LIMIT) return 0;
+	
+	migrate(table, MIGRATION_STEP);
+	
+	if (!table->key_base_set) {
+		choose_key_base(table, object);
+	}
+	
+	uint64_t key;
+	
+	if (!key_encode(table, object, &key)) {
+		// The heap spans more than the compressed keys can address:
+		if (!widen_keys(table)) return 0;
+		
+		key = (uint64_t)object;
+	}
+	
+	size_t index;
+	struct Memory_Profiler_Object_Table_Slots *slots = find(table, object, &index, "insert");
+	
+	if (slots) {
+		// Updating existing entry (its previous data belongs to a dead object at the same address)
+		value_store(table, slots, index, klass, epoch);
+		data_delete(table, object);
+		return 1;
+	}
+	
+	// Resize if load factor exceeded (count + tombstones, of the current slots)
+	// This clears tombstones and gives us fresh space - the capacity is only doubled if live entries need the space
+	if ((table->count - table->previous_count + table->tombstones + 1) * LOAD_FACTOR_DENOMINATOR > table->slots.capacity * LOAD_FACTOR_NUMERATOR) {
+		if (table->count * 2 * LOAD_FACTOR_DENOMINATOR >= table->slots.capacity * LOAD_FACTOR_NUMERATOR) {
+			resize_table(table, table->slots.capacity * 2);
+		} else {
+			resize_table(table, table->slots.capacity);
 		}
 	}
 	
-	free(old_entries);
+	uint64_t hash = hash_object(object);
+	index = find_available_slot(&table->slots, hash);
+	
+	if (index == SIZE_MAX) {
+		// Table is full (and could not grow)
+		if (DEBUG) {
+			fprintf(stderr, "{\"subject\":\"Memory::Profiler::ObjectTable\",\"level\":\"error\",\"operation\":\"insert\",\"event\":\"table_full\",\"capacity\":%zu,\"count\":%zu,\"tombstones\":%zu}\n", 
+				table->slots.capacity, table->count, table->tombstones);
+		}
+		return 0;
+	}
+	
+	// New entry - check if we're reusing a tombstone slot
+	if (table->slots.control[index] == CONTROL_DELETED) {
+		table->tombstones--;
+	}
+	
+	set_control(&table->slots, index, hash_control(hash));
+	entry_store(table, &table->slots, index, key, klass, epoch);
+	table->count++;
+	filter_increment(&table->slots, object);
+	
+	return 1;
 }
 
-// Insert object, returns pointer to entry for caller to fill
-struct Memory_Profiler_Object_Table_Entry* Memory_Profiler_Object_Table_insert(struct Memory_Profiler_Object_Table *table, VALUE object) {
-	// Resize if load factor exceeded (count + tombstones)
-	// This clears tombstones and gives us fresh space
-	if ((double)(table->count + table->tombstones) / table->capacity > LOAD_FACTOR) {
-		resize_table(table);
-	}
+// Lookup entry for object
+int Memory_Profiler_Object_Table_lookup(struct Memory_Profiler_Object_Table *table, VALUE object, struct Memory_Profiler_Object_Table_Entry *entry) {
+	migrate(table, MIGRATION_STEP);
+	
+	size_t index;
+	struct Memory_Profiler_Object_Table_Slots *slots = find(table, object, &index, "lookup");
 	
-	int found;
-	size_t index = find_insert_slot(table, object, &found);
+	if (!slots) return 0;
 	
-	if (!found) {
-		// New entry - check if we're reusing a tombstone slot
-		if (table->entries[index].object == TOMBSTONE) {
-			table->tombstones--;  // Reusing tombstone
+	entry->object = object;
+	entry->klass = klass_load(table, slots, index);
+	entry->epoch = epoch_load(table, slots, index);
+	data_load(table, entry);
+	entry->index = index;
+	entry->previous = (slots == &table->previous);
+	
+	return 1;
+}
+
+// Set the callback data of an object
+int Memory_Profiler_Object_Table_set_data(struct Memory_Profiler_Object_Table *table, VALUE object, VALUE data) {
+	if (NIL_P(data)) {
+		struct Memory_Profiler_Object_Table_Data *record = data_find(table, object);
+		
+		if (record && record->weight != 1) {
+			record->data = Qnil;
+		} else if (record) {
+			data_delete(table, object);
 		}
-		table->count++;
-		// Zero out the entry
-		table->entries[index].object = object;
-		table->entries[index].klass = 0;
-		table->entries[index].data = 0;
-	} else {
-		// Updating existing entry
-		table->entries[index].object = object;
+		
+		return 1;
 	}
 	
-	// Return pointer for caller to fill fields
-	return &table->entries[index];
+	struct Memory_Profiler_Object_Table_Data *record = data_fetch(table, object);
+	if (!record) return 0;
+	
+	record->data = data;
+	
+	return 1;
 }
 
-// Lookup entry for object - returns pointer or NULL
-struct Memory_Profiler_Object_Table_Entry* Memory_Profiler_Object_Table_lookup(struct Memory_Profiler_Object_Table *table, VALUE object) {
-	int found;
-	size_t index = find_entry(table->entries, table->capacity, object, &found, table, "lookup");
+// Set the weight of an object
+int Memory_Profiler_Object_Table_set_weight(struct Memory_Profiler_Object_Table *table, VALUE object, uint32_t weight) {
+	if (weight == 1) {
+		struct Memory_Profiler_Object_Table_Data *record = data_find(table, object);
+		
+		if (record && !NIL_P(record->data)) {
+			record->weight = 1;
+		} else if (record) {
+			data_delete(table, object);
+		}
+		
+		return 1;
+	}
+	
+	struct Memory_Profiler_Object_Table_Data *record = data_fetch(table, object);
+	if (!record) return 0;
 	
-	if (found) {
-		return &table->entries[index];
+	record->weight = weight;
+	
+	return 1;
+}
+
+// Check the membership filter for an object
+int Memory_Profiler_Object_Table_may_contain_p(struct Memory_Profiler_Object_Table *table, VALUE object) {
+	if (table->slots.filter[filter_index(table->slots.filter_shift, object)] != 0) {
+		return 1;
 	}
 	
-	return NULL;
+	// Entries not migrated yet are only counted by the previous filter:
+	return table->previous.control && table->previous.filter[filter_index(table->previous.filter_shift, object)] != 0;
 }
 
-// Delete object from table
-void Memory_Profiler_Object_Table_delete(struct Memory_Profiler_Object_Table *table, VALUE object) {
-	int found;
-	size_t index = find_entry(table->entries, table->capacity, object, &found, table, "delete");
+// Subtract shift from the epoch of every entry, in both the current and the previous slots, clamping at 0
+void Memory_Profiler_Object_Table_shift_epochs(struct Memory_Profiler_Object_Table *table, size_t shift) {
+	struct Memory_Profiler_Object_Table_Slots *slots[2] = {&table->slots, &table->previous};
 	
-	if (!found) {
-		return;
+	for (int set = 0; set < 2; set++) {
+		if (!slots[set]->control) continue;
+		
+		for (size_t i = 0; i < slots[set]->capacity; i++) {
+			if (!control_full_p(slots[set]->control[i])) continue;
+			
+			uint16_t epoch = epoch_load(table, slots[set], i);
+			value_store(table, slots[set], i, klass_load(table, slots[set], i), epoch > shift ? (uint16_t)(epoch - shift) : 0);
+		}
 	}
+}
+
+// Call the callback for every entry
+void Memory_Profiler_Object_Table_each(struct Memory_Profiler_Object_Table *table, void (*callback)(const struct Memory_Profiler_Object_Table_Entry *entry, void *arg), void *arg) {
+	Memory_Profiler_Object_Table_settle(table);
 	
-	// Mark as tombstone - no rehashing needed!
-	table->entries[index].object = TOMBSTONE;
-	table->entries[index].klass = 0;
-	table->entries[index].data = 0;
-	table->count--;
-	table->tombstones++;
+	// The callback may resize the table, so the slots are reloaded for every entry:
+	for (size_t i = 0; i < table->slots.capacity; i++) {
+		// Skip empty slots and tombstones
+		if (!control_full_p(table->slots.control[i])) continue;
+		
+		struct Memory_Profiler_Object_Table_Entry entry = {
+			.object = key_decode(table, key_load(table, &table->slots, i)),
+			.klass = klass_load(table, &table->slots, i),
+			.epoch = epoch_load(table, &table->slots, i),
+			.index = i,
+			.previous = 0,
+		};
+		
+		data_load(table, &entry);
+		
+		callback(&entry, arg);
+	}
 }
 
-// Mark all entries for GC
+// Mark the callback data for GC
 void Memory_Profiler_Object_Table_mark(struct Memory_Profiler_Object_Table *table) {
 	if (!table) return;
 	
-	for (size_t i = 0; i < table->capacity; i++) {
-		struct Memory_Profiler_Object_Table_Entry *entry = &table->entries[i];
-		// Skip empty slots and tombstones
-		if (entry->object != 0 && entry->object != TOMBSTONE) {
-			// Don't mark object keys - table is weak (object keys can be GC'd, that's how we detect frees)
-			// Always mark the other fields (klass, data) - we own these
-			if (entry->klass) rb_gc_mark_movable(entry->klass);
-			if (entry->data) rb_gc_mark_movable(entry->data);
-		}
+	// Don't mark object keys - table is weak (object keys can be GC'd, that's how we detect frees)
+	// Classes are indices, so only the data needs marking, and it's dense - counts-only entries cost nothing here:
+	for (size_t i = 0; i < table->data_count; i++) {
+		rb_gc_mark_movable(table->data[i].data);
+	}
+}
+
+// Finish any incremental resize
+void Memory_Profiler_Object_Table_settle(struct Memory_Profiler_Object_Table *table) {
+	migrate(table, SIZE_MAX);
+}
+
+// Empty or tombstone a slot of the current slots, whose entry has been removed
+static void clear_slot(struct Memory_Profiler_Object_Table *table, size_t index) {
+	struct Memory_Profiler_Object_Table_Slots *slots = &table->slots;
+	
+	// If every group containing this slot also has an empty slot, no probe sequence can have continued past it, so it can be emptied rather than becoming a tombstone:
+	uint32_t empty_after = group_match(slots->control + index, CONTROL_EMPTY);
+	uint32_t empty_before = group_match(slots->control + ((index - GROUP_WIDTH) & (slots->capacity - 1)), CONTROL_EMPTY);
+	
+	if (empty_after && empty_before && (size_t)__builtin_ctz(empty_after) + (size_t)(__builtin_clz(empty_before) - (32 - GROUP_WIDTH)) < GROUP_WIDTH) {
+		set_control(slots, index, CONTROL_EMPTY);
+	} else {
+		set_control(slots, index, CONTROL_DELETED);
+		table->tombstones++;
 	}
 }
 
 // Update object pointers during compaction
+// Only entries whose object moved are rehashed, in place - entries are never copied out
 void Memory_Profiler_Object_Table_compact(struct Memory_Profiler_Object_Table *table) {
-	if (!table || table->count == 0) return;
+	if (!table) return;
+	
+	// Compaction visits every entry anyway, so finish any resize first (this doesn't allocate):
+	Memory_Profiler_Object_Table_settle(table);
 	
-	// First pass: check if any objects moved
-	int any_moved = 0;
-	for (size_t i = 0; i < table->capacity; i++) {
+	for (size_t i = 0; i < table->slots.capacity; i++) {
 		// Skip empty slots and tombstones
-		if (table->entries[i].object != 0 && table->entries[i].object != TOMBSTONE) {
-			VALUE new_loc = rb_gc_location(table->entries[i].object);
-			if (new_loc != table->entries[i].object) {
-				any_moved = 1;
-				break;
+		if (!control_full_p(table->slots.control[i])) continue;
+		
+		VALUE object = key_decode(table, key_load(table, &table->slots, i));
+		VALUE moved = rb_gc_location(object);
+		if (moved == object) continue;
+		
+		// The object moved, so its entry belongs in a different slot:
+		uint32_t klass = klass_load(table, &table->slots, i);
+		uint16_t epoch = epoch_load(table, &table->slots, i);
+		
+		filter_decrement(&table->slots, object);
+		clear_slot(table, i);
+		
+		uint64_t key;
+		
+		// Widening converts the keys in place (by index), so the iteration can continue:
+		if (!key_encode(table, moved, &key)) {
+			if (!widen_keys(table)) {
+				// The entry can't be stored, its free will not be counted:
+				table->count--;
+				continue;
 			}
+			
+			key = (uint64_t)moved;
 		}
+		
+		// If the entry lands in a later slot, it's visited again, but its object is already up to date:
+		insert_rehashed(table, key, moved, klass, epoch);
 	}
 	
-	// If nothing moved, just update VALUE fields and we're done
-	if (!any_moved) {
-		for (size_t i = 0; i < table->capacity; i++) {
-			// Skip empty slots and tombstones
-			if (table->entries[i].object != 0 && table->entries[i].object != TOMBSTONE) {
-				// Update VALUE fields if they moved
-				table->entries[i].klass = rb_gc_location(table->entries[i].klass);
-				table->entries[i].data = rb_gc_location(table->entries[i].data);
-			}
+	// Rehashing leaves tombstones behind, which only an insert would purge (a stopped capture never inserts again), and lookups of missing objects would probe the whole table, so rebuild it now:
+	if ((table->count + table->tombstones) * LOAD_FACTOR_DENOMINATOR > table->slots.capacity * LOAD_FACTOR_NUMERATOR) {
+		resize_table(table, table->slots.capacity);
+		Memory_Profiler_Object_Table_settle(table);
+	}
+	
+	// The data index is keyed by object too, so it's rebuilt in place:
+	if (table->data_count > 0) {
+		for (size_t i = 0; i < table->data_count; i++) {
+			table->data[i].object = rb_gc_location(table->data[i].object);
+			table->data[i].data = rb_gc_location(table->data[i].data);
 		}
-		return;
+		
+		data_reindex(table);
 	}
+}
+
+// Remove the entry in the given slot, which holds object
+static void delete_slot(struct Memory_Profiler_Object_Table *table, struct Memory_Profiler_Object_Table_Slots *slots, size_t index, VALUE object) {
+	filter_decrement(slots, object);
+	data_delete(table, object);
+	table->count--;
 	
-	// Something moved - need to rehash entire table
-	// Collect all entries into temporary array (use system malloc, not Ruby's)
-	struct Memory_Profiler_Object_Table_Entry *temp_entries = malloc(table->count * sizeof(struct Memory_Profiler_Object_Table_Entry));
-	if (!temp_entries) {
-		// Allocation failed - this is bad, but can't do much during GC
+	if (slots == &table->previous) {
+		// The previous slots are only probed until the resize finishes:
+		set_control(slots, index, CONTROL_DELETED);
+		table->previous_count--;
 		return;
 	}
 	
-	size_t temp_count = 0;
-	for (size_t i = 0; i < table->capacity; i++) {
-		// Skip empty slots and tombstones
-		if (table->entries[i].object != 0 && table->entries[i].object != TOMBSTONE) {
-			// Update all pointers first
-			temp_entries[temp_count].object = rb_gc_location(table->entries[i].object);
-			temp_entries[temp_count].klass = rb_gc_location(table->entries[i].klass);
-			temp_entries[temp_count].data = rb_gc_location(table->entries[i].data);
-			temp_count++;
-		}
+	clear_slot(table, index);
+	
+	// Shrink by half when occupancy drops, so that marking and iterating don't scan a mostly empty table (halving keeps the migration bounded, and repeats while occupancy stays low):
+	if (!table->previous.control && table->slots.capacity > table->minimum_capacity && table->count * SHRINK_FACTOR < table->slots.capacity) {
+		resize_table(table, table->slots.capacity / 2);
 	}
+}
+
+// Delete object from table
+void Memory_Profiler_Object_Table_delete(struct Memory_Profiler_Object_Table *table, VALUE object) {
+	size_t index;
+	struct Memory_Profiler_Object_Table_Slots *slots = find(table, object, &index, "delete");
 	
-	// Clear the table (zero out all entries, clears tombstones too)
-	memset(table->entries, 0, table->capacity * sizeof(struct Memory_Profiler_Object_Table_Entry));
-	table->count = 0;
-	table->tombstones = 0;  // Compaction clears tombstones
+	if (slots) {
+		delete_slot(table, slots, index, object);
+	}
+}
+
+// Delete an entry returned by lookup (avoids a second lookup, unless the entry has moved since)
+void Memory_Profiler_Object_Table_delete_entry(struct Memory_Profiler_Object_Table *table, const struct Memory_Profiler_Object_Table_Entry *entry) {
+	// Entries not migrated yet are in the previous slots:
+	struct Memory_Profiler_Object_Table_Slots *slots = entry->previous ? &table->previous : &table->slots;
+	uint64_t key;
 	
-	// Reinsert all entries with new hash values
-	for (size_t i = 0; i < temp_count; i++) {
-		int found;
-		size_t index = find_entry(table->entries, table->capacity, temp_entries[i].object, &found, NULL, "compact");
-		
-		// Insert at new location
-		table->entries[index] = temp_entries[i];
-		table->count++;
+	if (slots->control && entry->index < slots->capacity && control_full_p(slots->control[entry->index])) {
+		if (key_encode(table, entry->object, &key) && key_load(table, slots, entry->index) == key) {
+			delete_slot(table, slots, entry->index, entry->object);
+			return;
+		}
 	}
 	
-	// Free temporary array
-	free(temp_entries);
+	Memory_Profiler_Object_Table_delete(table, entry->object);
 }
 
-// Delete by entry pointer (faster - avoids second lookup)
-void Memory_Profiler_Object_Table_delete_entry(struct Memory_Profiler_Object_Table *table, struct Memory_Profiler_Object_Table_Entry *entry) {
-	// Calculate index from pointer
-	size_t index = entry - table->entries;
+// Delete every entry matching the predicate
+size_t Memory_Profiler_Object_Table_delete_if(struct Memory_Profiler_Object_Table *table, int (*predicate)(const struct Memory_Profiler_Object_Table_Entry *entry, void *arg), void *arg) {
+	Memory_Profiler_Object_Table_settle(table);
 	
-	// Validate it's within our table
-	if (index >= table->capacity) {
-		return;  // Invalid pointer
+	size_t deleted = 0;
+	
+	for (size_t i = 0; i < table->slots.capacity; i++) {
+		if (!control_full_p(table->slots.control[i])) continue;
+		
+		struct Memory_Profiler_Object_Table_Entry entry = {
+			.object = key_decode(table, key_load(table, &table->slots, i)),
+			.klass = klass_load(table, &table->slots, i),
+			.epoch = epoch_load(table, &table->slots, i),
+			.index = i,
+			.previous = 0,
+		};
+		
+		data_load(table, &entry);
+		
+		if (!predicate(&entry, arg)) continue;
+		
+		// Like delete_slot, but the table can't be resized while it's being scanned:
+		filter_decrement(&table->slots, entry.object);
+		data_delete(table, entry.object);
+		table->count--;
+		clear_slot(table, i);
+		
+		deleted++;
+	}
+	
+	// Shrink once, straight to the capacity that repeated halving would reach:
+	size_t capacity = table->slots.capacity;
+	
+	while (capacity > table->minimum_capacity && table->count * SHRINK_FACTOR < capacity) {
+		capacity /= 2;
 	}
 	
-	// Check if entry is actually occupied (not empty or tombstone)
-	if (entry->object == 0 || entry->object == TOMBSTONE) {
-		return;  // Already deleted or empty
+	if (capacity < table->slots.capacity) {
+		resize_table(table, capacity);
 	}
 	
-	// Mark as tombstone - no rehashing needed!
-	entry->object = TOMBSTONE;
-	entry->klass = 0;
-	entry->data = 0;
-	table->count--;
-	table->tombstones++;
+	return deleted;
 }
 
 // Get current size
@@ -407,3 +1030,43 @@ size_t Memory_Profiler_Object_Table_size(struct Memory_Profiler_Object_Table *ta
 	return table->count;
 }
 
+size_t Memory_Profiler_Object_Table_capacity(struct Memory_Profiler_Object_Table *table) {
+	return table->slots.capacity;
+}
+
+size_t Memory_Profiler_Object_Table_tombstones(struct Memory_Profiler_Object_Table *table) {
+	return table->tombstones;
+}
+
+// Get the memory used by the table
+size_t Memory_Profiler_Object_Table_memsize(struct Memory_Profiler_Object_Table *table) {
+	return sizeof(struct Memory_Profiler_Object_Table)
+		+ slots_memsize(table, &table->slots)
+		+ slots_memsize(table, &table->previous)
+		+ table->data_capacity * sizeof(struct Memory_Profiler_Object_Table_Data)
+		+ table->data_slots_capacity * sizeof(uint32_t);
+}
+
+// Get statistics about the table
+VALUE Memory_Profiler_Object_Table_statistics(struct Memory_Profiler_Object_Table *table) {
+	VALUE statistics = rb_hash_new();
+	
+	rb_hash_aset(statistics, ID2SYM(rb_intern("size")), SIZET2NUM(table->count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("capacity")), SIZET2NUM(table->slots.capacity));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("tombstones")), SIZET2NUM(table->tombstones));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("grow_count")), SIZET2NUM(table->grow_count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("shrink_count")), SIZET2NUM(table->shrink_count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("purge_count")), SIZET2NUM(table->purge_count));
+	
+	// Entries still waiting to be migrated by an incremental resize:
+	rb_hash_aset(statistics, ID2SYM(rb_intern("migrating_count")), SIZET2NUM(table->previous_count));
+	
+	rb_hash_aset(statistics, ID2SYM(rb_intern("memory_size")), SIZET2NUM(Memory_Profiler_Object_Table_memsize(table)));
+	
+	// Entries with callback data (or a weight), and whether keys had to be widened to full addresses:
+	rb_hash_aset(statistics, ID2SYM(rb_intern("data_size")), SIZET2NUM(table->data_count));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("data_capacity")), SIZET2NUM(table->data_capacity));
+	rb_hash_aset(statistics, ID2SYM(rb_intern("wide_keys")), table->wide_keys ? Qtrue : Qfalse);
+	
+	return statistics;
+}
@@ -5,26 +5,105 @@
 
 #include <ruby.h>
 #include <stddef.h>
+#include <stdint.h>
 
-// Entry in the object table
+// An entry of the object table, as returned by lookup (a copy - entries are not stored contiguously).
 struct Memory_Profiler_Object_Table_Entry {
 	// Object pointer (key):
 	VALUE object;
-	// The class of the allocated object:
-	VALUE klass;
-	// User-defined state from callback:
+	// The class of the allocated object, as an index chosen by the caller (e.g. into the capture's class registry), below MEMORY_PROFILER_OBJECT_TABLE_KLASS_LIMIT:
+	uint32_t klass;
+	// When the object was allocated, in units chosen by the caller (e.g. GCs since a base, see Memory_Profiler_Object_Table_shift_epochs):
+	uint16_t epoch;
+	// User-defined state from callback (Qnil if none):
 	VALUE data;
+	// How many objects the entry stands for, as a multiple chosen by the caller (1 unless set with Memory_Profiler_Object_Table_set_weight):
+	uint32_t weight;
+	
+	// Where the entry was found, so that it can be deleted without probing again:
+	size_t index;
+	int previous;
+};
+
+// Callback data and weight of an entry. Most entries have neither, so they are kept in a separate vector.
+struct Memory_Profiler_Object_Table_Data {
+	VALUE object;
+	VALUE data;
+	uint32_t weight;
+};
+
+// Class indices are stored in 24 bits:
+#define MEMORY_PROFILER_OBJECT_TABLE_KLASS_LIMIT ((uint32_t)1 << 24)
+
+// A slot's entry: the object address compressed to 32 bits (see key_base), the 24 bit class index and the 16 bit allocation epoch, packed into unaligned bytes. The callback data is stored separately, so a hit only touches the control bytes and one 9 byte entry.
+struct Memory_Profiler_Object_Table_Slot {
+	uint8_t key[4];
+	uint8_t klass[3];
+	uint8_t epoch[2];
+};
+
+// A slot's entry once keys have been widened to full addresses (see wide_keys). The class and epoch fit in what would otherwise be padding.
+struct Memory_Profiler_Object_Table_Wide_Slot {
+	uint64_t key;
+	uint32_t klass;
+	uint16_t epoch;
+};
+
+// A set of slots: control bytes, and the entries, which are either all compressed or all wide.
+struct Memory_Profiler_Object_Table_Slots {
+	size_t capacity;    // Total slots (a power of two)
+	
+	// Control bytes, one per slot, followed by a copy of the first group so that groups can be loaded at any slot without wrapping around:
+	uint8_t *control;
+	
+	// Array of Memory_Profiler_Object_Table_Slot, or Memory_Profiler_Object_Table_Wide_Slot if wide_keys is set:
+	void *entries;
+	
+	// Counting membership filter, indexed by an independent hash of the object address.
+	// A zero counter proves the object is not in the slots without probing. Saturated counters stick until the next rebuild.
+	size_t filter_shift;
+	uint8_t *filter;
 };
 
 // Custom object table for tracking allocations during GC.
-// Uses system malloc/free (not ruby_xmalloc) to be safe during GC compaction.
+// Uses system malloc/free only (never ruby_xmalloc or the Ruby heap), so it can be updated from the NEWOBJ and FREEOBJ event hooks, including during sweep. Inserts and deletes may resize it, so they must not be called from dcompact, while the keys are being updated.
 // Keys are object addresses (updated during compaction).
-// Table is always weak - object keys are not marked, allowing GC to collect them.
+// Table is always weak - object keys are not marked, allowing GC to collect them (the owner removes them when they are freed).
+//
+// Open addressing in the style of SwissTable: each slot has a control byte (empty, deleted, or 7 bits of the key's hash), and probing compares a group of 16 control bytes at a time, so the table can run at a high load factor.
+//
+// Resizing is incremental: the previous slots are kept alongside the new ones, and each insert or lookup migrates a bounded number of them, so no single operation rehashes the whole table.
 struct Memory_Profiler_Object_Table {
-	size_t capacity;    // Total slots
-	size_t count;       // Used slots (occupied entries)
-	size_t tombstones;  // Deleted slots (tombstone markers)
-	struct Memory_Profiler_Object_Table_Entry *entries;  // System malloc'd array
+	size_t count;       // Used slots (occupied entries, including those not yet migrated)
+	size_t tombstones;  // Deleted slots (tombstone markers) of the current slots
+	struct Memory_Profiler_Object_Table_Slots slots;
+	
+	// The slots being migrated from during a resize (no control bytes otherwise), how many entries they still hold, and the next slot to migrate:
+	struct Memory_Profiler_Object_Table_Slots previous;
+	size_t previous_count;
+	size_t migrate_index;
+	
+	// Keys are stored as 32-bit offsets from key_base in units of 8 bytes (the alignment of heap slots), covering 32GiB around the first object inserted. If an object falls outside of that range, all keys are widened to full addresses:
+	VALUE key_base;
+	int key_base_set;
+	int wide_keys;
+	
+	// Callback data and weights, only for entries that have any, in a dense vector so that marking visits nothing else:
+	struct Memory_Profiler_Object_Table_Data *data;
+	size_t data_count;
+	size_t data_capacity;
+	
+	// Open addressing map (linear probing) from object to its position in the data vector + 1 (0 = empty slot), capacity is a power of two:
+	uint32_t *data_slots;
+	size_t data_slots_capacity;
+	
+	// The table never shrinks below its initial capacity:
+	size_t minimum_capacity;
+	
+	// Rebuilds of the table: doubling, halving when occupancy drops, and purging tombstones at the same capacity:
+	size_t grow_count;
+	size_t shrink_count;
+	size_t purge_count;
 };
 
 // Create a new object table with initial capacity
@@ -33,23 +112,48 @@ struct Memory_Profiler_Object_Table* Memory_Profiler_Object_Table_new(size_t ini
 // Free the table and all its memory
 void Memory_Profiler_Object_Table_free(struct Memory_Profiler_Object_Table *table);
 
-// Insert an object, returns pointer to entry for caller to fill fields.
-// Safe to call from postponed job (not during GC).
-struct Memory_Profiler_Object_Table_Entry* Memory_Profiler_Object_Table_insert(struct Memory_Profiler_Object_Table *table, VALUE object);
+// Insert an object with its class index and allocation epoch, replacing them (and removing the data and weight) if the object is already in the table.
+// Returns 0 if the table is full and could not grow, or the class index is not below MEMORY_PROFILER_OBJECT_TABLE_KLASS_LIMIT.
+// May grow the table. Safe to call from the NEWOBJ and FREEOBJ hooks, not from dcompact.
+int Memory_Profiler_Object_Table_insert(struct Memory_Profiler_Object_Table *table, VALUE object, uint32_t klass, uint16_t epoch);
 
-// Lookup entry for an object. Returns pointer to entry or NULL if not found.
-// Safe to call during FREEOBJ event handler (no allocation) - READ ONLY!
-struct Memory_Profiler_Object_Table_Entry* Memory_Profiler_Object_Table_lookup(struct Memory_Profiler_Object_Table *table, VALUE object);
+// Lookup the entry for an object, copying it into entry. Returns 0 if not found.
+// May migrate entries of an incremental resize (invalidating previously returned entries), but never allocates.
+// Safe to call during FREEOBJ event handler.
+int Memory_Profiler_Object_Table_lookup(struct Memory_Profiler_Object_Table *table, VALUE object, struct Memory_Profiler_Object_Table_Entry *entry);
 
-// Delete an object. Safe to call from postponed job (not during GC).
+// Set the callback data of an object in the table (Qnil removes it). Returns 0 if the data could not be stored.
+// The caller is responsible for the write barrier.
+int Memory_Profiler_Object_Table_set_data(struct Memory_Profiler_Object_Table *table, VALUE object, VALUE data);
+
+// Set the weight of an object in the table (1 removes it). Returns 0 if the weight could not be stored.
+int Memory_Profiler_Object_Table_set_weight(struct Memory_Profiler_Object_Table *table, VALUE object, uint32_t weight);
+
+// Check whether an object might be in the table. False positives are possible, false negatives are not.
+// Safe to call during GC (no allocation, no probing).
+int Memory_Profiler_Object_Table_may_contain_p(struct Memory_Profiler_Object_Table *table, VALUE object);
+
+// Delete an object. May shrink the table. Safe to call from the NEWOBJ and FREEOBJ hooks, not from dcompact.
 void Memory_Profiler_Object_Table_delete(struct Memory_Profiler_Object_Table *table, VALUE object);
 
-// Delete by entry pointer (faster - no second lookup needed).
-// Safe to call from postponed job (not during GC).
-// entry must be a valid pointer from Object_Table_lookup.
-void Memory_Profiler_Object_Table_delete_entry(struct Memory_Profiler_Object_Table *table, struct Memory_Profiler_Object_Table_Entry *entry);
+// Delete an entry returned by lookup (faster - no second lookup needed).
+// If the table was modified since the lookup (e.g. the entry was migrated), the object is looked up again.
+// May shrink the table. Safe to call from the NEWOBJ and FREEOBJ hooks (e.g. during sweep), not from dcompact.
+void Memory_Profiler_Object_Table_delete_entry(struct Memory_Profiler_Object_Table *table, const struct Memory_Profiler_Object_Table_Entry *entry);
+
+// Delete every entry for which the predicate returns true (e.g. all entries of a class), in a single pass. Returns the number of entries deleted.
+// May shrink the table. Safe to call from the NEWOBJ and FREEOBJ hooks, not from dcompact.
+size_t Memory_Profiler_Object_Table_delete_if(struct Memory_Profiler_Object_Table *table, int (*predicate)(const struct Memory_Profiler_Object_Table_Entry *entry, void *arg), void *arg);
+
+// Subtract shift from the epoch of every entry, clamping at 0 (e.g. when the caller moves the base of its epochs forward).
+// Rewrites the entries in place, without allocating. Safe to call from the NEWOBJ and FREEOBJ hooks, not from dcompact.
+void Memory_Profiler_Object_Table_shift_epochs(struct Memory_Profiler_Object_Table *table, size_t shift);
 
-// Mark all entries for GC.
+// Call the callback for every entry, after finishing any incremental resize.
+// Entries inserted or deleted by the callback may or may not be visited.
+void Memory_Profiler_Object_Table_each(struct Memory_Profiler_Object_Table *table, void (*callback)(const struct Memory_Profiler_Object_Table_Entry *entry, void *arg), void *arg);
+
+// Mark the callback data for GC (classes are indices, retained by the caller).
 // Must be called from dmark callback.
 void Memory_Profiler_Object_Table_mark(struct Memory_Profiler_Object_Table *table);
 
@@ -57,6 +161,20 @@ void Memory_Profiler_Object_Table_mark(struct Memory_Profiler_Object_Table *tabl
 // Must be called from dcompact callback.
 void Memory_Profiler_Object_Table_compact(struct Memory_Profiler_Object_Table *table);
 
+// Finish any incremental resize, so that all entries are in the current slots.
+void Memory_Profiler_Object_Table_settle(struct Memory_Profiler_Object_Table *table);
+
 // Get current size
 size_t Memory_Profiler_Object_Table_size(struct Memory_Profiler_Object_Table *table);
 
+// Get the number of slots (excluding those of an incremental resize in progress).
+size_t Memory_Profiler_Object_Table_capacity(struct Memory_Profiler_Object_Table *table);
+
+// Get the number of deleted slots left as tombstones.
+size_t Memory_Profiler_Object_Table_tombstones(struct Memory_Profiler_Object_Table *table);
+
+// Get the memory used by the table.
+size_t Memory_Profiler_Object_Table_memsize(struct Memory_Profiler_Object_Table *table);
+
+// Get statistics about the table (size, capacity, tombstones, rebuild counts and memory usage) as a Hash.
+VALUE Memory_Profiler_Object_Table_statistics(struct Memory_Profiler_Object_Table *table);
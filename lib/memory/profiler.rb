@@ -5,6 +5,8 @@
 
 require_relative "profiler/version"
 require_relative "profiler/call_tree"
+require_relative "profiler/native_call_tree"
 require_relative "profiler/capture"
 require_relative "profiler/allocations"
 require_relative "profiler/sampler"
+require_relative "profiler/export"
@@ -9,6 +9,71 @@ module Memory
 		# Each node represents a frame in the call stack, with counts of how many
 		# allocations occurred at this point in the call path.
 		class CallTree
+			# Reports on a call tree, given `each_path` and `each_frame`.
+			#
+			# Shared by {CallTree} and {NativeCallTree}.
+			module Reporting
+				# Get the top N call paths by allocation count.
+				#
+				# @parameter limit [Integer] Maximum number of paths to return.
+				# @parameter by [Symbol] Sort by :total or :retained count.
+				# @returns [Array(Array)] Array of [locations, total_count, retained_count].
+				def top_paths(limit: 10, by: :retained)
+					paths = []
+					
+					each_path do |locations, total_count, retained_count|
+						paths << [locations, total_count, retained_count]
+					end
+					
+					# Sort by the requested metric (default: retained, since that's what matters for leaks)
+					sort_index = (by == :total) ? 1 : 2
+					paths.sort_by{|path_data| -path_data[sort_index]}.first(limit)
+				end
+				
+				# Get hotspot locations (individual frames with highest counts).
+				#
+				# @parameter limit [Integer] Maximum number of hotspots to return.
+				# @parameter by [Symbol] Sort by :total or :retained count.
+				# @returns [Hash] Map of location => [total_count, retained_count].
+				def hotspots(limit: 20, by: :retained)
+					frames = Hash.new{|h, k| h[k] = [0, 0]}
+					
+					each_frame do |location, total_count, retained_count|
+						frames[location][0] += total_count
+						frames[location][1] += retained_count
+					end
+					
+					# Sort by the requested metric
+					sort_index = (by == :total) ? 0 : 1
+					frames.sort_by{|_, counts| -counts[sort_index]}.first(limit).to_h
+				end
+				
+				# Convert call tree data to JSON-compatible hash.
+				#
+				# @returns [Hash] Call tree data as a hash.
+				def as_json(top_paths: {limit: 10}, hotspots: {limit: 20})
+					{
+						total_allocations: total_allocations,
+							retained_allocations: retained_allocations,
+							top_paths: top_paths(**top_paths).map{|path, total, retained| 
+								{path: path, total_count: total, retained_count: retained}
+							},
+							hotspots: hotspots(**hotspots).transform_values{|total, retained|
+								{total_count: total, retained_count: retained}
+							}
+					}
+				end
+				
+				# Convert call tree data to JSON string.
+				#
+				# @returns [String] Call tree data as JSON.
+				def to_json(...)
+					as_json.to_json(...)
+				end
+			end
+			
+			include Reporting
+			
 			# Represents a node in the call tree.
 			#
 			# Each node tracks how many allocations occurred at a specific point in a call path.
@@ -182,38 +247,22 @@ module Memory
 				current
 			end
 			
-			# Get the top N call paths by allocation count.
+			# Enumerate all call paths (ending at a leaf) with their counts.
 			#
-			# @parameter limit [Integer] Maximum number of paths to return.
-			# @parameter by [Symbol] Sort by :total or :retained count.
-			# @returns [Array(Array)] Array of [locations, total_count, retained_count].
-			def top_paths(limit: 10, by: :retained)
-				paths = []
-				
+			# @yields {|locations, total_count, retained_count| ...} For each path, with its location strings innermost first.
+			def each_path
 				@root.each_path do |path, total_count, retained_count|
 					# Filter out root node (has nil location) and map to location strings
 					locations = path.select(&:location).map{|node| node.location.to_s}
-					paths << [locations, total_count, retained_count] unless locations.empty?
+					yield locations, total_count, retained_count unless locations.empty?
 				end
-				
-				# Sort by the requested metric (default: retained, since that's what matters for leaks)
-				sort_index = (by == :total) ? 1 : 2
-				paths.sort_by{|path_data| -path_data[sort_index]}.first(limit)
 			end
 			
-			# Get hotspot locations (individual frames with highest counts).
+			# Enumerate all frames (nodes other than the root) with their counts.
 			#
-			# @parameter limit [Integer] Maximum number of hotspots to return.
-			# @parameter by [Symbol] Sort by :total or :retained count.
-			# @returns [Hash] Map of location => [total_count, retained_count].
-			def hotspots(limit: 20, by: :retained)
-				frames = Hash.new{|h, k| h[k] = [0, 0]}
-				
-				collect_frames(@root, frames)
-				
-				# Sort by the requested metric
-				sort_index = (by == :total) ? 0 : 1
-				frames.sort_by{|_, counts| -counts[sort_index]}.first(limit).to_h
+			# @yields {|location, total_count, retained_count| ...} For each frame, with its location string.
+			def each_frame(&block)
+				collect_frames(@root, &block)
 			end
 			
 			# Total number of allocations tracked.
@@ -245,40 +294,15 @@ module Memory
 				@root.prune!(limit)
 			end
 			
-			# Convert call tree data to JSON-compatible hash.
-			#
-			# @returns [Hash] Call tree data as a hash.
-			def as_json(top_paths: {limit: 10}, hotspots: {limit: 20})
-				{
-					total_allocations: total_allocations,
-						retained_allocations: retained_allocations,
-						top_paths: top_paths(**top_paths).map{|path, total, retained| 
-							{path: path, total_count: total, retained_count: retained}
-						},
-						hotspots: hotspots(**hotspots).transform_values{|total, retained|
-							{total_count: total, retained_count: retained}
-						}
-				}
-			end
-			
-			# Convert call tree data to JSON string.
-			#
-			# @returns [String] Call tree data as JSON.
-			def to_json(...)
-				as_json.to_json(...)
-			end
-			
 		private
 			
-			def collect_frames(node, frames)
+			def collect_frames(node, &block)
 				# Skip root node (has no location)
 				if node.location
-					location_str = node.location.to_s
-					frames[location_str][0] += node.total_count
-					frames[location_str][1] += node.retained_count
+					yield node.location.to_s, node.total_count, node.retained_count
 				end
 				
-				node.each_child{|child| collect_frames(child, frames)}
+				node.each_child{|child| collect_frames(child, &block)}
 			end
 		end
 	end
@@ -3,4 +3,5 @@
 # Released under the MIT License.
 # Copyright, 2025, by Samuel Williams.
 
-require_relative "native"
\ No newline at end of file
+require_relative "native"
+require_relative "native_call_tree"
\ No newline at end of file
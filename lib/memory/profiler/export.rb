@@ -0,0 +1,85 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+module Memory
+	module Profiler
+		# Reads the counters a capture exports to a shared memory segment with {Capture#export}, e.g. from a sidecar process or a command line tool. Reading never interrupts the exporting process.
+		#
+		# This file doesn't depend on the native extension, so it can be loaded on its own.
+		module Export
+			# Identifies the segment ("MPRF"):
+			MAGIC = 0x4652504D
+			
+			# The version of the layout this reader understands:
+			VERSION = 1
+			
+			# The header fields following the magic number and version, each an unsigned 64-bit integer in native byte order:
+			FIELDS = [
+				:sequence,
+				:header_size, :class_size, :capacity,
+				:class_count, :tracked_count,
+				:pid,
+				:update_count, :updated_at,
+				:new_count, :free_count, :dropped_count, :folded_count,
+				:queue_size, :overflow_count, :annihilated_count, :drain_count, :peak_depth,
+				:table_size, :table_capacity, :table_tombstones, :table_memory_size,
+			].freeze
+			
+			HEADER_FORMAT = "L2Q#{FIELDS.size}"
+			
+			# A class record: a NUL terminated name, and its allocation and free counts:
+			CLASS_FORMAT = "Z112Q2"
+			
+			# Raised if the file is not a segment this reader understands, or is updated too often to read consistently.
+			class Error < StandardError
+			end
+			
+			# Read a consistent copy of the segment at the given path.
+			#
+			# The segment is updated with a sequence lock, so it is read again if it changed while it was being read.
+			#
+			# @parameter path [String] The path of the segment, as given to {Capture#export}.
+			# @parameter retries [Integer] How many times to read the segment before giving up.
+			# @returns [Hash] The header fields (see {FIELDS}), and `classes`, an array of `{name:, new_count:, free_count:}` hashes.
+			def self.read(path, retries: 100)
+				File.open(path, "rb") do |file|
+					retries.times do
+						data = file.pread(file.size, 0)
+						header = parse_header(data)
+						
+						# An odd sequence is an update in progress, and a different one an update since the copy was made:
+						if header[:sequence].even? && file.pread(8, 8).unpack1("Q") == header[:sequence]
+							return parse(data, header)
+						end
+						
+						Thread.pass
+					end
+				end
+				
+				raise Error, "Could not read a consistent copy of #{path}!"
+			end
+			
+			def self.parse_header(data)
+				if data.bytesize < 8 or data.unpack("L2") != [MAGIC, VERSION]
+					raise Error, "Not a version #{VERSION} memory profiler segment!"
+				end
+				
+				magic, version, *values = data.unpack(HEADER_FORMAT)
+				
+				return FIELDS.zip(values).to_h
+			end
+			
+			def self.parse(data, header)
+				classes = header[:class_count].times.map do |index|
+					name, new_count, free_count = data.unpack(CLASS_FORMAT, offset: header[:header_size] + index * header[:class_size])
+					
+					{name: name.force_encoding(Encoding::UTF_8), new_count: new_count, free_count: free_count}
+				end
+				
+				return header.merge(classes: classes)
+			end
+		end
+	end
+end
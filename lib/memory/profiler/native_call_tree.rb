@@ -0,0 +1,17 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+require_relative "native"
+require_relative "call_tree"
+
+module Memory
+	module Profiler
+		# Ruby extensions to the C-defined NativeCallTree class.
+		# The base NativeCallTree class is defined in the C extension, and is obtained with {Capture#call_tree}.
+		class NativeCallTree
+			include CallTree::Reporting
+		end
+	end
+end
@@ -9,6 +9,7 @@ require "objspace"
 require_relative "capture"
 require_relative "allocations"
 require_relative "call_tree"
+require_relative "native_call_tree"
 
 module Memory
 	module Profiler
@@ -95,15 +96,18 @@ module Memory
 			# @parameter prune_limit [Integer] Keep only top N children per node during pruning (default: 5).
 			# @parameter prune_threshold [Integer] Number of insertions before auto-pruning (nil = no auto-pruning).
 			# @parameter gc [Hash | Nil] Run GC with these options before each sample (nil = don't run GC).
-			def initialize(depth: 4, filter: nil, increases_threshold: 10, prune_limit: 5, prune_threshold: nil, gc: nil)
+			# @parameter sample_rate [Float | Nil] Record only this fraction of allocations, scaling counts accordingly (nil = record every allocation).
+			# @parameter native [Boolean] Record call paths in a native call tree, without running Ruby code for each allocation (the filter is not applied).
+			def initialize(depth: 4, filter: nil, increases_threshold: 10, prune_limit: 5, prune_threshold: nil, gc: nil, sample_rate: nil, native: false)
 				@depth = depth
 				@filter = filter || default_filter
 				@increases_threshold = increases_threshold
 				@prune_limit = prune_limit
 				@prune_threshold = prune_threshold
 				@gc = gc
+				@native = native
 				
-				@capture = Capture.new
+				@capture = Capture.new(sample_rate: sample_rate)
 				@call_trees = {}
 				@samples = {}
 			end
@@ -117,6 +121,9 @@ module Memory
 			# @attribute [Integer] The number of increases before enabling detailed tracking.
 			attr :increases_threshold
 			
+			# @attribute [Boolean] Whether call paths are recorded in a native call tree.
+			attr :native
+			
 			# @attribute [Integer] The number of insertions before auto-pruning (nil = no auto-pruning).
 			attr :prune_limit
 			
@@ -224,7 +231,15 @@ module Memory
 			# Start tracking with call path analysis.
 			#
 			# @parameter klass [Class] The class to track with detailed analysis.
-			def track(klass, allocations = nil, filter: @filter, depth: @depth)
+			def track(klass, allocations = nil, filter: @filter, depth: @depth, native: @native)
+				if native
+					# Call paths are captured and recorded in a native call tree, including frees:
+					tracked = @capture.track(klass, depth: depth)
+					@call_trees[klass] = @capture.call_tree(klass)
+					
+					return allocations || tracked
+				end
+				
 				# Track the class and get the allocations object
 				allocations ||= @capture.track(klass)
 				
@@ -47,6 +47,78 @@ describe Memory::Profiler::Allocations do
 		end
 	end
 	
+	with "#track_batch" do
+		let(:capture) {Memory::Profiler::Capture.new}
+		
+		it "invokes the callback once per batch of events" do
+			batches = []
+			
+			capture.track(String).track_batch do |events|
+				batches << events.dup
+				
+				# Store a value for each allocation, which is passed back when it is freed:
+				events.each_slice(3).map do |klass, kind, data|
+					kind == :newobj ? :allocated : nil
+				end
+			end
+			
+			capture.start
+			
+			# Allocates many strings without checking for interrupts, so they are processed in one drain:
+			strings = ("x" * 1000).chars
+			strings = nil
+			GC.start
+			
+			capture.stop
+			
+			events = batches.flatten.each_slice(3).to_a
+			allocated = events.select{|klass, kind, data| kind == :newobj}
+			freed = events.select{|klass, kind, data| kind == :freeobj}
+			
+			expect(allocated.size).to be >= 1000
+			expect(batches.size).to be < allocated.size / 10
+			expect(allocated.map(&:first).uniq).to be == [String]
+			
+			expect(freed.size).to be > 500
+			expect(freed.map(&:last).uniq).to be == [:allocated]
+		end
+	end
+	
+	with "#lifetime_histogram" do
+		let(:capture) {Memory::Profiler::Capture.new}
+		let(:klass) {Class.new}
+		
+		it "is empty without frees" do
+			expect(allocations.lifetime_histogram).to be == []
+		end
+		
+		it "buckets freed objects by the number of GCs they lived through" do
+			capture.track(klass)
+			capture.start
+			
+			# Short-lived objects, freed by the first GC:
+			1000.times{klass.new}
+			GC.start
+			
+			# Long-lived objects, freed after 5 GCs:
+			retained = 1000.times.map{klass.new}
+			4.times{GC.start}
+			retained = nil
+			GC.start
+			
+			capture.stop
+			
+			allocations = capture[klass]
+			histogram = allocations.lifetime_histogram
+			
+			expect(histogram.sum).to be == allocations.free_count
+			expect(histogram[1]).to be >= 500
+			
+			# 4-7 GCs:
+			expect(histogram[3]).to be >= 500
+		end
+	end
+	
 	with "integration with Capture" do
 		it "returns correct JSON from captured allocations" do
 			capture = Memory::Profiler::Capture.new
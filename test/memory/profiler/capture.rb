@@ -8,6 +8,356 @@ require "memory/profiler/capture"
 describe Memory::Profiler::Capture do
 	let(:capture) {subject.new}
 	
+	with "#initialize" do
+		it "records every allocation by default" do
+			expect(capture.sample_rate).to be == 1.0
+		end
+		
+		it "rejects invalid sample rates" do
+			expect{subject.new(sample_rate: 0)}.to raise_exception(ArgumentError)
+			expect{subject.new(sample_rate: 1.5)}.to raise_exception(ArgumentError)
+		end
+	end
+	
+	with "sample_rate: 0.01" do
+		let(:capture) {subject.new(sample_rate: 0.01)}
+		
+		it "rounds the sample rate to one in N allocations" do
+			expect(capture.sample_rate).to be == 0.01
+		end
+		
+		it "scales sampled counts to unbiased estimates" do
+			capture.track(Hash)
+			capture.start
+			
+			retained = 100_000.times.map{Hash.new}
+			
+			capture.stop
+			
+			# Each sampled allocation is weighted by 100:
+			expect(capture.new_count % 100).to be == 0
+			
+			count = capture.retained_count_of(Hash)
+			expect(count).to be >= retained.size / 2
+			expect(count).to be <= retained.size * 2
+		end
+	end
+	
+	with "track_all: false" do
+		let(:capture) {subject.new(track_all: false)}
+		
+		it "is not tracking all classes" do
+			expect(capture.track_all?).to be == false
+		end
+		
+		it "only records explicitly tracked classes" do
+			capture.track(Hash)
+			capture.start
+			
+			hashes = 10.times.map{Hash.new}
+			arrays = 10.times.map{Array.new}
+			
+			capture.stop
+			
+			expect(capture.retained_count_of(Hash)).to be >= 10
+			expect(capture.tracking?(Array)).to be == false
+			expect(capture.retained_count_of(Array)).to be == 0
+		end
+		
+		it "stops recording a class after untrack" do
+			capture.track(Hash)
+			capture.start
+			
+			Hash.new
+			capture.untrack(Hash)
+			hashes = 10.times.map{Hash.new}
+			
+			capture.stop
+			
+			expect(capture.tracking?(Hash)).to be == false
+			expect(capture.retained_count_of(Hash)).to be == 0
+		end
+	end
+	
+	with "weak_events: true" do
+		let(:capture) {subject.new(weak_events: true)}
+		
+		it "holds queued objects weakly" do
+			expect(capture.weak_events?).to be == true
+		end
+		
+		it "cancels allocations freed before they are processed" do
+			capture.track(Hash)
+			
+			# Allocates hashes and collects them while the event queue is being processed, so their events are still pending:
+			other = subject.new
+			other.track(Object) do |klass, event, data|
+				if event == :newobj
+					100.times{Hash.new}
+					GC.start
+				end
+				
+				nil
+			end
+			
+			before = Memory::Profiler::Events.statistics
+			
+			capture.start
+			other.start
+			Object.new
+			other.stop
+			capture.stop
+			
+			after = Memory::Profiler::Events.statistics
+			
+			expect(after[:annihilated_count] - before[:annihilated_count]).to be >= 50
+			expect(capture.new_count).to be >= 100
+			expect(capture.retained_count_of(Hash)).to be <= 50
+		end
+		
+		it "cancels allocations freed during the final drain" do
+			capture = subject.new(weak_events: true, track_all: false)
+			drain_event_budget = Memory::Profiler::Events.drain_event_budget
+			Memory::Profiler::Events.drain_event_budget = 10
+			
+			# Collects garbage while stopping, when the remaining events are processed:
+			stopping = false
+			collected = false
+			capture.track(String) do |klass, event, data|
+				if stopping && !collected
+					collected = true
+					GC.start
+				end
+				
+				nil
+			end
+			
+			capture.start
+			
+			# Allocates many strings without checking for interrupts, most of which are still queued:
+			("x" * 1000).chars.clear
+			
+			before = Memory::Profiler::Events.statistics
+			
+			stopping = true
+			capture.stop
+			
+			after = Memory::Profiler::Events.statistics
+			
+			count = 0
+			capture.each_object(String){count += 1}
+			
+			expect(collected).to be == true
+			expect(after[:annihilated_count] - before[:annihilated_count]).to be >= 500
+			expect(count).to be < 500
+		ensure
+			Memory::Profiler::Events.drain_event_budget = drain_event_budget
+		end
+		
+		it "records objects that survive until they are processed" do
+			capture.track(Hash)
+			capture.start
+			
+			hashes = 10.times.map{Hash.new}
+			
+			capture.stop
+			
+			expect(capture.retained_count_of(Hash)).to be >= 10
+		end
+	end
+	
+	with "#stacks" do
+		let(:klass) {Class.new}
+		
+		def allocate(count)
+			count.times.map{klass.new}
+		end
+		
+		it "records each unique allocation stack once" do
+			capture.track(klass, depth: 4)
+			capture.start
+			
+			objects = allocate(10)
+			objects.concat(allocate(10))
+			
+			capture.stop
+			
+			stacks = capture.stacks(klass)
+			expect(stacks.size).to be == 1
+			
+			locations, count, retained_count = stacks.first
+			expect(locations.size).to be == 4
+			expect(locations.any?{|location| location.include?("#{__FILE__}:") && location.include?("allocate")}).to be == true
+			expect(count).to be == 20
+			expect(retained_count).to be == 20
+			
+			expect(capture.statistics[:stack_table_size]).to be == 1
+		end
+		
+		it "counts frees against the allocation stack" do
+			capture.track(klass, depth: 4)
+			capture.start
+			
+			allocate(100)
+			GC.start
+			
+			capture.stop
+			
+			_locations, count, retained_count = capture.stacks(klass).first
+			expect(count).to be == 100
+			expect(retained_count).to be < 100
+		end
+		
+		it "captures stacks for classes with callbacks" do
+			capture.track(klass, depth: 2) {|klass, event, data| event}
+			capture.start
+			
+			objects = allocate(10)
+			
+			capture.stop
+			
+			stacks = capture.stacks(klass)
+			expect(stacks.sum{|_locations, count, _retained_count| count}).to be == 10
+		end
+		
+		it "is empty for classes tracked without a depth" do
+			capture.track(klass)
+			capture.start
+			
+			objects = allocate(10)
+			
+			capture.stop
+			
+			expect(capture.stacks(klass)).to be == []
+		end
+		
+		it "rejects invalid depths" do
+			expect{capture.track(klass, depth: -1)}.to raise_exception(ArgumentError)
+			expect{capture.track(klass, depth: 100_000)}.to raise_exception(ArgumentError)
+		end
+	end
+	
+	with "#call_tree" do
+		let(:klass) {Class.new}
+		
+		def allocate(count)
+			count.times.map{klass.new}
+		end
+		
+		it "is nil for classes tracked without a depth" do
+			capture.track(klass)
+			
+			expect(capture.call_tree(klass)).to be == nil
+			expect(capture.call_tree(Class.new)).to be == nil
+		end
+		
+		it "records allocation paths" do
+			capture.track(klass, depth: 4)
+			capture.start
+			
+			objects = allocate(10)
+			
+			capture.stop
+			
+			tree = capture.call_tree(klass)
+			expect(tree).to be_a(Memory::Profiler::NativeCallTree)
+			expect(tree.total_allocations).to be == 10
+			expect(tree.retained_allocations).to be == 10
+			expect(tree.insertion_count).to be == 10
+			
+			paths = tree.top_paths(limit: 10)
+			expect(paths.size).to be == 1
+			
+			locations, total_count, retained_count = paths.first
+			expect(locations.size).to be == 4
+			expect(total_count).to be == 10
+			expect(retained_count).to be == 10
+			
+			hotspots = tree.hotspots(limit: 20)
+			expect(hotspots.keys.any?{|location| location.include?("allocate")}).to be == true
+			
+			expect(tree.as_json).to have_keys(
+				total_allocations: be == 10,
+				retained_allocations: be == 10,
+				top_paths: be_a(Array),
+				hotspots: be_a(Hash)
+			)
+		end
+		
+		it "decrements retained counts when objects are freed" do
+			capture.track(klass, depth: 4)
+			capture.start
+			
+			allocate(100)
+			GC.start
+			
+			capture.stop
+			
+			tree = capture.call_tree(klass)
+			expect(tree.total_allocations).to be == 100
+			expect(tree.retained_allocations).to be < 100
+		end
+		
+		it "can prune and clear the tree" do
+			capture.track(klass, depth: 4)
+			capture.start
+			
+			retained = allocate(10)
+			3.times.map{klass.new}
+			
+			capture.stop
+			
+			tree = capture.call_tree(klass)
+			node_count = tree.node_count
+			
+			expect(tree.prune!(1)).to be > 0
+			expect(tree.node_count).to be < node_count
+			expect(tree.top_paths.size).to be == 1
+			expect(tree.total_allocations).to be == 13
+			
+			tree.clear!
+			expect(tree.node_count).to be == 0
+			expect(tree.total_allocations).to be == 0
+			
+			# Objects recorded before clearing no longer count against the tree:
+			retained = nil
+			GC.start
+			capture.start
+			capture.stop
+			
+			expect(tree.retained_allocations).to be == 0
+		end
+	end
+	
+	with "#age_histogram" do
+		let(:klass) {Class.new}
+		
+		it "buckets live objects by the number of GCs they survived" do
+			capture.track(klass)
+			capture.start
+			
+			old = 10.times.map{klass.new}
+			4.times{GC.start}
+			young = 5.times.map{klass.new}
+			
+			histogram = capture.age_histogram(klass)
+			
+			capture.stop
+			
+			expect(histogram.sum).to be == 15
+			
+			# Minor GCs may run at any time, so the objects may be older than the explicit GCs alone would make them:
+			expect(histogram[0..1].sum).to be == 5
+			
+			# Survived at least 4 GCs:
+			expect(histogram[3..].sum).to be == 10
+		end
+		
+		it "returns nil for untracked classes" do
+			expect(capture.age_histogram(klass)).to be_nil
+		end
+	end
+	
 	with "#start" do
 		it "can start capturing" do
 			result = capture.start
@@ -129,6 +479,77 @@ describe Memory::Profiler::Capture do
 		end
 	end
 	
+	with "#free_count" do
+		it "ignores frees of objects that were never recorded" do
+			klass = Class.new
+			objects = 100.times.map{klass.new}
+			
+			capture.track(klass)
+			capture.start
+			
+			objects = nil
+			3.times{GC.start}
+			
+			capture.stop
+			
+			expect(capture[klass].free_count).to be == 0
+			
+			# The frees were discarded by the membership filter, rather than queued and looked up:
+			expect(capture.statistics[:filtered_count]).to be >= 100
+		end
+	end
+	
+	with "counts only" do
+		it "records classes without a callback" do
+			klass = Class.new
+			capture.track(klass)
+			capture.start
+			
+			retained = 100.times.map{klass.new}
+			100.times{klass.new}
+			
+			3.times{GC.start}
+			
+			capture.stop
+			
+			allocations = capture[klass]
+			expect(allocations.new_count).to be == 200
+			expect(allocations.free_count).to be > 0
+			expect(allocations.retained_count).to be >= 100
+		end
+		
+		it "doesn't overtake queued frees of reused addresses" do
+			capture = Memory::Profiler::Capture.new(track_all: false)
+			
+			# Frees of objects with data are queued, while allocations without a callback are recorded inline:
+			with_data = Class.new
+			without_callback = Class.new
+			
+			freed = 0
+			capture.track(with_data) do |klass, event, data|
+				freed += 1 if event == :freeobj
+				:data if event == :newobj
+			end
+			capture.track(without_callback)
+			capture.start
+			
+			200_000.times{with_data.new}
+			
+			# Lazy sweep hands the addresses of the freed objects to these allocations, before their frees are processed:
+			retained = 200_000.times.map{without_callback.new}
+			
+			GC.start
+			capture.stop
+			
+			expect(capture[with_data].free_count).to be == freed
+			expect(capture[without_callback].free_count).to be == 0
+			
+			count = 0
+			capture.each_object(without_callback){count += 1}
+			expect(count).to be == retained.size
+		end
+	end
+	
 	with "callback" do
 		it "calls callback on allocation" do
 			captured_classes = []
@@ -325,6 +746,28 @@ describe Memory::Profiler::Capture do
 			capture.stop
 		end
 		
+		it "continues processing after a callback raises" do
+			count = 0
+			capture.track(String) do |klass, event, data|
+				if event == :newobj
+					count += 1
+					raise "boom!" if count % 10 == 0
+				end
+			end
+			
+			capture.start
+			
+			# Allocates many strings without checking for interrupts, so they are processed in one batch:
+			strings = ("x" * 100).chars
+			
+			# The capture is not left paused by the exceptions:
+			more_strings = 50.times.map{"y" * 2}
+			
+			capture.stop
+			
+			expect(count).to be >= strings.size + more_strings.size
+		end
+		
 		it "handles callback allocating same tracked class" do
 			nested_count = 0
 			
@@ -348,6 +791,454 @@ describe Memory::Profiler::Capture do
 		end
 	end
 	
+	with "#statistics" do
+		it "includes event queue statistics" do
+			statistics = capture.statistics
+			
+			expect(statistics).to have_keys(
+				tracked_count: be_a(Integer),
+				object_table_size: be_a(Integer),
+				events: have_keys(
+					queue_size: be_a(Integer),
+					trigger_count: be_a(Integer),
+					trigger_skipped_count: be_a(Integer),
+				)
+			)
+		end
+		
+		it "coalesces postponed job triggers" do
+			capture.track(String){|klass, event, data| nil}
+			capture.start
+			
+			before = capture.statistics[:events]
+			
+			# Allocates many strings without checking for interrupts:
+			("x" * 1000).chars
+			
+			capture.stop
+			
+			after = capture.statistics[:events]
+			
+			expect(after[:trigger_skipped_count] - before[:trigger_skipped_count]).to be >= 900
+			expect(after[:trigger_count] - before[:trigger_count]).to be < 100
+		end
+		
+		it "doesn't trigger the postponed job while a run is pending" do
+			klass = Class.new
+			capture.track(klass){|klass, event, data| nil}
+			
+			threshold = Memory::Profiler::Events.trigger_threshold
+			Memory::Profiler::Events.trigger_threshold = 0
+			
+			capture.start
+			
+			before = capture.statistics[:events]
+			
+			10_000.times{klass.new}
+			
+			# Every event is processed by a run that was triggered once:
+			after = capture.statistics[:events]
+			
+			capture.stop
+			
+			triggers = after[:trigger_count] - before[:trigger_count]
+			drains = after[:drain_count] - before[:drain_count]
+			
+			expect(triggers).to be <= drains + 1
+			expect(after[:trigger_skipped_count] - before[:trigger_skipped_count] + triggers).to be >= 10_000
+		ensure
+			Memory::Profiler::Events.trigger_threshold = threshold
+		end
+		
+		it "records frees across object table growth" do
+			klass = Class.new
+			capture.track(klass)
+			capture.start
+			
+			# Nothing is collected until every object is in the (grown) table, and nothing refers to them, so they can all be freed:
+			GC.disable
+			50_000.times{klass.new}
+			size = capture.statistics[:object_table_size]
+			GC.enable
+			
+			GC.start
+			
+			capture.stop
+			
+			expect(size).to be >= 50_000
+			expect(capture[klass].new_count).to be == 50_000
+			
+			# A few may be kept alive by conservatively scanned stack slots:
+			expect(capture[klass].free_count).to be >= 49_000
+		end
+		
+		it "shrinks the object table when occupancy drops" do
+			klass = Class.new
+			capture.track(klass)
+			capture.start
+			
+			objects = 50_000.times.map{klass.new}
+			peak_capacity = capture.statistics[:object_table][:capacity]
+			
+			objects = nil
+			4.times{GC.start}
+			
+			statistics = capture.statistics[:object_table]
+			capture.stop
+			
+			expect(statistics).to have_keys(
+				size: be < 50_000,
+				capacity: be < peak_capacity,
+				tombstones: be_a(Integer),
+				grow_count: be > 0,
+				shrink_count: be > 0,
+				purge_count: be_a(Integer),
+			)
+		end
+		
+		it "finds objects while the object table is resizing" do
+			klass = Class.new
+			capture.track(klass)
+			capture.start
+			
+			objects = []
+			until capture.statistics[:object_table][:migrating_count] > 0
+				objects << klass.new
+				raise "Object table did not resize!" if objects.size > 100_000
+			end
+			
+			count = 0
+			capture.each_object(klass){count += 1}
+			expect(count).to be == objects.size
+			expect(capture.statistics[:object_table][:migrating_count]).to be == 0
+			
+			capture.stop
+			
+			expect(capture[klass].retained_count).to be == objects.size
+		end
+		
+		it "keeps recorded objects after stopping" do
+			klass = Class.new
+			capture.track(klass)
+			capture.start
+			
+			objects = 1000.times.map{klass.new}
+			
+			capture.stop
+			
+			found = []
+			capture.each_object(klass){|object, allocations| found << object}
+			
+			expect(found.size).to be == 1000
+			expect(found.all?(klass)).to be == true
+			
+			# The objects are not retained by the stopped capture, which removes them as they are freed:
+			objects = found = nil
+			4.times{GC.start}
+			
+			live = ObjectSpace.each_object(klass).count
+			
+			count = 0
+			capture.each_object(klass){count += 1}
+			
+			expect(live).to be < 1000
+			expect(count).to be <= live
+			
+			# Counts stop with the capture:
+			expect(capture[klass].retained_count).to be == 1000
+			
+			capture.clear
+			
+			count = 0
+			capture.each_object{count += 1}
+			expect(count).to be == 0
+		end
+		
+		it "yields each object once while the block allocates" do
+			klass = Class.new
+			capture.track(klass)
+			capture.start
+			
+			objects = 1000.times.map{klass.new}
+			
+			# The allocations grow the table while it is iterated:
+			found = []
+			capture.each_object(klass) do |object, allocations|
+				found << object
+				objects.concat(100.times.map{klass.new})
+			end
+			
+			capture.stop
+			
+			expect(found.size).to be == 1000
+			expect(found.uniq.size).to be == 1000
+		end
+		
+		it "can't be stopped or cleared while iterating" do
+			klass = Class.new
+			capture.track(klass)
+			capture.start
+			
+			objects = 10.times.map{klass.new}
+			
+			count = 0
+			expect do
+				capture.each_object(klass) do |object, allocations|
+					count += 1
+					capture.stop
+				end
+			end.to raise_exception(RuntimeError, message: be =~ /iterating/)
+			
+			expect(count).to be == 1
+			expect(capture.stop).to be == true
+			
+			expect do
+				capture.each_object(klass){capture.clear}
+			end.to raise_exception(RuntimeError, message: be =~ /iterating/)
+			
+			# Once the iteration is over:
+			capture.clear
+			expect(capture[klass].new_count).to be == 0
+		end
+		
+		it "stores tracked objects compactly" do
+			klass = Class.new
+			capture.track(klass){|klass, event, data| :allocated if event == :newobj}
+			capture.track(Array)
+			capture.start
+			
+			tagged = 1000.times.map{klass.new}
+			objects = 100_000.times.map{Array.new}
+			
+			statistics = capture.statistics[:object_table]
+			capture.stop
+			
+			# Only objects with callback data use the data map:
+			expect(statistics[:size]).to be >= 101_000
+			expect(statistics[:data_size]).to be == 1000
+			expect(statistics[:memory_size].to_f / statistics[:capacity]).to be < 12
+		end
+		
+		it "releases the callback data of freed objects" do
+			klass = Class.new
+			capture.track(klass){|klass, event, data| :allocated if event == :newobj}
+			capture.start
+			
+			objects = 10_000.times.map{klass.new}
+			peak = capture.statistics[:object_table]
+			
+			objects = nil
+			4.times{GC.start}
+			
+			statistics = capture.statistics[:object_table]
+			capture.stop
+			
+			# Data is kept in a dense vector, which shrinks so that marking only visits live data:
+			expect(peak[:data_size]).to be == 10_000
+			expect(statistics[:data_size]).to be < 10_000
+			expect(statistics[:data_capacity]).to be < peak[:data_capacity]
+		end
+		
+		it "removes the objects of an untracked class" do
+			# Otherwise, queued allocations would track the class again:
+			capture = subject.new(track_all: false)
+			klass = Class.new
+			other = Class.new
+			capture.track(klass){|klass, event, data| :allocated if event == :newobj}
+			capture.track(other)
+			capture.start
+			
+			objects = 10_000.times.map{klass.new}
+			others = 1000.times.map{other.new}
+			
+			capture.untrack(klass)
+			
+			statistics = capture.statistics[:object_table]
+			
+			count = 0
+			capture.each_object(klass){count += 1}
+			expect(count).to be == 0
+			
+			found = []
+			capture.each_object(other){|object, allocations| found << object}
+			expect(found.size).to be == 1000
+			
+			capture.stop
+			
+			# The class's entries and their data are dropped at once, instead of lingering until the objects are freed:
+			expect(statistics[:size]).to be == 1000
+			expect(statistics[:data_size]).to be == 0
+			expect(statistics[:shrink_count]).to be > 0
+		end
+	end
+	
+	with "event queue memory limit" do
+		def before
+			super
+			
+			@memory_limit = Memory::Profiler::Events.memory_limit
+			@overflow_policy = Memory::Profiler::Events.overflow_policy
+			
+			# A single segment:
+			Memory::Profiler::Events.memory_limit = 64 * 1024
+		end
+		
+		def after(error = nil)
+			Memory::Profiler::Events.memory_limit = @memory_limit
+			Memory::Profiler::Events.overflow_policy = @overflow_policy
+			
+			super
+		end
+		
+		def allocate_strings
+			capture.track(String){|klass, event, data| nil}
+			capture.start
+			
+			# Allocates many strings without checking for interrupts:
+			strings = ("x" * 10_000).chars
+			
+			capture.stop
+			
+			return strings
+		end
+		
+		it "counts events beyond the limit" do
+			before = capture.statistics[:events]
+			
+			allocate_strings
+			
+			after = capture.statistics[:events]
+			
+			expect(after[:overflow_count]).to be > before[:overflow_count]
+			expect(after[:peak_depth]).to be >= 4000
+			expect(after[:memory_limit]).to be == 64 * 1024
+		end
+		
+		it "drops events beyond the limit" do
+			Memory::Profiler::Events.overflow_policy = :drop
+			
+			strings = allocate_strings
+			
+			expect(capture.statistics[:dropped_count]).to be > 5000
+			expect(capture.retained_count_of(String)).to be < strings.size
+		end
+		
+		it "samples events beyond half the limit" do
+			Memory::Profiler::Events.overflow_policy = :sample
+			
+			strings = allocate_strings
+			
+			expect(capture.statistics[:dropped_count]).to be > 5000
+		end
+		
+		it "weights sampled events by the inverse of their probability" do
+			Memory::Profiler::Events.memory_limit = 4 * 64 * 1024
+			Memory::Profiler::Events.overflow_policy = :sample
+			
+			capture.track(String){|klass, event, data| nil}
+			capture.start
+			
+			# Allocates many strings without checking for interrupts:
+			strings = ("x" * 50_000).chars
+			
+			capture.stop
+			
+			# Most allocations were rejected, but each admitted one stands for those rejected in its place:
+			expect(capture.statistics[:dropped_count]).to be > 20_000
+			expect(capture[String].new_count).to be > 40_000
+			expect(capture[String].new_count).to be < 60_000
+			expect(capture[String].retained_count).to be == capture[String].new_count
+		end
+		
+		it "records events beyond the limit synchronously" do
+			Memory::Profiler::Events.overflow_policy = :synchronous
+			
+			strings = allocate_strings
+			
+			expect(capture.statistics[:dropped_count]).to be == 0
+			expect(capture.retained_count_of(String)).to be >= strings.size
+		end
+		
+		it "releases idle segments" do
+			Memory::Profiler::Events.memory_limit = 0
+			
+			allocate_strings
+			
+			expect(capture.statistics[:events][:memory_size]).to be <= 2 * 64 * 1024 + 1024
+		end
+		
+		it "rejects invalid overflow policies" do
+			expect{Memory::Profiler::Events.overflow_policy = :invalid}.to raise_exception(ArgumentError)
+		end
+	end
+	
+	with "event queue drain budget" do
+		def before
+			super
+			
+			@drain_event_budget = Memory::Profiler::Events.drain_event_budget
+			@drain_time_budget = Memory::Profiler::Events.drain_time_budget
+		end
+		
+		def after(error = nil)
+			Memory::Profiler::Events.drain_event_budget = @drain_event_budget
+			Memory::Profiler::Events.drain_time_budget = @drain_time_budget
+			
+			super
+		end
+		
+		it "carries events over to later drains" do
+			Memory::Profiler::Events.drain_event_budget = 100
+			
+			count = 0
+			capture.track(String){|klass, event, data| count += 1 if event == :newobj; nil}
+			capture.start
+			
+			before = capture.statistics[:events]
+			
+			# Allocates many strings without checking for interrupts:
+			strings = ("x" * 10_000).chars
+			
+			# Each drain processes at most 100 events:
+			expect(count).to be <= 100 + 10
+			
+			capture.stop
+			
+			# Stopping processes everything, regardless of the budget:
+			expect(count).to be >= strings.size
+			
+			after = capture.statistics[:events]
+			expect(after[:drain_deferred_count]).to be > before[:drain_deferred_count]
+			expect(after[:drain_histogram].sum - before[:drain_histogram].sum).to be == after[:drain_count] - before[:drain_count]
+		end
+		
+		it "drains carried over events without further enqueues" do
+			Memory::Profiler::Events.drain_event_budget = 10
+			
+			count = 0
+			capture.track(String){|klass, event, data| count += 1 if event == :newobj; nil}
+			capture.start
+			
+			# Allocates many strings without checking for interrupts:
+			strings = ("x" * 1000).chars
+			
+			# Without allocating any strings, each garbage collection resumes the backlog:
+			500.times do
+				break if count >= strings.size
+				GC.start
+			end
+			
+			expect(count).to be >= strings.size
+			expect(capture.statistics[:events][:drain_deferred_count]).to be > 0
+			
+			capture.stop
+		end
+		
+		it "rejects negative time budgets" do
+			expect{Memory::Profiler::Events.drain_time_budget = -1}.to raise_exception(ArgumentError)
+		end
+	end
+	
 	with "#new_count, #free_count, #retained_count" do
 		it "tracks total allocations across all classes" do
 			capture.start
@@ -482,6 +1373,66 @@ describe Memory::Profiler::Capture do
 		end
 	end
 	
+	with "#folded" do
+		def allocate_anonymous(count)
+			count.times do
+				klass = Class.new
+				3.times{klass.new}
+			end
+			
+			return nil
+		end
+		
+		it "folds the allocations of freed classes by name" do
+			capture.start
+			
+			allocate_anonymous(100)
+			4.times{GC.start}
+			
+			capture.stop
+			
+			# Most anonymous classes are freed, and their allocations are folded under their superclass's name:
+			folded = capture.folded["Object"]
+			expect(folded).to be_a(Memory::Profiler::Allocations)
+			expect(folded.new_count).to be >= 150
+			expect(capture.statistics[:folded_count]).to be >= 50
+			
+			# Freed classes are no longer tracked:
+			anonymous = capture.each.count{|klass, allocations| klass.name.nil?}
+			expect(anonymous).to be < 50
+		end
+		
+		it "discards folded allocations on clear" do
+			capture.start
+			allocate_anonymous(100)
+			4.times{GC.start}
+			capture.stop
+			
+			capture.clear
+			
+			expect(capture.folded).to be == {}
+		end
+		
+		it "reuses the registry indices of folded classes" do
+			capture.start
+			
+			10.times do
+				allocate_anonymous(100)
+				2.times{GC.start}
+				
+				# Folds the freed classes, and releases those folded by an earlier round:
+				capture.folded
+			end
+			
+			# 1000 classes were created, but only a few rounds' worth are ever in the registry at once (it is only pruned once stopped):
+			statistics = capture.statistics
+			expect(statistics[:folded_count]).to be >= 500
+			expect(statistics[:class_registry_size]).to be < 300
+		ensure
+			capture.stop
+		end
+	end
+	
 	with "GC stress test" do
 		it "handles GC during tracking with callbacks that store state" do
 			# This test attempts to recreate the T_NONE marking bug
@@ -600,6 +1551,51 @@ describe Memory::Profiler::Capture do
 			end
 		end
 		
+		it "purges tombstones left by GC compaction" do
+			klass = Class.new
+			capture.track(klass)
+			capture.start
+			
+			objects = 10_000.times.map{klass.new}
+			
+			capture.stop
+			
+			begin
+				GC.verify_compaction_references(expand_heap: true, toward: :empty)
+			rescue NotImplementedError
+				skip "GC compaction not available"
+			end
+			
+			# A stopped capture never inserts again, so lookups of freed objects would otherwise probe through the tombstones:
+			table = capture.statistics[:object_table]
+			expect((table[:size] + table[:tombstones]) * 8).to be <= table[:capacity] * 7
+			
+			objects.clear
+		end
+		
+		it "finds moved objects after GC compaction" do
+			klass = Class.new
+			capture.track(klass){|klass, event, data| event == :newobj ? :allocated : nil}
+			capture.start
+			
+			objects = 1000.times.map{klass.new}
+			
+			begin
+				GC.verify_compaction_references(expand_heap: true, toward: :empty)
+			rescue NotImplementedError
+				skip "GC compaction not available"
+			end
+			
+			addresses = objects.map{|object| Memory::Profiler.address_of(object)}
+			found = []
+			capture.each_object(klass){|object, allocations| found << Memory::Profiler.address_of(object)}
+			
+			expect(found.sort).to be == addresses.sort
+			expect(capture.statistics[:object_table][:size]).to be >= 1000
+			
+			capture.stop
+		end
+		
 		it "handles GC compaction with FREEOBJ events and data" do
 			# This test specifically targets the bug where FREEOBJ events
 			# kept dying object pointers in object_states during compaction.
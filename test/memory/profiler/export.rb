@@ -0,0 +1,136 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+require "memory/profiler"
+require "tmpdir"
+
+describe Memory::Profiler::Export do
+	let(:capture) {Memory::Profiler::Capture.new}
+	let(:directory) {File.directory?("/dev/shm") ? "/dev/shm" : Dir.tmpdir}
+	let(:path) {File.join(directory, "memory-profiler-test-#{Process.pid}-#{object_id}")}
+	
+	after do
+		capture.export(nil)
+	end
+	
+	it "publishes the counters when exporting starts" do
+		capture.export(path)
+		
+		export = subject.read(path)
+		
+		expect(export).to have_keys(
+			pid: be == Process.pid,
+			capacity: be == 1024,
+			class_count: be == 0,
+			update_count: be == 1,
+			new_count: be == 0,
+		)
+	end
+	
+	it "publishes per class counts from the event hook" do
+		capture.track(Hash)
+		capture.export(path, interval: 0)
+		capture.start
+		
+		hashes = 10_000.times.map{Hash.new}
+		
+		export = subject.read(path)
+		
+		capture.stop
+		
+		expect(export[:update_count]).to be > 1
+		expect(export[:classes].any?{|record| record[:name] == "Hash" && record[:new_count] > 0}).to be == true
+		
+		# Stopping publishes the final counts:
+		export = subject.read(path)
+		hash = export[:classes].find{|record| record[:name] == "Hash"}
+		
+		expect(hash[:new_count]).to be == capture[Hash].new_count
+		expect(export[:new_count]).to be == capture.new_count
+	end
+	
+	it "truncates the tracked classes to the capacity" do
+		capture.track(Hash)
+		capture.track(Array)
+		capture.export(path, capacity: 1)
+		
+		export = subject.read(path)
+		
+		expect(export[:class_count]).to be == 1
+		expect(export[:tracked_count]).to be == 2
+	end
+	
+	it "creates the segment readable only by this user" do
+		capture.export(path)
+		
+		expect(File.stat(path).mode & 0o777).to be == 0o600
+	end
+	
+	it "refuses to replace an existing file" do
+		File.write(path, "Hello World")
+		
+		expect{capture.export(path)}.to raise_exception(Errno::EEXIST)
+		
+		# The file is neither truncated nor removed:
+		expect(File.read(path)).to be == "Hello World"
+	ensure
+		File.unlink(path) if File.exist?(path)
+	end
+	
+	it "refuses to follow a symbolic link" do
+		target = "#{path}.target"
+		File.symlink(target, path)
+		
+		expect{capture.export(path)}.to raise_exception(SystemCallError)
+		expect(File).not.to be(:exist?, target)
+	ensure
+		File.unlink(path) if File.symlink?(path)
+	end
+	
+	it "leaves a file that replaced the segment" do
+		capture.export(path)
+		
+		File.unlink(path)
+		File.write(path, "Hello World")
+		
+		capture.export(nil)
+		expect(File.read(path)).to be == "Hello World"
+	ensure
+		File.unlink(path) if File.exist?(path)
+	end
+	
+	it "removes the segment when exporting stops" do
+		capture.export(path)
+		expect(File).to be(:exist?, path)
+		
+		capture.export(nil)
+		expect(File).not.to be(:exist?, path)
+	end
+	
+	it "leaves the segment to the parent after fork" do
+		capture.export(path)
+		
+		pid = fork do
+			# The child inherits the capture, but must not update or remove the parent's segment:
+			capture.start
+			1000.times{Object.new}
+			capture.stop
+			capture.export(nil)
+		end
+		
+		Process.wait(pid)
+		
+		expect(File).to be(:exist?, path)
+		expect(subject.read(path)[:update_count]).to be == 1
+	end
+	
+	it "rejects files that are not segments" do
+		File.write(path, "Hello World")
+		
+		expect{subject.read(path)}.to raise_exception(Memory::Profiler::Export::Error)
+	ensure
+		File.unlink(path) if File.exist?(path)
+	end
+end
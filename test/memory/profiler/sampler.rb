@@ -221,6 +221,28 @@ describe Memory::Profiler::Sampler do
 			
 			sampler.stop
 		end
+		
+		it "returns the allocations it tracks" do
+			allocations = sampler.capture.track(Hash)
+			
+			expect(sampler.track(Hash, allocations)).to be(:equal?, allocations)
+			expect(sampler.call_tree(Hash)).to be_a(Memory::Profiler::CallTree)
+		end
+		
+		it "records call paths natively when requested" do
+			sampler = subject.new(depth: 4, native: true)
+			
+			sampler.start
+			allocations = sampler.track(Hash)
+			
+			100.times{Hash.new}
+			
+			sampler.stop
+			
+			expect(allocations).to be_a(Memory::Profiler::Allocations)
+			expect(sampler.call_tree(Hash)).to be_a(Memory::Profiler::NativeCallTree)
+			expect(sampler.call_tree(Hash).total_allocations).to be >= 100
+		end
 	end
 	
 	with "#clear and #clear_all!" do
@@ -0,0 +1,73 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+require "memory/profiler"
+
+describe Memory::Profiler::Snapshot do
+	let(:capture) {Memory::Profiler::Capture.new}
+	let(:klass) {Class.new}
+	
+	def allocate(count)
+		count.times.map{klass.new}
+	end
+	
+	it "can't be created directly" do
+		expect{subject.new}.to raise_exception(TypeError)
+	end
+	
+	with "Capture#snapshot" do
+		it "records the live objects of each class" do
+			capture.track(klass)
+			capture.start
+			
+			objects = allocate(100)
+			snapshot = capture.snapshot
+			
+			capture.stop
+			
+			expect(snapshot).to be(:frozen?)
+			expect(snapshot.size).to be >= 100
+			expect(snapshot.counts[klass]).to be == 100
+			expect(snapshot.gc_count).to be <= GC.count
+		end
+	end
+	
+	with "#diff" do
+		it "counts added and removed objects per class" do
+			capture.track(klass)
+			capture.start
+			
+			@before = allocate(1000)
+			before = capture.snapshot
+			
+			@after = allocate(500)
+			@before = nil
+			3.times{GC.start}
+			
+			after = capture.snapshot
+			
+			capture.stop
+			
+			added, removed = before.diff(after)[klass]
+			expect(added).to be == 500
+			expect(removed).to be >= 500
+			
+			# The reverse comparison swaps them:
+			expect(after.diff(before)[klass]).to be == [removed, added]
+		end
+		
+		it "omits classes without changes" do
+			capture.track(klass)
+			capture.start
+			
+			objects = allocate(10)
+			snapshot = capture.snapshot
+			
+			capture.stop
+			
+			expect(snapshot.diff(snapshot)).to be == {}
+		end
+	end
+end